@@ -31,11 +31,82 @@
 #define STAMFS_MAX_BLOCK_NUMS_PER_BLOCK (STAMFS_BLOCK_SIZE / 4)
 #define STAMFS_MAX_BLOCKS_PER_FILE STAMFS_MAX_BLOCK_NUMS_PER_BLOCK
 #define STAMFS_MAX_FNAME_LEN    16
+#define STAMFS_MAX_LONG_FNAME_LEN 255 /* with STAMFS_FEATURE_INCOMPAT_LONG_NAMES. */
+/* the 2.4 buffer cache addresses blocks with an 'int'. */
+#define STAMFS_MAX_BLOCKS_COUNT 0x7fffffffUL
 
 /* special markers inside lists. */
 #define STAMFS_FREE_BLOCK_MARKER        (~(__u32)0)
 #define STAMFS_FREE_DIR_REC_MARKER      (~(__u32)0)
 
+/*
+ * super-block features. the feature fields of the super-block are only
+ * valid when its s_feature_magic field holds STAMFS_FEATURE_MAGIC - older
+ * file-systems have no feature fields at all.
+ * a kernel that does not know an 'incompat' feature must refuse to mount
+ * the file-system. a kernel that does not know a 'ro_compat' feature may
+ * only mount it read-only.
+ */
+#define STAMFS_FEATURE_MAGIC            0x5eafc0de
+
+#define STAMFS_FEATURE_INCOMPAT_LONG_NAMES 0x00000004 /* directories hold   */
+                                                   /* variable-length       */
+                                                   /* entries.              */
+
+/* the 'incompat' features supported by this version. */
+#define STAMFS_FEATURE_INCOMPAT_SUPP    (STAMFS_FEATURE_INCOMPAT_LONG_NAMES)
+
+#define STAMFS_FEATURE_RO_COMPAT_PARENT 0x00000001 /* inodes point to their */
+                                                   /* parent directory.     */
+#define STAMFS_FEATURE_RO_COMPAT_DIR_USAGE 0x00000002 /* directories hold   */
+                                                   /* their subtree's usage */
+                                                   /* (requires PARENT).    */
+#define STAMFS_FEATURE_RO_COMPAT_CHANGELOG 0x00000004 /* changes to inodes  */
+                                                   /* are logged.           */
+#define STAMFS_FEATURE_RO_COMPAT_LARGE_DIR 0x00000008 /* directories may span */
+                                                   /* several data blocks.  */
+#define STAMFS_FEATURE_RO_COMPAT_DIR_INDEX 0x00000010 /* large directories   */
+                                                   /* are indexed by a hash */
+                                                   /* of the names.         */
+#define STAMFS_FEATURE_RO_COMPAT_NAME_HASH 0x00000020 /* directory entries  */
+                                                   /* hold the hash of      */
+                                                   /* their names.          */
+#define STAMFS_FEATURE_RO_COMPAT_SORTED_DIR 0x00000040 /* directories may  */
+                                                   /* be sorted by name.    */
+#define STAMFS_FEATURE_RO_COMPAT_DIR_COUNT 0x00000080 /* directories may    */
+                                                   /* count their entries.  */
+#define STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS 0x00000100 /* inodes hold     */
+                                                   /* i_flags, i_dir_free_  */
+                                                   /* block and i_dir_      */
+                                                   /* entries - set by      */
+                                                   /* mkstamfs only, as     */
+                                                   /* older inodes may hold */
+                                                   /* garbage there.        */
+
+/* the 'ro_compat' features supported by this version. */
+#define STAMFS_FEATURE_RO_COMPAT_SUPP   (STAMFS_FEATURE_RO_COMPAT_PARENT | \
+                                         STAMFS_FEATURE_RO_COMPAT_DIR_USAGE | \
+                                         STAMFS_FEATURE_RO_COMPAT_CHANGELOG | \
+                                         STAMFS_FEATURE_RO_COMPAT_LARGE_DIR | \
+                                         STAMFS_FEATURE_RO_COMPAT_DIR_INDEX | \
+                                         STAMFS_FEATURE_RO_COMPAT_NAME_HASH | \
+                                         STAMFS_FEATURE_RO_COMPAT_SORTED_DIR | \
+                                         STAMFS_FEATURE_RO_COMPAT_DIR_COUNT | \
+                                         STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS)
+
+/*
+ * with STAMFS_FEATURE_RO_COMPAT_CHANGELOG, creations, unlinks, writes and
+ * truncations of inodes are logged, each with a sequence number, in a ring
+ * of contiguous blocks allocated by mkstamfs. once the ring is full, the
+ * oldest records are overwritten.
+ */
+#define STAMFS_CHANGELOG_DEFAULT_BLOCKS 16
+
+#define STAMFS_CHANGE_CREATE    1
+#define STAMFS_CHANGE_UNLINK    2
+#define STAMFS_CHANGE_WRITE     3
+#define STAMFS_CHANGE_TRUNCATE  4
+
 
 /* types with given sizes, to make a STAMFS more portable. */
 #ifdef __KERNEL__
@@ -46,7 +117,19 @@
 typedef uint8_t  __u8;
 typedef uint16_t __u16;
 typedef uint32_t __u32;
+typedef unsigned long long __u64;
+
+#endif
 
+/* on-disk data is little-endian. the user-space utilities assume a
+ * little-endian host. */
+#ifdef __KERNEL__
+#include <asm/byteorder.h>
+#define STAMFS_LE32_TO_CPU(x) le32_to_cpu(x)
+#define STAMFS_CPU_TO_LE32(x) cpu_to_le32(x)
+#else
+#define STAMFS_LE32_TO_CPU(x) (x)
+#define STAMFS_CPU_TO_LE32(x) (x)
 #endif
 
 /* data structures used to store STAMFS constructs on disk blocks. */
@@ -58,6 +141,21 @@ struct stamfs_super_block {
         __u32 s_free_blocks_count;
         __u32 s_free_list_block_num;
         __u32 s_highest_used_block_num;
+        /* the fields below are valid only if s_feature_magic is set. */
+        __u32 s_feature_magic;
+        __u32 s_feature_compat;
+        __u32 s_feature_incompat;
+        __u32 s_reserved1[3];   /* unused, always 0. */
+        __u32 s_feature_ro_compat;
+        /* the change log (STAMFS_FEATURE_RO_COMPAT_CHANGELOG): its first
+         * block and number of blocks, the slot of its next record, and the
+         * sequence number of its next record (the first one is 1). */
+        __u32 s_changelog_block_num;
+        __u32 s_reserved2;      /* unused, always 0. */
+        __u32 s_changelog_blocks;
+        __u32 s_changelog_head;
+        __u32 s_changelog_seq;
+        __u32 s_changelog_seq_hi;
 };
 
 struct stamfs_inode_index {
@@ -80,12 +178,40 @@ struct stamfs_inode {
         __u32 i_ctime;
         __u32 i_num_blocks;
         __u32 i_index_block;
+        __u32 i_reserved1[2];   /* unused, always 0. */
+        /* the parent directory (STAMFS_FEATURE_RO_COMPAT_PARENT), or 0 for
+         * the root and for unlinked inodes. */
+        __u32 i_parent_ino;
+        /* usage of the subtree rooted at this inode, including the inode
+         * itself (STAMFS_FEATURE_RO_COMPAT_DIR_USAGE). */
+        __u32 i_tree_bytes;
+        __u32 i_tree_bytes_hi;
+        __u32 i_tree_blocks;
+        __u32 i_tree_blocks_hi;
+        __u32 i_tree_inodes;
+        /* the fields below are only valid with
+         * STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS, and are taken as 0 without
+         * it. */
+        __u32 i_flags;          /* STAMFS_INODE_FL_*. */
+        /* a directory's first data block that may have room for an entry -
+         * just a hint, blocks below it are not searched for room. */
+        __u32 i_dir_free_block;
+        /* a directory's number of entries, if it has
+         * STAMFS_INODE_FL_COUNTED (STAMFS_FEATURE_RO_COMPAT_DIR_COUNT). */
+        __u32 i_dir_entries;
 };
 
 struct stamfs_inode_block_index {
         __u32 index[STAMFS_MAX_BLOCKS_PER_FILE];
 };
 
+/* inode flags (i_flags). */
+#define STAMFS_INODE_FL_SEALED  0x00000001 /* immutable, see STAMFS_IOC_SEAL. */
+#define STAMFS_INODE_FL_INDEX   0x00000002 /* directory with a hash index. */
+#define STAMFS_INODE_FL_SORTED  0x00000004 /* directory sorted by name, see */
+                                           /* STAMFS_IOC_SORT_DIR.          */
+#define STAMFS_INODE_FL_COUNTED 0x00000008 /* i_dir_entries is valid.       */
+
 #define STAMFS_DIR_REC_FTYPE_UNKNOWN    0
 #define STAMFS_DIR_REC_FTYPE_DIR        1
 #define STAMFS_DIR_REC_FTYPE_FILE       2
@@ -95,6 +221,229 @@ struct stamfs_dir_rec {
         __u8  dr_name_len;
         __u8  dr_ftype;
         char  dr_name[STAMFS_MAX_FNAME_LEN];
+        __u16 dr_hash;          /* STAMFS_FEATURE_RO_COMPAT_NAME_HASH. */
+};
+
+/* the number of entries in each data block of a directory. */
+#define STAMFS_DIR_RECS_PER_BLOCK \
+        (STAMFS_BLOCK_SIZE / sizeof(struct stamfs_dir_rec))
+
+/*
+ * with STAMFS_FEATURE_INCOMPAT_LONG_NAMES, the data blocks of directories
+ * hold variable-length entries instead: each entry takes de_rec_len bytes,
+ * up to the next entry, and the entries of a block cover all of it. an
+ * entry with de_ino 0 is unused. a removed entry is merged into the entry
+ * before it, and a new entry is carved out of the slack at the end of an
+ * existing one (or takes an unused entry).
+ */
+struct stamfs_dir_entry {
+        __u32 de_ino;
+        __u16 de_rec_len;
+        __u8  de_name_len;
+        __u8  de_ftype;
+        char  de_name[0];       /* de_name_len characters. */
 };
 
+/* the length of an entry with a name of the given length (4-byte aligned). */
+#define STAMFS_DIR_ENTRY_LEN(name_len) \
+        ((sizeof(struct stamfs_dir_entry) + (name_len) + 3) & ~3)
+
+/*
+ * with STAMFS_FEATURE_RO_COMPAT_NAME_HASH, every live entry also holds the
+ * hash of its name (see stamfs_dir_hash()), so a scan for a name compares
+ * a single word per entry, and compares the names themselves only when the
+ * hashes match. a fixed-length entry keeps the low 16 bits of the hash in
+ * dr_hash. a variable-length entry keeps all of it in a __u32 right after
+ * the name, at offset STAMFS_DIR_ENTRY_LEN(de_name_len) - so older versions
+ * can still read the entries.
+ */
+#define STAMFS_DIR_ENTRY_HASH_LEN(name_len) \
+        (STAMFS_DIR_ENTRY_LEN(name_len) + sizeof(__u32))
+
+/* the maximal number of entries in a directory data block, in any format. */
+#define STAMFS_DIR_MAX_ENTRIES_PER_BLOCK \
+        (STAMFS_BLOCK_SIZE / STAMFS_DIR_ENTRY_LEN(1))
+
+/*
+ * with STAMFS_FEATURE_RO_COMPAT_DIR_INDEX, a directory whose first data block
+ * fills up turns into an indexed directory (STAMFS_INODE_FL_INDEX): its first
+ * data block becomes the index root, and all other data blocks are leaves,
+ * holding ordinary entries. the root maps ranges of name hashes to the leaf
+ * holding the entries of those names: leaf dx_entries[i].de_block holds the
+ * names whose hash is at least dx_entries[i].de_hash, and below the hash of
+ * the next index entry. the first index entry always has hash 0.
+ * scans for entries in all data blocks skip the root. (with fixed-length
+ * entries, it also starts like an empty data block.)
+ */
+struct stamfs_dx_entry {
+        __u32 de_hash;
+        __u32 de_block;         /* block offset inside the directory. */
+};
+
+struct stamfs_dx_root {
+        __u32 dx_fake_ino;      /* always 0 - an end-of-list marker. */
+        __u16 dx_count;         /* number of entries in dx_entries. */
+        __u16 dx_pad;
+        struct stamfs_dx_entry dx_entries[0];
+};
+
+#define STAMFS_DX_ENTRIES_PER_ROOT \
+        ((STAMFS_BLOCK_SIZE - sizeof(struct stamfs_dx_root)) / \
+         sizeof(struct stamfs_dx_entry))
+
+/* name hashes have 31 bits (readdir positions are built of them). */
+#define STAMFS_DX_HASH_MAX      0x7fffffff
+
+struct stamfs_change_rec {
+        __u32 cr_seq;
+        __u32 cr_seq_hi;
+        __u32 cr_ino;
+        __u32 cr_op;            /* one of STAMFS_CHANGE_*. */
+};
+
+#define STAMFS_CHANGE_RECS_PER_BLOCK \
+        (STAMFS_BLOCK_SIZE / sizeof(struct stamfs_change_rec))
+
+/*
+ * Access entry 'i' of a block of block pointers (the inode index, the free
+ * list or an inode's block index).
+ */
+static inline __u32 stamfs_get_block_ptr(const void *block, int i)
+{
+        return STAMFS_LE32_TO_CPU(((const __u32 *)block)[i]);
+}
+
+static inline void stamfs_set_block_ptr(void *block, int i, __u32 val)
+{
+        ((__u32 *)block)[i] = STAMFS_CPU_TO_LE32(val);
+}
+
+/*
+ * ioctls.
+ */
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
+/* usage of a subtree, as returned by STAMFS_IOC_GET_USAGE. */
+struct stamfs_usage {
+        __u64 su_bytes;         /* sum of the inodes' sizes.                 */
+        __u64 su_blocks;        /* blocks mapped by the inodes.              */
+        __u64 su_inodes;        /* number of inodes.                         */
+};
+
+#define STAMFS_IOC_MAGIC        'S'
+
+/* get the usage of the subtree rooted at the file (which may be a plain
+ * file). needs STAMFS_FEATURE_RO_COMPAT_DIR_USAGE. */
+#define STAMFS_IOC_GET_USAGE    _IOR(STAMFS_IOC_MAGIC, 1, struct stamfs_usage)
+
+/* the path of an inode, as returned by STAMFS_IOC_GET_PATH. */
+#define STAMFS_PATH_MAX         4096
+
+struct stamfs_path {
+        __u32 sp_ino;                   /* in: the inode number.            */
+        char  sp_path[STAMFS_PATH_MAX]; /* out: its path, relative to the   */
+                                        /* file-system's root, starting     */
+                                        /* with '/'.                        */
+};
+
+/* get the path of the inode with the given number, on the file-system of
+ * the file. needs STAMFS_FEATURE_RO_COMPAT_PARENT. */
+#define STAMFS_IOC_GET_PATH     _IOWR(STAMFS_IOC_MAGIC, 2, struct stamfs_path)
+
+/* a batch of change log records, as returned by STAMFS_IOC_READ_CHANGES. */
+#define STAMFS_CHANGES_MAX      64
+
+struct stamfs_change {
+        __u64 sc_seq;
+        __u32 sc_ino;
+        __u32 sc_op;            /* one of STAMFS_CHANGE_*. */
+};
+
+struct stamfs_changes {
+        __u64 sc_seq;           /* in: the first sequence number wanted.    */
+                                /* out: the one to ask for next time.       */
+        __u64 sc_oldest_seq;    /* out: the oldest one still in the log -   */
+                                /* if it is above the one asked for, some   */
+                                /* changes were lost.                       */
+        __u32 sc_count;         /* out: number of changes returned.         */
+        __u32 sc_pad;
+        struct stamfs_change sc_changes[STAMFS_CHANGES_MAX];
+};
+
+/* read the changes logged from a given sequence number on, on the
+ * file-system of the file. needs STAMFS_FEATURE_RO_COMPAT_CHANGELOG. */
+#define STAMFS_IOC_READ_CHANGES _IOWR(STAMFS_IOC_MAGIC, 3, struct stamfs_changes)
+
+/* statistics of the cache of decoded meta-data of a mount, as returned by
+ * STAMFS_IOC_GET_CACHE_STATS. */
+struct stamfs_cache_stats {
+        __u64 cs_hits;          /* lookups that found the data in memory.   */
+        __u64 cs_misses;        /* lookups that had to read it from disk.   */
+        __u64 cs_evictions;     /* entries dropped to make room.            */
+        __u32 cs_entries;       /* entries in the cache now.                */
+        __u32 cs_limit;         /* the 'cache_limit=' mount option.         */
+};
+
+#define STAMFS_IOC_GET_CACHE_STATS _IOR(STAMFS_IOC_MAGIC, 6, struct stamfs_cache_stats)
+/* drop the whole cache of the file's mount. */
+#define STAMFS_IOC_DROP_CACHE   _IO(STAMFS_IOC_MAGIC, 7)
+
+/* make a regular file immutable, and move its data blocks into a single run
+ * of adjacent blocks. a sealed file may be unsealed, but it stays where it
+ * was moved to. */
+#define STAMFS_IOC_SEAL         _IO(STAMFS_IOC_MAGIC, 4)
+#define STAMFS_IOC_UNSEAL       _IO(STAMFS_IOC_MAGIC, 5)
+
+/* pack the entries of a directory's blocks, dropping removed entries, and
+ * free the empty blocks at its end. */
+#define STAMFS_IOC_COMPACT_DIR  _IO(STAMFS_IOC_MAGIC, 8)
+
+/* get the number of entries of a directory, not counting "." and "..". */
+#define STAMFS_IOC_GET_DIR_ENTRIES _IOR(STAMFS_IOC_MAGIC, 9, __u32)
+
+/* a directory entry with the attributes of its inode, as returned by
+ * STAMFS_IOC_READDIRPLUS. */
+struct stamfs_direntplus {
+        __u64 dp_size;
+        __u32 dp_ino;
+        __u32 dp_mode;          /* 0 if the inode could not be read.        */
+        __u32 dp_nlink;
+        __u32 dp_uid;
+        __u32 dp_gid;
+        __u32 dp_mtime;
+        __u32 dp_blocks;        /* as reported by stat().                   */
+        __u16 dp_reclen;        /* the offset of the next entry.            */
+        __u16 dp_name_len;
+        char  dp_name[0];       /* dp_name_len characters, null-terminated. */
+};
+
+/* the length of an entry with a name of the given length (8-byte aligned). */
+#define STAMFS_DIRENTPLUS_LEN(name_len) \
+        ((sizeof(struct stamfs_direntplus) + (name_len) + 1 + 7) & ~7)
+
+/* larger buffers are filled only up to this length. */
+#define STAMFS_READDIRPLUS_MAX_LEN      65536
+
+struct stamfs_readdirplus {
+        __u64 rp_buf;           /* in: the address of a buffer for entries. */
+        __u32 rp_buf_len;       /* in: its length.                          */
+        __u32 rp_count;         /* out: number of entries returned - 0 at   */
+                                /* the end of the directory.                */
+};
+
+/* read the next entries of a directory, like getdents(), together with the
+ * attributes of their inodes, like stat(). the entries are read from the
+ * directory's file position, which is advanced past them. */
+#define STAMFS_IOC_READDIRPLUS  _IOWR(STAMFS_IOC_MAGIC, 10, struct stamfs_readdirplus)
+
+/* sort the entries of a directory by name, so lookups binary-search it. it
+ * stays writable, and the first change to its entries (or unsorting it)
+ * drops the order. */
+#define STAMFS_IOC_SORT_DIR     _IO(STAMFS_IOC_MAGIC, 11)
+#define STAMFS_IOC_UNSORT_DIR   _IO(STAMFS_IOC_MAGIC, 12)
+
 #endif /* STAMFS_H */
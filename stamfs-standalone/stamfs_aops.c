@@ -2,6 +2,7 @@
 
 #include "stamfs.h"
 #include "stamfs_super.h"
+#include "stamfs_inode.h"
 #include "stamfs_iops.h"
 #include "stamfs_aops.h"
 #include "stamfs_util.h"
@@ -69,7 +70,7 @@ int stamfs_get_block(struct inode *ino, long block_offset,
                      struct buffer_head *bh_result, int create)
 {
         int err = 0;
-        int block_num = -1;
+        unsigned long block_num = 0;
 
         STAMFS_DBG(DEB_STAM, "stamfs: ino=%ld, block_offset=%ld, create=%d\n",
                              ino->i_ino, block_offset, create);
@@ -80,12 +81,12 @@ int stamfs_get_block(struct inode *ino, long block_offset,
 
         /* the block offset is mapped - set the number in bh_result,
          * and return. */
-        if (block_num != -1) {
+        if (block_num != 0) {
                 bh_result->b_dev = ino->i_dev;
                 bh_result->b_blocknr = block_num;
                 bh_result->b_state |= (1UL << BH_Mapped);
                 STAMFS_DBG(DEB_STAM,
-                           "stamfs: found existing block, block_num=%d\n",
+                           "stamfs: found existing block, block_num=%lu\n",
                            block_num);
                 stamfs_dbg_print_bh(bh_result);
                 goto ret;
@@ -99,8 +100,13 @@ int stamfs_get_block(struct inode *ino, long block_offset,
                 goto ret;
         }
 
-        /* block offset not mapped and create != 0 - allocate a new block. */
-        block_num = stamfs_alloc_block(ino->i_sb);
+        /* block offset not mapped and create != 0 - allocate a new block.
+         * the first block goes right after the inode's block index, if
+         * that's still free. */
+        if (block_offset == 0)
+                block_num = stamfs_inode_alloc_first_block(ino);
+        else
+                block_num = stamfs_alloc_block(ino->i_sb);
         if (block_num == 0) {
                 STAMFS_DBG(DEB_STAM, "stamfs: cannot allocate block - "
                                      "no free blocks available\n");
@@ -117,6 +123,11 @@ int stamfs_get_block(struct inode *ino, long block_offset,
                 goto ret_err;
         }
 
+        /* i_blocks grew - the delta is propagated to the ancestors later,
+         * from file_write, truncate or write_inode. we may be called from
+         * writepage under memory pressure, so we don't take s_usage_sem or
+         * iget() anything here. */
+
         /* the block is now mapped, and its a new block. */
         bh_result->b_dev = ino->i_dev;
         bh_result->b_blocknr = block_num;
@@ -148,14 +159,24 @@ int stamfs_readpage(struct file *filp, struct page *page)
 int stamfs_writepage(struct page *page)
 {
         STAMFS_DBG(DEB_STAM, "stamfs: writepage, page=%lu\n", page->index);
+        /* a sealed file's blocks were laid out already - pages dirtied
+           through a mapping made before it was sealed are not written. */
+        if (IS_IMMUTABLE(page->mapping->host)) {
+                UnlockPage(page);
+                return -EPERM;
+        }
         return block_write_full_page(page, stamfs_get_block);
 }
 
-/* delegate the work to the VFS's page prepare writing function. */
+/* delegate the work to the VFS's page prepare writing function. a sealed
+ * file may no longer be written - writers that opened it before it was
+ * sealed are caught here, under the inode's semaphore. */
 int stamfs_prepare_write(struct file *filp, struct page *page,
                          unsigned from, unsigned to)
 {
         STAMFS_DBG(DEB_STAM, "stamfs: prepare_write, file=%s, page=%lu\n",
                              filp->f_dentry->d_name.name, page->index);
+        if (IS_IMMUTABLE(filp->f_dentry->d_inode))
+                return -EPERM;
         return block_prepare_write(page, from, to, stamfs_get_block);
 }
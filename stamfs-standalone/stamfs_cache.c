@@ -0,0 +1,194 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_cache.h"
+#include "stamfs_names.h"
+#include "stamfs_dir_bloom.h"
+
+/*
+ * The in-core inodes of a mount that hold decoded meta-data (block maps, and
+ * the name tables, free space hints and Bloom filters of directories) are
+ * kept on an LRU list, most recently used first. when an inode's meta-data
+ * is loaded and the list grows beyond the 'cache_limit=' mount option, the
+ * decoded meta-data of the inodes at the tail of the list is dropped - it is
+ * simply re-read from disk when needed again. the same happens to the whole
+ * list when memory runs out, or on request (STAMFS_IOC_DROP_CACHE).
+ *
+ * lock order: s_cache_lock, then an inode's i_bmap_lock.
+ */
+
+/*
+ * Drop the decoded meta-data of the given inode, which was just taken off
+ * the LRU list. s_cache_lock must be held by the caller.
+ */
+static void stamfs_cache_drop(struct stamfs_inode_meta_data *inode_meta)
+{
+        unsigned long *bmap;
+        struct stamfs_name_table *names;
+        __u16 *dir_free;
+        struct stamfs_dir_bloom *bloom;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bmap = inode_meta->i_bmap;
+        inode_meta->i_bmap = NULL;
+        names = inode_meta->i_names;
+        inode_meta->i_names = NULL;
+        dir_free = inode_meta->i_dir_free;
+        inode_meta->i_dir_free = NULL;
+        bloom = inode_meta->i_dir_bloom;
+        inode_meta->i_dir_bloom = NULL;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (bmap)
+                kfree(bmap);
+        if (names)
+                stamfs_names_free(names);
+        if (dir_free)
+                kfree(dir_free);
+        if (bloom)
+                stamfs_dir_bloom_free(bloom);
+}
+
+/*
+ * Evict the entry at the tail of the LRU list, unless it is the given one.
+ * s_cache_lock must be held by the caller.
+ * returns 1 if an entry was evicted, 0 otherwise.
+ */
+static int stamfs_cache_evict_lru(struct stamfs_meta_data *stamfs_meta,
+                                  struct stamfs_inode_meta_data *keep)
+{
+        struct stamfs_inode_meta_data *victim;
+
+        if (list_empty(&stamfs_meta->s_cache_lru))
+                return 0;
+        victim = list_entry(stamfs_meta->s_cache_lru.prev,
+                            struct stamfs_inode_meta_data, i_cache_lru);
+        if (victim == keep)
+                return 0;
+
+        list_del_init(&victim->i_cache_lru);
+        stamfs_meta->s_cache_count--;
+        stamfs_meta->s_cache_evictions++;
+        stamfs_cache_drop(victim);
+
+        return 1;
+}
+
+/*
+ * Initialize the (empty) cache of a file-system being mounted. the limit
+ * is set by the mount options.
+ */
+void stamfs_cache_init(struct stamfs_meta_data *stamfs_meta)
+{
+        spin_lock_init(&stamfs_meta->s_cache_lock);
+        INIT_LIST_HEAD(&stamfs_meta->s_cache_lru);
+        stamfs_meta->s_cache_count = 0;
+        stamfs_meta->s_cache_hits = 0;
+        stamfs_meta->s_cache_misses = 0;
+        stamfs_meta->s_cache_evictions = 0;
+}
+
+/*
+ * The decoded meta-data of the given inode was found in memory - count the
+ * hit, and mark it as the most recently used.
+ */
+void stamfs_cache_hit(struct inode *ino)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(ino->i_sb);
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        spin_lock(&stamfs_meta->s_cache_lock);
+        stamfs_meta->s_cache_hits++;
+        if (!list_empty(&inode_meta->i_cache_lru)) {
+                list_del(&inode_meta->i_cache_lru);
+                list_add(&inode_meta->i_cache_lru, &stamfs_meta->s_cache_lru);
+        }
+        spin_unlock(&stamfs_meta->s_cache_lock);
+}
+
+/*
+ * The decoded meta-data of the given inode was just loaded - count the
+ * miss, and make room for it by evicting the least recently used entries.
+ */
+void stamfs_cache_insert(struct inode *ino)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(ino->i_sb);
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        spin_lock(&stamfs_meta->s_cache_lock);
+        stamfs_meta->s_cache_misses++;
+        if (list_empty(&inode_meta->i_cache_lru))
+                stamfs_meta->s_cache_count++;
+        else
+                list_del(&inode_meta->i_cache_lru);
+        list_add(&inode_meta->i_cache_lru, &stamfs_meta->s_cache_lru);
+
+        while (stamfs_meta->s_cache_count > stamfs_meta->s_cache_limit) {
+                if (!stamfs_cache_evict_lru(stamfs_meta, inode_meta))
+                        break;
+        }
+        spin_unlock(&stamfs_meta->s_cache_lock);
+}
+
+/*
+ * The given inode is going away, or its decoded meta-data was dropped -
+ * take it off the cache.
+ */
+void stamfs_cache_remove(struct inode *ino)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(ino->i_sb);
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        spin_lock(&stamfs_meta->s_cache_lock);
+        if (!list_empty(&inode_meta->i_cache_lru)) {
+                list_del_init(&inode_meta->i_cache_lru);
+                stamfs_meta->s_cache_count--;
+        }
+        spin_unlock(&stamfs_meta->s_cache_lock);
+}
+
+/*
+ * Evict up to 'count' of the least recently used entries.
+ * returns the number of entries evicted.
+ */
+unsigned long stamfs_cache_shrink(struct super_block *sb, unsigned long count)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        unsigned long evicted = 0;
+
+        spin_lock(&stamfs_meta->s_cache_lock);
+        while (evicted < count && stamfs_cache_evict_lru(stamfs_meta, NULL))
+                evicted++;
+        spin_unlock(&stamfs_meta->s_cache_lock);
+
+        STAMFS_DBG(DEB_STAM, "stamfs: evicted %lu cache entries\n", evicted);
+
+        return evicted;
+}
+
+/*
+ * Get the cache's statistics.
+ */
+void stamfs_cache_get_stats(struct super_block *sb,
+                            struct stamfs_cache_stats *stats)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+
+        spin_lock(&stamfs_meta->s_cache_lock);
+        stats->cs_hits = stamfs_meta->s_cache_hits;
+        stats->cs_misses = stamfs_meta->s_cache_misses;
+        stats->cs_evictions = stamfs_meta->s_cache_evictions;
+        stats->cs_entries = stamfs_meta->s_cache_count;
+        stats->cs_limit = stamfs_meta->s_cache_limit;
+        spin_unlock(&stamfs_meta->s_cache_lock);
+}
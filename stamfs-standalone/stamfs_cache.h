@@ -0,0 +1,54 @@
+
+#ifndef STAMFS_CACHE_H
+#define STAMFS_CACHE_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+
+/*
+ * Functions that bound the memory used by the decoded meta-data STAMFS
+ * keeps for in-core inodes (such as their block maps), per mount.
+ */
+
+/* the default of the 'cache_limit=' mount option. */
+#define STAMFS_CACHE_DEFAULT_LIMIT      1024
+
+/*
+ * Initialize the (empty) cache of a file-system being mounted. the limit
+ * is set by the mount options.
+ */
+void stamfs_cache_init(struct stamfs_meta_data *stamfs_meta);
+
+/*
+ * The decoded meta-data of the given inode was found in memory - count the
+ * hit, and mark it as the most recently used.
+ */
+void stamfs_cache_hit(struct inode *ino);
+
+/*
+ * The decoded meta-data of the given inode was just loaded - count the
+ * miss, and make room for it by evicting the least recently used entries.
+ */
+void stamfs_cache_insert(struct inode *ino);
+
+/*
+ * The given inode is going away, or its decoded meta-data was dropped -
+ * take it off the cache.
+ */
+void stamfs_cache_remove(struct inode *ino);
+
+/*
+ * Evict up to 'count' of the least recently used entries.
+ * returns the number of entries evicted.
+ */
+unsigned long stamfs_cache_shrink(struct super_block *sb, unsigned long count);
+
+/*
+ * Get the cache's statistics.
+ */
+void stamfs_cache_get_stats(struct super_block *sb,
+                            struct stamfs_cache_stats *stats);
+
+#endif /* STAMFS_CACHE_H */
@@ -0,0 +1,226 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/locks.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_changelog.h"
+
+/*
+ * The change log is a ring of s_changelog_blocks contiguous blocks, holding
+ * STAMFS_CHANGE_RECS_PER_BLOCK records each. s_changelog_head is the slot
+ * the next record goes into, and s_changelog_seq is its sequence number -
+ * so the records in the ring are those numbered from
+ * s_changelog_seq - min(s_changelog_seq - 1, capacity) up to
+ * s_changelog_seq - 1. both are kept in the super-block, which is written
+ * along with the ring's blocks by the buffer cache.
+ *
+ * a run of changes of the same kind to the same inode (e.g. a sequence of
+ * writes) is logged once - unless someone read the log in between.
+ */
+
+/* the number of records the change log can hold. */
+static inline unsigned long stamfs_changelog_capacity(
+                                        struct stamfs_meta_data *stamfs_meta)
+{
+        return stamfs_meta->s_changelog_blocks * STAMFS_CHANGE_RECS_PER_BLOCK;
+}
+
+/*
+ * Decode the change log's location and position from the super-block into
+ * the given meta-data, and check them.
+ * returns 1 on success, 0 on failure.
+ */
+int stamfs_changelog_init(struct stamfs_meta_data *stamfs_meta,
+                          struct stamfs_super_block *stamfs_sb)
+{
+        __u32 block_num;
+        __u64 seq;
+
+        init_MUTEX(&stamfs_meta->s_changelog_sem);
+        stamfs_meta->s_changelog_block_num = 0;
+        stamfs_meta->s_changelog_blocks = 0;
+        stamfs_meta->s_changelog_head = 0;
+        stamfs_meta->s_changelog_seq = 1;
+        stamfs_meta->s_changelog_last_ino = 0;
+        stamfs_meta->s_changelog_last_op = 0;
+
+        if (!(stamfs_meta->s_feature_ro_compat &
+              STAMFS_FEATURE_RO_COMPAT_CHANGELOG))
+                return 1;
+
+        block_num = le32_to_cpu(stamfs_sb->s_changelog_block_num);
+        seq = le32_to_cpu(stamfs_sb->s_changelog_seq) |
+              (__u64)le32_to_cpu(stamfs_sb->s_changelog_seq_hi) << 32;
+
+        stamfs_meta->s_changelog_block_num = block_num;
+        stamfs_meta->s_changelog_blocks = le32_to_cpu(stamfs_sb->s_changelog_blocks);
+        stamfs_meta->s_changelog_head = le32_to_cpu(stamfs_sb->s_changelog_head);
+        stamfs_meta->s_changelog_seq = seq;
+
+        if (block_num <= STAMFS_LAST_HARDCODED_BLOCK_NUM ||
+            stamfs_meta->s_changelog_blocks == 0 ||
+            block_num + stamfs_meta->s_changelog_blocks >
+                        stamfs_meta->s_blocks_count ||
+            stamfs_meta->s_changelog_head >=
+                        stamfs_changelog_capacity(stamfs_meta) ||
+            seq == 0) {
+                printk("stamfs: bad change log (block %u, %lu blocks, "
+                       "head %lu).\n", block_num,
+                       stamfs_meta->s_changelog_blocks,
+                       stamfs_meta->s_changelog_head);
+                return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * Log a change (one of STAMFS_CHANGE_*) of the given inode.
+ */
+void stamfs_changelog_record(struct inode *ino, int op)
+{
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_super_block *stamfs_sb = stamfs_meta->s_stamfs_sb;
+        struct stamfs_change_rec *rec = NULL;
+        struct buffer_head *bh = NULL;
+        unsigned long head;
+        __u64 seq;
+
+        if (!(stamfs_meta->s_feature_ro_compat &
+              STAMFS_FEATURE_RO_COMPAT_CHANGELOG) || IS_RDONLY(ino))
+                return;
+
+        down(&stamfs_meta->s_changelog_sem);
+
+        if (stamfs_meta->s_changelog_last_ino == ino->i_ino &&
+            stamfs_meta->s_changelog_last_op == op)
+                goto ret;
+
+        head = stamfs_meta->s_changelog_head;
+        seq = stamfs_meta->s_changelog_seq;
+
+        bh = bread(sb->s_dev, stamfs_meta->s_changelog_block_num +
+                              head / STAMFS_CHANGE_RECS_PER_BLOCK,
+                   STAMFS_BLOCK_SIZE);
+        if (!bh) {
+                printk("stamfs: unable to read change log block.\n");
+                goto ret;
+        }
+        rec = (struct stamfs_change_rec *)bh->b_data +
+              head % STAMFS_CHANGE_RECS_PER_BLOCK;
+        rec->cr_seq = cpu_to_le32((__u32)seq);
+        rec->cr_seq_hi = cpu_to_le32((__u32)(seq >> 32));
+        rec->cr_ino = cpu_to_le32(ino->i_ino);
+        rec->cr_op = cpu_to_le32(op);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+
+        STAMFS_DBG(DEB_STAM, "stamfs: logged change %llu - inode %lu, op %d\n",
+                             seq, ino->i_ino, op);
+
+        seq++;
+        if (++head == stamfs_changelog_capacity(stamfs_meta))
+                head = 0;
+        stamfs_meta->s_changelog_head = head;
+        stamfs_meta->s_changelog_seq = seq;
+        stamfs_meta->s_changelog_last_ino = ino->i_ino;
+        stamfs_meta->s_changelog_last_op = op;
+
+        stamfs_sb->s_changelog_head = cpu_to_le32(head);
+        stamfs_sb->s_changelog_seq = cpu_to_le32((__u32)seq);
+        stamfs_sb->s_changelog_seq_hi = cpu_to_le32((__u32)(seq >> 32));
+        mark_buffer_dirty(stamfs_meta->s_sbh);
+        sb->s_dirt = 1;
+
+  ret:
+        up(&stamfs_meta->s_changelog_sem);
+}
+
+/*
+ * Read the changes logged from changes->sc_seq on, filling the rest of
+ * 'changes'.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_changelog_read(struct super_block *sb,
+                          struct stamfs_changes *changes)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_change_rec *rec = NULL;
+        struct buffer_head *bh = NULL;
+        unsigned long capacity;
+        unsigned long slot;
+        unsigned long block_num;
+        __u64 next_seq;
+        __u64 oldest_seq;
+        __u64 seq;
+        int count = 0;
+        int err = 0;
+
+        if (!(stamfs_meta->s_feature_ro_compat &
+              STAMFS_FEATURE_RO_COMPAT_CHANGELOG))
+                return -EOPNOTSUPP;
+
+        down(&stamfs_meta->s_changelog_sem);
+
+        capacity = stamfs_changelog_capacity(stamfs_meta);
+        next_seq = stamfs_meta->s_changelog_seq;
+        if (next_seq - 1 > capacity)
+                oldest_seq = next_seq - capacity;
+        else
+                oldest_seq = 1;
+
+        seq = changes->sc_seq;
+        if (seq < oldest_seq)
+                seq = oldest_seq;
+        if (seq > next_seq)
+                seq = next_seq;
+
+        for ( ; seq < next_seq && count < STAMFS_CHANGES_MAX; seq++, count++) {
+                /* next_seq - seq is at most the capacity. */
+                slot = stamfs_meta->s_changelog_head + capacity -
+                       (unsigned long)(next_seq - seq);
+                if (slot >= capacity)
+                        slot -= capacity;
+                block_num = stamfs_meta->s_changelog_block_num +
+                            slot / STAMFS_CHANGE_RECS_PER_BLOCK;
+
+                if (!bh || bh->b_blocknr != block_num) {
+                        if (bh)
+                                brelse(bh);
+                        bh = bread(sb->s_dev, block_num, STAMFS_BLOCK_SIZE);
+                        if (!bh) {
+                                printk("stamfs: unable to read change log "
+                                       "block.\n");
+                                err = -EIO;
+                                goto ret;
+                        }
+                }
+
+                rec = (struct stamfs_change_rec *)bh->b_data +
+                      slot % STAMFS_CHANGE_RECS_PER_BLOCK;
+                changes->sc_changes[count].sc_seq =
+                        le32_to_cpu(rec->cr_seq) |
+                        (__u64)le32_to_cpu(rec->cr_seq_hi) << 32;
+                changes->sc_changes[count].sc_ino = le32_to_cpu(rec->cr_ino);
+                changes->sc_changes[count].sc_op = le32_to_cpu(rec->cr_op);
+        }
+
+        changes->sc_seq = seq;
+        changes->sc_oldest_seq = oldest_seq;
+        changes->sc_count = count;
+
+        /* the reader has seen the last change - log the next one anew. */
+        stamfs_meta->s_changelog_last_ino = 0;
+
+  ret:
+        if (bh)
+                brelse(bh);
+        up(&stamfs_meta->s_changelog_sem);
+        return err;
+}
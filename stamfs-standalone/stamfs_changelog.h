@@ -0,0 +1,36 @@
+
+#ifndef STAMFS_CHANGELOG_H
+#define STAMFS_CHANGELOG_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+
+/*
+ * Functions that maintain the change log of a file-system
+ * (STAMFS_FEATURE_RO_COMPAT_CHANGELOG).
+ */
+
+/*
+ * Decode the change log's location and position from the super-block into
+ * the given meta-data, and check them.
+ * returns 1 on success, 0 on failure.
+ */
+int stamfs_changelog_init(struct stamfs_meta_data *stamfs_meta,
+                          struct stamfs_super_block *stamfs_sb);
+
+/*
+ * Log a change (one of STAMFS_CHANGE_*) of the given inode.
+ */
+void stamfs_changelog_record(struct inode *ino, int op);
+
+/*
+ * Read the changes logged from changes->sc_seq on, filling the rest of
+ * 'changes'.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_changelog_read(struct super_block *sb,
+                          struct stamfs_changes *changes);
+
+#endif /* STAMFS_CHANGELOG_H */
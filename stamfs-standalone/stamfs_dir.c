@@ -1,40 +1,43 @@
 
 
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
 
 #include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_dir_sort.h"
+#include "stamfs_dir_bloom.h"
+#include "stamfs_names.h"
+#include "stamfs_dirent.h"
 
 #include "stamfs.h"
 #include "stamfs_super.h"
 #include "stamfs_inode.h"
+#include "stamfs_iops.h"
+#include "stamfs_usage.h"
 #include "stamfs_util.h"
+#include "stamfs_cache.h"
 
 /*
- * return the block number of the (first) data block of the given directory.
+ * return the block number of the data block at the given block offset of
+ * the given directory.
  * returns a negative error code, in case of an error, 0 on success.
  */
-int stamfs_dir_get_data_block_num(struct inode *dir, int *p_data_block_num)
+int stamfs_dir_get_data_block_num(struct inode *dir, int block_offset,
+                                  unsigned long *p_data_block_num)
 {
         int err = 0;
-        struct super_block *sb = dir->i_sb;
-        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
-        int bi_block_num = inode_meta->i_bi_block_num;
-        struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
+        unsigned long data_block_num = 0;
 
-        /* read the directory's block index. */
-        if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
-                       bi_block_num);
-                err = -EIO;
+        /* consult the in-memory copy of the directory's block index. */
+        err = stamfs_inode_bmap_lookup(dir, block_offset, &data_block_num);
+        if (err)
                 goto ret;
-        }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
-        (*p_data_block_num) = le32_to_cpu(stamfs_bi->index[0]);
+        (*p_data_block_num) = data_block_num;
 
   ret:
-        if (bibh)
-                brelse(bibh);
         return err;
 }
 
@@ -42,25 +45,25 @@ int stamfs_dir_get_data_block_num(struct inode *dir, int *p_data_block_num)
  * set the block number of the (first) data block of the given directory.
  * returns a negative error code, in case of an error.
  */
-int stamfs_dir_set_data_block_num(struct inode *dir, int data_block_num)
+int stamfs_dir_set_data_block_num(struct inode *dir,
+                                  unsigned long data_block_num)
 {
         int err = 0;
         struct super_block *sb = dir->i_sb;
         struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
-        int bi_block_num = inode_meta->i_bi_block_num;
+        unsigned long bi_block_num = inode_meta->i_bi_block_num;
         struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
 
         /* read the directory's block index. */
         if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
+                printk("stamfs: unable to read inode block index, block %lu.\n",
                        bi_block_num);
                 err = -EIO;
                 goto ret;
         }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
-        stamfs_bi->index[0] = cpu_to_le32(data_block_num);
+        stamfs_set_block_ptr(bibh->b_data, 0, data_block_num);
         mark_buffer_dirty_inode(bibh, dir);
+        stamfs_inode_bmap_update(dir, 0, data_block_num);
 
   ret:
         if (bibh)
@@ -68,6 +71,274 @@ int stamfs_dir_set_data_block_num(struct inode *dir, int data_block_num)
         return err;
 }
 
+/*
+ * Read in the data block at the given block offset of the given directory.
+ * returns the block's buffer, or NULL on failure.
+ */
+struct buffer_head *stamfs_dir_bread(struct inode *dir, int block_offset)
+{
+        struct buffer_head *bh = NULL;
+        unsigned long data_block_num = 0;
+
+        if (stamfs_dir_get_data_block_num(dir, block_offset, &data_block_num))
+                return NULL;
+        if (data_block_num == 0) {
+                printk("stamfs: directory %lu has no data block at "
+                       "offset %d.\n", dir->i_ino, block_offset);
+                return NULL;
+        }
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir data in block %lu\n", data_block_num);
+        if (!(bh = bread(dir->i_sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE)))
+                printk("stamfs: unable to read dir data block %lu.\n",
+                       data_block_num);
+
+        return bh;
+}
+
+/*
+ * The free space of a directory is tracked by hints, so adding an entry
+ * neither scans the directory for a block with room, nor scans that block
+ * for a free entry: i_dir_free_block (kept on disk) is the first block that
+ * may have room, and i_dir_free (in memory, dropped along with the block
+ * map) holds, per block, the offset below which it has no room - or
+ * STAMFS_BLOCK_SIZE if it has none. both are lowered when entries are
+ * removed, and never point past room. i_dir_free_block is only read from
+ * disk with STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS - older inodes may hold
+ * anything there - and is clamped to the directory's size when read.
+ */
+
+/*
+ * Get the offset below which the given data block of the given directory
+ * has no room for an entry (0 if not known).
+ */
+static unsigned int stamfs_dir_free_get(struct inode *dir, int block_offset)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        unsigned int hint = 0;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_dir_free)
+                hint = inode_meta->i_dir_free[block_offset];
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        return hint;
+}
+
+/*
+ * Set the offset below which the given data block of the given directory
+ * has no room for an entry.
+ */
+static void stamfs_dir_free_set(struct inode *dir, int block_offset,
+                                unsigned int hint)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        int max_blocks = STAMFS_MAX_BLOCKS_PER_FILE;
+        __u16 *dir_free = NULL;
+        int loaded = 0;
+
+        /* without memory for the hints, blocks are just searched. */
+        if (!inode_meta->i_dir_free) {
+                dir_free = kmalloc(max_blocks * sizeof(__u16), GFP_NOFS);
+                if (dir_free)
+                        memset(dir_free, 0, max_blocks * sizeof(__u16));
+        }
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (!inode_meta->i_dir_free && dir_free) {
+                inode_meta->i_dir_free = dir_free;
+                dir_free = NULL;
+                loaded = 1;
+        }
+        if (inode_meta->i_dir_free)
+                inode_meta->i_dir_free[block_offset] = hint;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (dir_free)
+                kfree(dir_free);
+        if (loaded)
+                stamfs_cache_insert(dir);
+}
+
+/*
+ * An entry was removed from the given data block of the given directory,
+ * leaving room at the given offset - lower the hints accordingly.
+ */
+static void stamfs_dir_free_lower(struct inode *dir, int block_offset,
+                                  unsigned int offset)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_dir_free &&
+            inode_meta->i_dir_free[block_offset] > offset)
+                inode_meta->i_dir_free[block_offset] = offset;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (inode_meta->i_dir_free_block > block_offset) {
+                inode_meta->i_dir_free_block = block_offset;
+                mark_inode_dirty(dir);
+        }
+}
+
+/*
+ * Entries of the given directory were moved around on disk - drop its free
+ * space hints. blocks will be searched for room again.
+ */
+void stamfs_dir_free_invalidate(struct inode *dir)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        __u16 *dir_free;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        dir_free = inode_meta->i_dir_free;
+        inode_meta->i_dir_free = NULL;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (dir_free)
+                kfree(dir_free);
+        if (inode_meta->i_dir_free_block != 0) {
+                inode_meta->i_dir_free_block = 0;
+                mark_inode_dirty(dir);
+        }
+}
+
+/*
+ * A directory counts its entries in i_dir_entries (STAMFS_INODE_FL_COUNTED),
+ * so checking whether it's empty takes no I/O. directories made before the
+ * count was kept are counted on the first check. the count is only trusted
+ * once the file-system says it's kept (STAMFS_FEATURE_RO_COMPAT_DIR_COUNT),
+ * in inodes that hold flags at all (STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS).
+ */
+
+/* does the given directory keep a count of its entries? */
+static int stamfs_dir_counted(struct inode *dir)
+{
+        return ((STAMFS_META(dir->i_sb)->s_feature_ro_compat &
+                 STAMFS_FEATURE_RO_COMPAT_DIR_COUNT) &&
+                stamfs_inode_flags_enabled(dir->i_sb) &&
+                (STAMFS_INODE_META(dir)->i_flags & STAMFS_INODE_FL_COUNTED));
+}
+
+/*
+ * Set the number of entries of the given directory, and start keeping it.
+ */
+static void stamfs_dir_count_set(struct inode *dir, unsigned long count)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+
+        /* the flag has nowhere to go on disk. */
+        if (!stamfs_inode_flags_enabled(dir->i_sb))
+                return;
+
+        inode_meta->i_dir_entries = count;
+        inode_meta->i_flags |= STAMFS_INODE_FL_COUNTED;
+        mark_inode_dirty(dir);
+
+        /* older versions would change the directory without counting. */
+        stamfs_set_feature_ro_compat(dir->i_sb,
+                                     STAMFS_FEATURE_RO_COMPAT_DIR_COUNT);
+}
+
+/*
+ * An entry was added to (delta 1) or removed from (delta -1) the given
+ * directory - update its count, if it keeps one.
+ */
+static void stamfs_dir_count_add(struct inode *dir, int delta)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+
+        if (!stamfs_dir_counted(dir))
+                return;
+        if (delta < 0 && inode_meta->i_dir_entries == 0) {
+                printk("stamfs: bad entry count of directory %lu.\n",
+                       dir->i_ino);
+                return;
+        }
+        inode_meta->i_dir_entries += delta;
+        mark_inode_dirty(dir);
+}
+
+/*
+ * Find the entry with the given name in the given directory, scanning all
+ * its data blocks - or just the one leaf that may hold the name, if the
+ * directory is indexed.
+ * on success, *p_bh holds the entry's block (to be released by the caller),
+ * *p_block_offset its block offset, and *de the entry inside it.
+ * @return 0 on success, -ENOENT if there is no such entry, another negative
+ *         error code on failure.
+ */
+static int stamfs_dir_find_entry(struct inode *dir, const char *name,
+                                 int namelen, struct buffer_head **p_bh,
+                                 int *p_block_offset,
+                                 struct stamfs_dirent *de)
+{
+        struct super_block *sb = dir->i_sb;
+        int first_block = stamfs_dx_first_block(dir);
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head *bh = NULL;
+        __u32 hash = stamfs_dir_hash(name, namelen);
+        int ent_offset = 0;
+        ino_t ino_num = 0;
+        int err = 0;
+        int i;
+
+        /* the name table knows where the entry is - if it's there at all. */
+        if (stamfs_names_lookup(dir, name, namelen, &ino_num,
+                                &first_block, &ent_offset)) {
+                if (ino_num == 0)
+                        return -ENOENT;
+                if (!(bh = stamfs_dir_bread(dir, first_block)))
+                        return -EIO;
+                if (stamfs_dirent_get(sb, bh->b_data, ent_offset, de) &&
+                    de->de_ino == ino_num &&
+                    de->de_name_len == namelen &&
+                    memcmp(de->de_name, name, namelen) == 0) {
+                        *p_bh = bh;
+                        *p_block_offset = first_block;
+                        return 0;
+                }
+                brelse(bh);
+                printk("stamfs: stale name table of directory %lu.\n",
+                       dir->i_ino);
+                stamfs_names_invalidate(dir);
+                first_block = stamfs_dx_first_block(dir);
+        }
+
+        if (stamfs_dir_sorted(dir))
+                return stamfs_dir_sorted_find(dir, name, namelen, hash, p_bh,
+                                              p_block_offset, de);
+
+        if (stamfs_dx_indexed(dir)) {
+                err = stamfs_dx_find_leaf(dir, hash, &first_block, NULL);
+                if (err)
+                        return err;
+                num_blocks = first_block + 1;
+        }
+
+        for (i = first_block; i < num_blocks; i++) {
+                /* blocks that surely don't hold the name are not read. */
+                if (stamfs_dir_bloom_skip(dir, i, hash))
+                        continue;
+                if (!(bh = stamfs_dir_bread(dir, i)))
+                        return -EIO;
+
+                /* scan the data block, looking for the given name. */
+                if (stamfs_dirent_find(sb, bh->b_data, name, namelen, hash,
+                                       de)) {
+                        *p_bh = bh;
+                        *p_block_offset = i;
+                        return 0;
+                }
+
+                /* the next lookup of a missing name may skip it. */
+                stamfs_dir_bloom_build(dir, i, bh->b_data);
+                brelse(bh);
+        }
+
+        return -ENOENT;
+}
+
 /*
  * Given a directory's inode and a file-name, returns the inode number of
  * this file.
@@ -79,61 +350,81 @@ int stamfs_dir_get_file_by_name(struct inode *dir, const char *name,
 {
         int err = 0;
         struct buffer_head *bh = NULL;
-        struct super_block* sb = dir->i_sb;
-        struct stamfs_dir_rec *dir_rec = NULL;
-        int data_block_num = 0;
+        struct stamfs_dirent de;
+        int block_offset;
 
         STAMFS_DBG(DEB_STAM,
                    "stamfs: getting file '%s', namelen=%d, dir_inode=%lu\n",
                    name, namelen, dir->i_ino);
 
-        err = stamfs_dir_get_data_block_num(dir, &data_block_num);
-        if (err)
-                goto ret_err;
-
-        /* read in the data block of this directory. */
-        STAMFS_DBG(DEB_STAM, "stamfs: dir data in block %d\n", data_block_num);
-        if (!(bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read dir data block.\n");
-                err = -EIO;
-                goto ret_err;
-        }
-
-        /* scan the data block, looking for the given file. */
         *p_ino_num = 0;
-        dir_rec = (struct stamfs_dir_rec *)((char*)(bh->b_data));
-        for ( ; ((char*)dir_rec) < ((char*)bh->b_data) + STAMFS_BLOCK_SIZE; dir_rec++) {
-                STAMFS_DBG(DEB_STAM,
-                           "stamfs: next entry: ino=%d, name=%s, namelen=%d\n",
-                           dir_rec->dr_ino,
-                           (dir_rec->dr_ino ? dir_rec->dr_name : "(null)"),
-                           dir_rec->dr_name_len);
-                if (dir_rec->dr_ino == 0)
-                        break; /* last entry. */
-                if (le32_to_cpu(dir_rec->dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
-                        continue; /* empty entry. */
-                if (dir_rec->dr_name_len != namelen)
-                        continue;
-                if (memcmp(dir_rec->dr_name, name, namelen) != 0)
-                        continue;
-                /* we have a match. */
-                *p_ino_num = dir_rec->dr_ino;
-                break;
+
+        /* answer from the name table, building it on first use. */
+        if (stamfs_names_enabled(dir->i_sb)) {
+                if (stamfs_names_lookup(dir, name, namelen, p_ino_num,
+                                        NULL, NULL))
+                        goto ret;
+                if (stamfs_names_build(dir) == 0 &&
+                    stamfs_names_lookup(dir, name, namelen, p_ino_num,
+                                        NULL, NULL))
+                        goto ret;
         }
 
-        /* all went well... */
-        goto ret;
+        err = stamfs_dir_find_entry(dir, name, namelen, &bh, &block_offset,
+                                    &de);
+        if (err == 0)
+                *p_ino_num = de.de_ino;
+        else if (err == -ENOENT)
+                err = 0; /* not found is not an error. */
 
-  ret_err:
-        /* fall through. */
-  ret:
         if (bh)
                 brelse(bh);
+  ret:
         STAMFS_DBG(DEB_STAM, "stamfs: returning %d, *p_ino_num=%lu\n",
                              err, *p_ino_num);
         return err;
 }
 
+/*
+ * Given a directory's inode and the number of an inode linked in it, copy
+ * the name of that inode into 'name' (which must have room for
+ * STAMFS_MAX_LONG_FNAME_LEN characters; it is not null-terminated).
+ * @return 0 on success, -ENOENT if the inode is not linked in this
+ *         directory, another negative error code on failure.
+ */
+int stamfs_dir_get_name_by_ino(struct inode *dir, unsigned long ino_num,
+                               char *name, int *p_namelen)
+{
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head *bh = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset;
+        int i;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: getting name of inode %lu, "
+                             "dir_inode=%lu\n", ino_num, dir->i_ino);
+
+        for (i = stamfs_dx_first_block(dir); i < num_blocks; i++) {
+                if (!(bh = stamfs_dir_bread(dir, i)))
+                        return -EIO;
+
+                /* scan the data block, looking for the given inode. */
+                offset = 0;
+                while (stamfs_dirent_next(dir->i_sb, bh->b_data, &offset, &de)) {
+                        if (de.de_ino != ino_num)
+                                continue;
+                        memcpy(name, de.de_name, de.de_name_len);
+                        *p_namelen = de.de_name_len;
+                        brelse(bh);
+                        return 0;
+                }
+
+                brelse(bh);
+        }
+
+        return -ENOENT;
+}
+
 /*
  * Given a directory's inode, create the data part of this directory on disk,
  * as an empty directory.
@@ -144,28 +435,22 @@ int stamfs_inode_make_empty_dir(struct inode *dir)
         int err = 0;
         struct super_block *sb = dir->i_sb;
         struct buffer_head *data_bh = NULL;
-        struct stamfs_dir_rec *last_dir_rec = NULL;
-        int data_block_num = 0;
+        unsigned long data_block_num = 0;
 
-        /* allocate a data block. */
-        data_block_num = stamfs_alloc_block(sb);
+        /* allocate it next to the directory's inode, if possible. */
+        data_block_num = stamfs_inode_alloc_first_block(dir);
         if (data_block_num == 0) {
                 err = -ENOSPC;
                 goto ret_err;
         }
 
-        /* initialize the directory's dir records block. */
-        if (!(data_bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read block %d.\n", data_block_num);
+        /* initialize the directory's dir records block, as an empty one. */
+        if (!(data_bh = stamfs_getblk_zeroed(sb, data_block_num))) {
+                printk("stamfs: unable to get block %lu.\n", data_block_num);
                 err = -EIO;
                 goto ret_err;
         }
-
-        /* the first entry should have its 'dr_ino' field set to 0, to mark
-         * end-of-list. */
-        last_dir_rec = (struct stamfs_dir_rec *)((char*)(data_bh->b_data));
-        memset(last_dir_rec, 0, sizeof(struct stamfs_dir_rec));
-        last_dir_rec->dr_ino = 0;
+        stamfs_dirent_init_block(sb, data_bh->b_data);
         mark_buffer_dirty(data_bh);
         buffer_insert_inode_data_queue(data_bh, dir);
 
@@ -177,7 +462,7 @@ int stamfs_inode_make_empty_dir(struct inode *dir)
         dir->i_size += STAMFS_BLOCK_SIZE;
         dir->i_blocks++;
         dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-        mark_inode_dirty(dir);
+        stamfs_dir_count_set(dir, 0);
 
         /* all went well... */
         err = 0;
@@ -192,6 +477,116 @@ int stamfs_inode_make_empty_dir(struct inode *dir)
         return err;
 }
 
+/*
+ * Add a new (empty) data block at the end of the given directory.
+ * on success, *p_bh holds the new block (to be released by the caller).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_add_block(struct inode *dir, struct buffer_head **p_bh)
+{
+        int err = 0;
+        struct super_block *sb = dir->i_sb;
+        struct buffer_head *data_bh = NULL;
+        unsigned long data_block_num = 0;
+        int block_offset = stamfs_dir_num_blocks(dir);
+
+        /* a directory is limited by its block index, like any file. */
+        if (block_offset >= STAMFS_MAX_BLOCKS_PER_FILE)
+                return -ENOSPC;
+
+        data_block_num = stamfs_alloc_block(sb);
+        if (data_block_num == 0)
+                return -ENOSPC;
+
+        if (!(data_bh = stamfs_getblk_zeroed(sb, data_block_num))) {
+                printk("stamfs: unable to get block %lu.\n", data_block_num);
+                err = -EIO;
+                goto ret_err;
+        }
+        stamfs_dirent_init_block(sb, data_bh->b_data);
+        mark_buffer_dirty(data_bh);
+        buffer_insert_inode_data_queue(data_bh, dir);
+
+        err = stamfs_inode_map_block_offset_to_number(dir, block_offset,
+                                                      data_block_num);
+        if (err)
+                goto ret_err;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir %lu grew to %d blocks\n",
+                             dir->i_ino, block_offset + 1);
+
+        dir->i_size += STAMFS_BLOCK_SIZE;
+        mark_inode_dirty(dir);
+        stamfs_usage_sync(dir);
+
+        /* older versions only look at the first block of a directory. */
+        stamfs_set_feature_ro_compat(sb, STAMFS_FEATURE_RO_COMPAT_LARGE_DIR);
+
+        *p_bh = data_bh;
+        return 0;
+
+  ret_err:
+        if (data_bh)
+                bforget(data_bh);
+        stamfs_release_block(sb, data_block_num);
+        return err;
+}
+
+/*
+ * Add an entry for the given name to the leaf of the given indexed
+ * directory that holds the name's hash - splitting the leaf if it's full.
+ * on success, *p_bh holds the leaf (to be released by the caller),
+ * *p_block_offset its block offset, and *p_offset the offset of the new
+ * entry inside it.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int stamfs_dir_leaf_add(struct inode *dir, const char *name,
+                               int namelen, unsigned long ino_num, int ftype,
+                               struct buffer_head **p_bh,
+                               int *p_block_offset, int *p_offset)
+{
+        int err = 0;
+        __u32 hash = stamfs_dir_hash(name, namelen);
+        struct buffer_head *bh = NULL;
+        unsigned int hint;
+        int block_offset;
+        int offset;
+        int tries;
+
+        for (tries = 0; tries < 2; tries++) {
+                err = stamfs_dx_find_leaf(dir, hash, &block_offset, NULL);
+                if (err)
+                        return err;
+
+                /* a leaf known to be full is split without reading it. */
+                hint = stamfs_dir_free_get(dir, block_offset);
+                if (hint < STAMFS_BLOCK_SIZE) {
+                        if (!(bh = stamfs_dir_bread(dir, block_offset)))
+                                return -EIO;
+                        offset = stamfs_dirent_add(dir->i_sb, bh->b_data,
+                                                   name, namelen, ino_num,
+                                                   ftype, &hint);
+                        stamfs_dir_free_set(dir, block_offset, hint);
+                        if (offset >= 0) {
+                                *p_bh = bh;
+                                *p_block_offset = block_offset;
+                                *p_offset = offset;
+                                return 0;
+                        }
+                        brelse(bh);
+                }
+
+                /* both halves of a split leaf have room. */
+                if (tries == 0) {
+                        err = stamfs_dx_split_leaf(dir, hash);
+                        if (err)
+                                return err;
+                }
+        }
+
+        return -ENOSPC;
+}
+
 /*
  * Given a directory's inode and a child inode, add this child inode as an
  * entry in the directory's data.
@@ -202,63 +597,102 @@ int stamfs_dir_add_link(struct inode *parent_dir, struct inode *child,
 {
         int err = 0;
         struct super_block *sb = parent_dir->i_sb;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(parent_dir);
+        int num_blocks = stamfs_dir_num_blocks(parent_dir);
+        int ftype = (S_ISDIR(child->i_mode) ? STAMFS_DIR_REC_FTYPE_DIR :
+                                              STAMFS_DIR_REC_FTYPE_FILE);
         struct buffer_head *data_bh = NULL;
-        struct stamfs_dir_rec *last_dir_rec = NULL;
-        int data_block_num = 0;
-
-        /* TODO - handle directories with more then one data block... */
+        int block_offset = 0;
+        int offset = -ENOSPC;
+        int free_block = -1;
+        unsigned int hint;
+        int i;
 
         STAMFS_DBG(DEB_STAM,
                    "stamfs: adding link, inode %lu -> inode %lu, name=%s\n",
                    parent_dir->i_ino, child->i_ino, name);
 
         /* sanity checks. */
-        if (namelen > STAMFS_MAX_FNAME_LEN) {
+        if (namelen > stamfs_dirent_max_name_len(sb)) {
                 err = -ENAMETOOLONG;
                 goto ret_err;
         }
 
-        err = stamfs_dir_get_data_block_num(parent_dir, &data_block_num);
-        if (err)
-                goto ret_err;
+        stamfs_dir_unsort(parent_dir);
 
-        /* read in the data block of the parent directory. */
-        STAMFS_DBG(DEB_STAM, "stamfs: dir data in block %d\n", data_block_num);
-        if (!(data_bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read dir data block.\n");
-                err = -EIO;
-                goto ret;
+        /* add the entry to the first data block with room for it. blocks
+         * below the directory's hint, or known to be full, are not read. */
+        i = inode_meta->i_dir_free_block;
+        if (i > num_blocks)
+                i = num_blocks;
+        for ( ; i < num_blocks && !stamfs_dx_indexed(parent_dir); i++) {
+                hint = stamfs_dir_free_get(parent_dir, i);
+                if (hint >= STAMFS_BLOCK_SIZE)
+                        continue;
+                if (!(data_bh = stamfs_dir_bread(parent_dir, i))) {
+                        err = -EIO;
+                        goto ret_err;
+                }
+
+                offset = stamfs_dirent_add(sb, data_bh->b_data, name, namelen,
+                                           child->i_ino, ftype, &hint);
+                stamfs_dir_free_set(parent_dir, i, hint);
+                if (free_block < 0 && hint < STAMFS_BLOCK_SIZE)
+                        free_block = i;
+                if (offset >= 0) {
+                        block_offset = i;
+                        break;
+                }
+
+                brelse(data_bh);
+                data_bh = NULL;
         }
 
-        /* find the last entry in the parent directory. */
-        /* TODO - if we find a freed entry in the middle of the list - we
-         * should use it instead. */
-        last_dir_rec = (struct stamfs_dir_rec *)((char*)(data_bh->b_data));
-        for ( ; ((char*)last_dir_rec) < ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE; last_dir_rec++) {
-                if (last_dir_rec->dr_ino == 0)
-                        break; /* last entry found. */
+        /* if no room found - grow the directory, or index it. */
+        if (!data_bh && !stamfs_dx_indexed(parent_dir)) {
+                if (stamfs_dx_enabled(sb) && num_blocks == 1) {
+                        err = stamfs_dx_make_index(parent_dir);
+                }
+                else {
+                        err = stamfs_dir_add_block(parent_dir, &data_bh);
+                        if (data_bh) {
+                                block_offset = num_blocks;
+                                hint = 0;
+                                offset = stamfs_dirent_add(sb, data_bh->b_data,
+                                                           name, namelen,
+                                                           child->i_ino, ftype,
+                                                           &hint);
+                                stamfs_dir_free_set(parent_dir, block_offset,
+                                                    hint);
+                                if (free_block < 0 &&
+                                    hint < STAMFS_BLOCK_SIZE)
+                                        free_block = block_offset;
+                        }
+                }
+                if (err)
+                        goto ret_err;
         }
 
-        /* if no free entry found... */
-        if (((char*)last_dir_rec) >= ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE) {
-                err = -ENOSPC;
+        /* in an indexed directory, the name goes to the leaf of its hash. */
+        if (!data_bh) {
+                err = stamfs_dir_leaf_add(parent_dir, name, namelen,
+                                          child->i_ino, ftype, &data_bh,
+                                          &block_offset, &offset);
+                if (err)
+                        goto ret_err;
+        }
+        if (offset < 0) {
+                err = offset;
                 goto ret_err;
         }
-
-        /* ok, populate the entry. */
-        last_dir_rec->dr_ino = cpu_to_le32(child->i_ino);
-        last_dir_rec->dr_name_len = namelen;
-        if (S_ISDIR(child->i_mode))
-                last_dir_rec->dr_ftype = STAMFS_DIR_REC_FTYPE_DIR;
-        else
-                last_dir_rec->dr_ftype = STAMFS_DIR_REC_FTYPE_FILE;
-        memcpy(last_dir_rec->dr_name, name, namelen);
-
-        /* mark the next entry as the last one, in case it contains 
-         * stale data. */
-        last_dir_rec++;
-        if (((char*)last_dir_rec) < ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE)
-                last_dir_rec->dr_ino = cpu_to_le32(0);
+        stamfs_names_add(parent_dir, name, namelen, child->i_ino,
+                         block_offset, offset);
+        stamfs_dir_count_add(parent_dir, 1);
+        stamfs_dir_bloom_add(parent_dir, block_offset,
+                             stamfs_dir_hash(name, namelen));
+        if (!stamfs_dx_indexed(parent_dir))
+                inode_meta->i_dir_free_block = (free_block >= 0 ? free_block :
+                                                block_offset + 1);
 
         mark_buffer_dirty(data_bh);
         buffer_insert_inode_data_queue(data_bh, parent_dir);
@@ -266,6 +700,9 @@ int stamfs_dir_add_link(struct inode *parent_dir, struct inode *child,
         parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
         mark_inode_dirty(parent_dir);
 
+        /* the child now counts in the usage of the parent's subtree. */
+        stamfs_usage_link(parent_dir, child);
+
         /* all went well... */
         err = 0;
         goto ret;
@@ -278,6 +715,143 @@ int stamfs_dir_add_link(struct inode *parent_dir, struct inode *child,
         return err;
 }
 
+/*
+ * Blocks of fixed-length entries keep the entries removed from them, so
+ * scans have to skip them. a block is compacted - its live entries packed
+ * at its start - once most of its entries were removed, and empty blocks at
+ * the end of a directory are freed. STAMFS_IOC_COMPACT_DIR does both for a
+ * whole directory.
+ */
+
+/* compact a block once at least this many of its entries were removed,
+ * and no less than the number of its live entries. */
+#define STAMFS_DIR_COMPACT_MIN_REMOVED  4
+
+/*
+ * Move the positions of the open files of the given (linear) directory
+ * that are inside the given block to where their next entries will be once
+ * the block is packed, so readdir neither skips nor repeats entries. the
+ * caller holds the directory's i_sem and the BKL, which readdir and llseek
+ * hold too.
+ */
+static void stamfs_dir_compact_fix_pos(struct inode *dir, int block_offset,
+                                       const char *block)
+{
+        struct super_block *sb = dir->i_sb;
+        /* note: the '+ 2' is because of the phony "." and ".." entries. */
+        loff_t block_pos = ((loff_t)block_offset << sb->s_blocksize_bits) + 2;
+        struct list_head *p;
+        struct file *filp;
+
+        file_list_lock();
+        list_for_each(p, &sb->s_files) {
+                filp = list_entry(p, struct file, f_list);
+                if (!filp->f_dentry || filp->f_dentry->d_inode != dir)
+                        continue;
+                if (filp->f_pos < block_pos ||
+                    filp->f_pos >= block_pos + STAMFS_BLOCK_SIZE)
+                        continue;
+                filp->f_pos = block_pos +
+                              stamfs_dirent_pack_offset(sb, block,
+                                                        filp->f_pos - block_pos);
+        }
+        file_list_unlock();
+}
+
+/*
+ * Pack the live entries of the given data block of the given directory at
+ * the block's start.
+ */
+static void stamfs_dir_compact_block(struct inode *dir, int block_offset,
+                                     struct buffer_head *bh)
+{
+        unsigned int hint;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: compacting block %d of dir %lu\n",
+                             block_offset, dir->i_ino);
+
+        /* positions in indexed directories are hashes - they don't move. */
+        if (!stamfs_dx_indexed(dir))
+                stamfs_dir_compact_fix_pos(dir, block_offset, bh->b_data);
+
+        hint = stamfs_dirent_pack(dir->i_sb, bh->b_data);
+        mark_buffer_dirty(bh);
+        buffer_insert_inode_data_queue(bh, dir);
+
+        stamfs_names_invalidate(dir);
+        stamfs_dir_bloom_build(dir, block_offset, bh->b_data);
+        stamfs_dir_free_set(dir, block_offset, hint);
+        stamfs_dir_free_lower(dir, block_offset, hint);
+}
+
+/*
+ * Free the empty data blocks at the end of the given (linear) directory,
+ * keeping at least one block.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_trim(struct inode *dir)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head *bh = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset;
+        int empty;
+
+        /* the leaves of an indexed directory are pointed to by its root. */
+        if (stamfs_dx_indexed(dir))
+                return 0;
+
+        while (num_blocks > 1) {
+                if (!(bh = stamfs_dir_bread(dir, num_blocks - 1)))
+                        return -EIO;
+                offset = 0;
+                empty = !stamfs_dirent_next(dir->i_sb, bh->b_data, &offset, &de);
+                brelse(bh);
+                if (!empty)
+                        break;
+                num_blocks--;
+                stamfs_dir_free_set(dir, num_blocks, 0);
+                stamfs_dir_bloom_clear(dir, num_blocks);
+        }
+        if (num_blocks == stamfs_dir_num_blocks(dir))
+                return 0;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir %lu shrinks to %d blocks\n",
+                             dir->i_ino, num_blocks);
+
+        /* readdir positions past the new end just find no more entries. */
+        dir->i_size = (loff_t)num_blocks << dir->i_sb->s_blocksize_bits;
+        if (inode_meta->i_dir_free_block > num_blocks)
+                inode_meta->i_dir_free_block = num_blocks;
+        return stamfs_inode_do_truncate(dir);
+}
+
+/*
+ * Compact the given directory - pack the live entries of each of its blocks
+ * at the block's start, and free the empty blocks at its end. the caller
+ * holds the directory's i_sem and the BKL.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_compact(struct inode *dir)
+{
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head *bh = NULL;
+        int live, removed;
+        int i;
+
+        for (i = stamfs_dx_first_block(dir); i < num_blocks; i++) {
+                if (!(bh = stamfs_dir_bread(dir, i)))
+                        return -EIO;
+                stamfs_dirent_count(dir->i_sb, bh->b_data, &live, &removed);
+                if (removed > 0)
+                        stamfs_dir_compact_block(dir, i, bh);
+                brelse(bh);
+        }
+
+        return stamfs_dir_trim(dir);
+}
+
 /*
  * Given a directory's inode and a child inode, remove this child inode from
  * the directory's list-of-entries.
@@ -287,70 +861,48 @@ int stamfs_dir_del_link(struct inode *parent_dir, struct inode *child,
                         const char *name, int namelen)
 {
         int err = 0;
-        struct super_block *sb = parent_dir->i_sb;
         struct buffer_head *data_bh = NULL;
-        struct stamfs_dir_rec *dir_rec = NULL;
-        struct stamfs_dir_rec *next_dir_rec = NULL;
-        int data_block_num = 0;
-        int found_child = 0;
-
-        /* TODO - handle directories with more then one data block... */
+        struct stamfs_dirent de;
+        int block_offset;
+        unsigned int free_offset;
+        int live, removed;
+        int trim = 0;
 
         STAMFS_DBG(DEB_STAM,
                    "stamfs: removing link, inode %lu -/-> inode %lu, name=%s\n",
                    parent_dir->i_ino, child->i_ino, name);
 
-        err = stamfs_dir_get_data_block_num(parent_dir, &data_block_num);
-        if (err)
-                goto ret_err;
-
-        /* read in the data block of the parent directory. */
-        STAMFS_DBG(DEB_STAM, "stamfs: dir data in block %d\n", data_block_num);
-        if (!(data_bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read dir data block.\n");
-                err = -EIO;
-                goto ret_err;
-        }
-
         /* find the child's entry in the parent directory. */
-        dir_rec = (struct stamfs_dir_rec *)((char*)(data_bh->b_data));
-        for ( ; ((char*)dir_rec) < ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE; dir_rec++) {
-                STAMFS_DBG(DEB_STAM,
-                           "stamfs: next entry: ino=%d, name=%s, namelen=%d\n",
-                           dir_rec->dr_ino,
-                           (dir_rec->dr_ino ? dir_rec->dr_name : "(null)"),
-                           dir_rec->dr_name_len);
-                if (le32_to_cpu(dir_rec->dr_ino) == 0)
-                        break; /* last entry. */
-                if (le32_to_cpu(dir_rec->dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
-                        continue; /* empty entry. */
-                if (dir_rec->dr_name_len != namelen)
-                        continue;
-                if (memcmp(dir_rec->dr_name, name, namelen) != 0)
-                        continue;
-                /* we have a match. */
-                found_child = 1;
-                break;
-        }
-
-        if (!found_child) {
-                err = -ENOENT;
+        err = stamfs_dir_find_entry(parent_dir, name, namelen,
+                                    &data_bh, &block_offset, &de);
+        if (err)
                 goto ret_err;
-        }
 
-        /* mark this entry as free, unless it's the one before last. */
-        next_dir_rec = dir_rec + 1;
-        if ( ((char*)next_dir_rec) < ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE && le32_to_cpu(next_dir_rec->dr_ino) != 0)
-                dir_rec->dr_ino = cpu_to_le32(STAMFS_FREE_DIR_REC_MARKER);
-        else
-                dir_rec->dr_ino = cpu_to_le32(0);
-
-        /* clear up the fields, just for safety. */
-        dir_rec->dr_name_len = 0;
-        dir_rec->dr_ftype = STAMFS_DIR_REC_FTYPE_UNKNOWN;
-        dir_rec->dr_name[0] = '\0';
+        stamfs_dir_unsort(parent_dir);
+        free_offset = stamfs_dirent_del(parent_dir->i_sb, data_bh->b_data,
+                                        de.de_offset);
         mark_buffer_dirty(data_bh);
         buffer_insert_inode_data_queue(data_bh, parent_dir);
+        stamfs_names_del(parent_dir, name, namelen);
+        stamfs_dir_free_lower(parent_dir, block_offset, free_offset);
+        stamfs_dir_count_add(parent_dir, -1);
+
+        /* compact the block if it's mostly removed entries, and free it if
+         * it's an empty block at the end of the directory. */
+        stamfs_dirent_count(parent_dir->i_sb, data_bh->b_data,
+                            &live, &removed);
+        if (removed >= STAMFS_DIR_COMPACT_MIN_REMOVED && removed >= live)
+                stamfs_dir_compact_block(parent_dir, block_offset, data_bh);
+        trim = (live == 0 &&
+                block_offset == stamfs_dir_num_blocks(parent_dir) - 1);
+
+        /* the child no longer counts in the usage of the parent's subtree. */
+        stamfs_usage_unlink(parent_dir, child);
+
+        brelse(data_bh);
+        data_bh = NULL;
+        if (trim)
+                stamfs_dir_trim(parent_dir);
 
         /* all went well... */
         err = 0;
@@ -364,6 +916,48 @@ int stamfs_dir_del_link(struct inode *parent_dir, struct inode *child,
         return err;
 }
 
+/*
+ * Get the number of entries of the given directory (not counting "." and
+ * ".."), counting them if it doesn't keep a count yet. the caller keeps the
+ * directory's entries from changing (with its i_sem, or i_zombie in rmdir).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_get_entries(struct inode *dir, unsigned long *p_count)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head *data_bh = NULL;
+        struct stamfs_dirent de;
+        unsigned long count = 0;
+        unsigned int offset;
+        int i;
+
+        if (stamfs_dir_counted(dir)) {
+                *p_count = inode_meta->i_dir_entries;
+                return 0;
+        }
+
+        STAMFS_DBG(DEB_STAM, "stamfs: counting entries of dir %lu\n",
+                             dir->i_ino);
+
+        for (i = stamfs_dx_first_block(dir); i < num_blocks; i++) {
+                if (!(data_bh = stamfs_dir_bread(dir, i)))
+                        return -EIO;
+
+                offset = 0;
+                while (stamfs_dirent_next(dir->i_sb, data_bh->b_data,
+                                          &offset, &de))
+                        count++;
+
+                brelse(data_bh);
+        }
+
+        if (!IS_RDONLY(dir))
+                stamfs_dir_count_set(dir, count);
+        *p_count = count;
+        return 0;
+}
+
 /*
  * Given a directory's inode, check if this directory is empty.
  * returns 0 if it is, 1 if it's not, a negative value in case of an error
@@ -371,47 +965,15 @@ int stamfs_dir_del_link(struct inode *parent_dir, struct inode *child,
  */
 int stamfs_dir_is_empty(struct inode *dir)
 {
-        int err = 0; /* assume the directory is empty. */
-        struct super_block *sb = dir->i_sb;
-        struct buffer_head *data_bh = NULL;
-        struct stamfs_dir_rec *last_dir_rec = NULL;
-        int data_block_num = 0;
-
-        /* TODO - handle directories with more then one data block... */
+        unsigned long count = 0;
+        int err;
 
         STAMFS_DBG(DEB_STAM, "stamfs: checking if dir empty,inode %lu\n",
                              dir->i_ino);
 
-        err = stamfs_dir_get_data_block_num(dir, &data_block_num);
+        err = stamfs_dir_get_entries(dir, &count);
         if (err)
-                goto ret_err;
+                return err;
 
-        /* read in the data block of the directory. */
-        STAMFS_DBG(DEB_STAM, "stamfs: dir data in block %d\n", data_block_num);
-        if (!(data_bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read dir data block.\n");
-                err = -EIO;
-                goto ret_err;
-        }
-
-        /* find if there's any entry in the directory. */
-        last_dir_rec = (struct stamfs_dir_rec *)((char*)(data_bh->b_data));
-        for ( ; ((char*)last_dir_rec) < ((char*)data_bh->b_data) + STAMFS_BLOCK_SIZE; last_dir_rec++) {
-                if (le32_to_cpu(last_dir_rec->dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
-                        continue;
-                if (le32_to_cpu(last_dir_rec->dr_ino) == 0)
-                        break;
-                /* found a real entry - not empty. */
-                err = 1;
-        }
-
-        /* all went well... */
-        goto ret;
-
-  ret_err:
-        /* fallthrough */
-  ret:
-        if (data_bh)
-                brelse(data_bh);
-        return err;
+        return (count != 0);
 }
@@ -9,17 +9,39 @@
 
 #include <linux/fs.h>
 
+/* the number of data blocks of the given directory. */
+static inline int stamfs_dir_num_blocks(struct inode *dir)
+{
+        return dir->i_size >> dir->i_sb->s_blocksize_bits;
+}
+
 /*
- * return the block number of the (first) data block of the given directory.
+ * return the block number of the data block at the given block offset of
+ * the given directory.
  * returns a negative error code, in case of an error, 0 on success.
  */
-int stamfs_dir_get_data_block_num(struct inode *dir, int *p_data_block_num);
+int stamfs_dir_get_data_block_num(struct inode *dir, int block_offset,
+                                  unsigned long *p_data_block_num);
 
 /*
  * set the block number of the (first) data block of the given directory.
  * returns a negative error code, in case of an error.
  */
-int stamfs_dir_set_data_block_num(struct inode *dir, int data_block_num);
+int stamfs_dir_set_data_block_num(struct inode *dir,
+                                  unsigned long data_block_num);
+
+/*
+ * Read in the data block at the given block offset of the given directory.
+ * returns the block's buffer, or NULL on failure.
+ */
+struct buffer_head *stamfs_dir_bread(struct inode *dir, int block_offset);
+
+/*
+ * Add a new (empty) data block at the end of the given directory.
+ * on success, *p_bh holds the new block (to be released by the caller).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_add_block(struct inode *dir, struct buffer_head **p_bh);
 
 /*
  * Given a directory's inode and a file-name, returns the inode number of
@@ -30,6 +52,16 @@ int stamfs_dir_set_data_block_num(struct inode *dir, int data_block_num);
 int stamfs_dir_get_file_by_name(struct inode *dir, const char *name,
                                 int namelen, ino_t* p_ino_num);
 
+/*
+ * Given a directory's inode and the number of an inode linked in it, copy
+ * the name of that inode into 'name' (which must have room for
+ * STAMFS_MAX_LONG_FNAME_LEN characters; it is not null-terminated).
+ * @return 0 on success, -ENOENT if the inode is not linked in this
+ *         directory, another negative error code on failure.
+ */
+int stamfs_dir_get_name_by_ino(struct inode *dir, unsigned long ino_num,
+                               char *name, int *p_namelen);
+
 /*
  * Given a directory's inode, create the data part of this directory on disk,
  * as an empty directory.
@@ -53,6 +85,14 @@ int stamfs_dir_add_link(struct inode *parent_dir, struct inode *child,
 int stamfs_dir_del_link(struct inode *parent_dir, struct inode *child,
                         const char *name, int namelen);
 
+/*
+ * Get the number of entries of the given directory (not counting "." and
+ * ".."), counting them if it doesn't keep a count yet. the caller keeps the
+ * directory's entries from changing (with its i_sem, or i_zombie in rmdir).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_get_entries(struct inode *dir, unsigned long *p_count);
+
 /*
  * Given a directory's inode, check if this directory is empty.
  * returns 0 if it is, 1 if it's not, a negative value in case of an error
@@ -60,4 +100,25 @@ int stamfs_dir_del_link(struct inode *parent_dir, struct inode *child,
  */
 int stamfs_dir_is_empty(struct inode *dir);
 
+/*
+ * Entries of the given directory were moved around on disk - drop its free
+ * space hints. blocks will be searched for room again.
+ */
+void stamfs_dir_free_invalidate(struct inode *dir);
+
+/*
+ * Free the empty data blocks at the end of the given (linear) directory,
+ * keeping at least one block.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_trim(struct inode *dir);
+
+/*
+ * Compact the given directory - pack the live entries of each of its blocks
+ * at the block's start, and free the empty blocks at its end. the caller
+ * holds the directory's i_sem and the BKL.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dir_compact(struct inode *dir);
+
 #endif /* STAMFS_DIR_H */
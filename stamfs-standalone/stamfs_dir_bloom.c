@@ -0,0 +1,259 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_dir_bloom.h"
+#include "stamfs_cache.h"
+#include "stamfs_dirent.h"
+
+/*
+ * A directory of several data blocks keeps, in memory, a Bloom filter per
+ * block: a few bits set by the hash of each name added to the block. a
+ * lookup tests the filter of each block before reading it - if one of the
+ * name's bits is clear, the name is surely not in the block, and the block
+ * is skipped. so a lookup of a name that doesn't exist reads no blocks at
+ * all, once the filters are built.
+ *
+ * a block's filter is built when a lookup scans the block without finding
+ * the name, and when the block is compacted. adding an entry sets its bits.
+ * removing an entry can't clear them, so filters only get less selective
+ * until their blocks are compacted. a block whose filter was not built
+ * yet (or was dropped, because entries were moved around) is always read.
+ *
+ * like the other decoded meta-data of directories, the filters are evicted
+ * by the per-mount LRU cache (see stamfs_cache.c), and protected by the
+ * directory's i_bmap_lock. they are changed only under the directory's
+ * i_sem.
+ */
+
+/* the size of the filter of a block, and the number of its bits set by
+ * each name - about 1 in 200 false positives for a block full of fixed-length
+ * entries, and 1 in 20 for short variable-length ones. */
+#define STAMFS_DIR_BLOOM_BITS   512
+#define STAMFS_DIR_BLOOM_HASHES 4
+
+#define STAMFS_DIR_BLOOM_WORDS  (STAMFS_DIR_BLOOM_BITS / 32)
+
+struct stamfs_dir_bloom {
+        int db_num_blocks;              /* the blocks with room for filters. */
+        unsigned char *db_valid;        /* per block, is its filter built? */
+        __u32 db_filters[0];            /* STAMFS_DIR_BLOOM_WORDS per block. */
+};
+
+/* the index of the i-th bit of a name with the given hash - double hashing,
+ * by the two halves of the hash. */
+static inline unsigned int stamfs_dir_bloom_bit(__u32 hash, int i)
+{
+        return ((hash & 0xffff) + i * ((hash >> 16) | 1)) %
+               STAMFS_DIR_BLOOM_BITS;
+}
+
+static void stamfs_dir_bloom_set(__u32 *filter, __u32 hash)
+{
+        unsigned int bit;
+        int i;
+
+        for (i = 0; i < STAMFS_DIR_BLOOM_HASHES; i++) {
+                bit = stamfs_dir_bloom_bit(hash, i);
+                filter[bit / 32] |= (1U << (bit % 32));
+        }
+}
+
+static int stamfs_dir_bloom_test(const __u32 *filter, __u32 hash)
+{
+        unsigned int bit;
+        int i;
+
+        for (i = 0; i < STAMFS_DIR_BLOOM_HASHES; i++) {
+                bit = stamfs_dir_bloom_bit(hash, i);
+                if (!(filter[bit / 32] & (1U << (bit % 32))))
+                        return 0;
+        }
+        return 1;
+}
+
+/*
+ * Allocate filters for the given number of blocks, none of them built.
+ * returns the filters, or NULL if out of memory.
+ */
+static struct stamfs_dir_bloom *stamfs_dir_bloom_alloc(int num_blocks)
+{
+        struct stamfs_dir_bloom *bloom;
+        size_t filters_size = num_blocks * STAMFS_DIR_BLOOM_WORDS *
+                              sizeof(__u32);
+
+        bloom = kmalloc(sizeof(*bloom) + filters_size + num_blocks, GFP_NOFS);
+        if (!bloom)
+                return NULL;
+
+        bloom->db_num_blocks = num_blocks;
+        bloom->db_valid = (unsigned char *)bloom->db_filters + filters_size;
+        memset(bloom->db_valid, 0, num_blocks);
+
+        return bloom;
+}
+
+/* copy the built filters of the given filters into the given other ones. */
+static void stamfs_dir_bloom_copy(struct stamfs_dir_bloom *to,
+                                  struct stamfs_dir_bloom *from)
+{
+        int num_blocks = (from->db_num_blocks < to->db_num_blocks ?
+                          from->db_num_blocks : to->db_num_blocks);
+
+        memcpy(to->db_filters, from->db_filters,
+               num_blocks * STAMFS_DIR_BLOOM_WORDS * sizeof(__u32));
+        memcpy(to->db_valid, from->db_valid, num_blocks);
+}
+
+/*
+ * Free the given filters, which are no longer attached to their directory.
+ */
+void stamfs_dir_bloom_free(struct stamfs_dir_bloom *bloom)
+{
+        kfree(bloom);
+}
+
+/*
+ * Does the Bloom filter of the given data block of the given directory rule
+ * out the name with the given stamfs_dir_hash()?
+ * @return 1 if the block surely doesn't hold the name, 0 if it may.
+ */
+int stamfs_dir_bloom_skip(struct inode *dir, int block_offset, __u32 hash)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_dir_bloom *bloom;
+        int skip = 0;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bloom = inode_meta->i_dir_bloom;
+        if (bloom && block_offset < bloom->db_num_blocks &&
+            bloom->db_valid[block_offset])
+                skip = !stamfs_dir_bloom_test(bloom->db_filters +
+                                              block_offset *
+                                              STAMFS_DIR_BLOOM_WORDS, hash);
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        return skip;
+}
+
+/*
+ * Build the Bloom filter of the given data block of the given directory,
+ * from the block's contents.
+ */
+void stamfs_dir_bloom_build(struct inode *dir, int block_offset,
+                            const char *block)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct stamfs_dir_bloom *bloom = NULL;
+        struct stamfs_dir_bloom *old = NULL;
+        __u32 filter[STAMFS_DIR_BLOOM_WORDS];
+        struct stamfs_dirent de;
+        unsigned int offset = 0;
+        int grow;
+        int built = 0;
+
+        /* a directory of a single block is read anyway. */
+        if (num_blocks < 2 || block_offset >= num_blocks)
+                return;
+
+        memset(filter, 0, sizeof(filter));
+        while (stamfs_dirent_next(dir->i_sb, block, &offset, &de))
+                stamfs_dir_bloom_set(filter,
+                                     stamfs_dir_hash(de.de_name,
+                                                     de.de_name_len));
+
+        /* filters that don't cover the block are replaced by bigger ones.
+         * without memory for them, blocks are just read. */
+        spin_lock(&inode_meta->i_bmap_lock);
+        grow = (!inode_meta->i_dir_bloom ||
+                block_offset >= inode_meta->i_dir_bloom->db_num_blocks);
+        spin_unlock(&inode_meta->i_bmap_lock);
+        if (grow && !(bloom = stamfs_dir_bloom_alloc(num_blocks)))
+                return;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (bloom) {
+                old = inode_meta->i_dir_bloom;
+                if (old)
+                        stamfs_dir_bloom_copy(bloom, old);
+                inode_meta->i_dir_bloom = bloom;
+        }
+        /* (the filters may have been evicted meanwhile.) */
+        bloom = inode_meta->i_dir_bloom;
+        if (bloom && block_offset < bloom->db_num_blocks) {
+                memcpy(bloom->db_filters + block_offset * STAMFS_DIR_BLOOM_WORDS,
+                       filter, sizeof(filter));
+                bloom->db_valid[block_offset] = 1;
+                built = 1;
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (old)
+                stamfs_dir_bloom_free(old);
+        /* every filter built is decoded meta-data, like a block map - not
+           just a newly allocated array of them. */
+        if (built)
+                stamfs_cache_insert(dir);
+}
+
+/*
+ * An entry with the name with the given stamfs_dir_hash() was added to the
+ * given data block of the given directory - add it to the block's filter.
+ */
+void stamfs_dir_bloom_add(struct inode *dir, int block_offset, __u32 hash)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_dir_bloom *bloom;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bloom = inode_meta->i_dir_bloom;
+        if (bloom && block_offset < bloom->db_num_blocks &&
+            bloom->db_valid[block_offset])
+                stamfs_dir_bloom_set(bloom->db_filters +
+                                     block_offset * STAMFS_DIR_BLOOM_WORDS,
+                                     hash);
+        spin_unlock(&inode_meta->i_bmap_lock);
+}
+
+/*
+ * The given data block of the given directory was freed - drop its filter.
+ */
+void stamfs_dir_bloom_clear(struct inode *dir, int block_offset)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_dir_bloom *bloom;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bloom = inode_meta->i_dir_bloom;
+        if (bloom && block_offset < bloom->db_num_blocks)
+                bloom->db_valid[block_offset] = 0;
+        spin_unlock(&inode_meta->i_bmap_lock);
+}
+
+/*
+ * Entries of the given directory were moved around on disk - drop the
+ * filters of all its blocks.
+ */
+void stamfs_dir_bloom_invalidate(struct inode *dir)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_dir_bloom *bloom;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bloom = inode_meta->i_dir_bloom;
+        inode_meta->i_dir_bloom = NULL;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (bloom)
+                stamfs_dir_bloom_free(bloom);
+}
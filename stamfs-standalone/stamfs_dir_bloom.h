@@ -0,0 +1,53 @@
+
+#ifndef STAMFS_DIR_BLOOM_H
+#define STAMFS_DIR_BLOOM_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+
+/*
+ * Functions that maintain the in-memory Bloom filters of the data blocks of
+ * directories, which let lookups skip blocks that don't hold a name.
+ */
+
+struct stamfs_dir_bloom;
+
+/*
+ * Does the Bloom filter of the given data block of the given directory rule
+ * out the name with the given stamfs_dir_hash()?
+ * @return 1 if the block surely doesn't hold the name, 0 if it may.
+ */
+int stamfs_dir_bloom_skip(struct inode *dir, int block_offset, __u32 hash);
+
+/*
+ * Build the Bloom filter of the given data block of the given directory,
+ * from the block's contents.
+ */
+void stamfs_dir_bloom_build(struct inode *dir, int block_offset,
+                            const char *block);
+
+/*
+ * An entry with the name with the given stamfs_dir_hash() was added to the
+ * given data block of the given directory - add it to the block's filter.
+ */
+void stamfs_dir_bloom_add(struct inode *dir, int block_offset, __u32 hash);
+
+/*
+ * The given data block of the given directory was freed - drop its filter.
+ */
+void stamfs_dir_bloom_clear(struct inode *dir, int block_offset);
+
+/*
+ * Entries of the given directory were moved around on disk - drop the
+ * filters of all its blocks.
+ */
+void stamfs_dir_bloom_invalidate(struct inode *dir);
+
+/*
+ * Free the given filters, which are no longer attached to their directory.
+ */
+void stamfs_dir_bloom_free(struct stamfs_dir_bloom *bloom);
+
+#endif /* STAMFS_DIR_BLOOM_H */
@@ -0,0 +1,381 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_names.h"
+#include "stamfs_dir_bloom.h"
+#include "stamfs_dirent.h"
+
+/*
+ * An indexed directory has a single level of index: its first data block is
+ * the root, mapping ranges of name hashes to leaves (see struct
+ * stamfs_dx_root in stamfs.h). a lookup thus reads the root, binary-searches
+ * it for the name's hash, and scans a single leaf. when a leaf fills up, it
+ * is split in two at the median hash of its entries, and the new leaf is
+ * added to the root. the number of leaves is bounded by the size of the
+ * root, and by the directory's block index. the root holds no entries, and
+ * is skipped by scans of the whole directory.
+ */
+
+/* the hash of an entry's name, and the entry's offset in a copy of its
+ * leaf - used for splitting. */
+struct stamfs_dx_sort_rec {
+        __u32 sr_hash;
+        unsigned int sr_offset;
+};
+
+/*
+ * Calculate the hash of the given name - a number between 0 and
+ * STAMFS_DX_HASH_MAX.
+ */
+__u32 stamfs_dir_hash(const char *name, int namelen)
+{
+        __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+        while (namelen--) {
+                hash = hash1 + (hash0 ^ (*name++ * 7152373));
+                if (hash & 0x80000000)
+                        hash -= 0x7fffffff;
+                hash1 = hash0;
+                hash0 = hash;
+        }
+
+        return hash0 & STAMFS_DX_HASH_MAX;
+}
+
+/* the maximal number of leaves of an indexed directory. */
+static inline int stamfs_dx_limit(struct super_block *sb)
+{
+        int limit = STAMFS_DX_ENTRIES_PER_ROOT;
+
+        /* the root itself takes one pointer of the block index. */
+        if (limit > STAMFS_MAX_BLOCKS_PER_FILE - 1)
+                limit = STAMFS_MAX_BLOCKS_PER_FILE - 1;
+        return limit;
+}
+
+/*
+ * Read in the root of the given indexed directory, and make sure it's sane.
+ * returns the root's buffer, or NULL on failure.
+ */
+static struct buffer_head *stamfs_dx_read_root(struct inode *dir)
+{
+        struct buffer_head *bh = NULL;
+        struct stamfs_dx_root *root = NULL;
+        int count;
+
+        if (!(bh = stamfs_dir_bread(dir, 0)))
+                return NULL;
+
+        root = (struct stamfs_dx_root *)((char*)(bh->b_data));
+        count = le16_to_cpu(root->dx_count);
+        if (count < 1 || count > stamfs_dx_limit(dir->i_sb) ||
+            le32_to_cpu(root->dx_entries[0].de_hash) != 0) {
+                printk("stamfs: corrupt index root in directory %lu.\n",
+                       dir->i_ino);
+                brelse(bh);
+                return NULL;
+        }
+
+        return bh;
+}
+
+/*
+ * Binary-search the given index root for the entry covering the given hash.
+ * returns the entry's position in the root.
+ */
+static int stamfs_dx_search(struct stamfs_dx_root *root, __u32 hash)
+{
+        int low = 0;
+        int high = le16_to_cpu(root->dx_count) - 1;
+        int mid;
+
+        /* dx_entries[0] has hash 0, so it always covers the given hash. */
+        while (low < high) {
+                mid = (low + high + 1) / 2;
+                if (le32_to_cpu(root->dx_entries[mid].de_hash) <= hash)
+                        low = mid;
+                else
+                        high = mid - 1;
+        }
+
+        return low;
+}
+
+/*
+ * Given an indexed directory and a name hash, find the block offset of the
+ * leaf that holds the names with this hash.
+ * if p_next_hash is not NULL, it gets the lowest hash held by the following
+ * leaves (STAMFS_DX_HASH_MAX + 1 for the last leaf).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dx_find_leaf(struct inode *dir, __u32 hash, int *p_block_offset,
+                        unsigned long *p_next_hash)
+{
+        struct buffer_head *root_bh = NULL;
+        struct stamfs_dx_root *root = NULL;
+        int block_offset;
+        int i;
+
+        if (!(root_bh = stamfs_dx_read_root(dir)))
+                return -EIO;
+        root = (struct stamfs_dx_root *)((char*)(root_bh->b_data));
+
+        i = stamfs_dx_search(root, hash);
+        block_offset = le32_to_cpu(root->dx_entries[i].de_block);
+        if (p_next_hash) {
+                if (i + 1 < le16_to_cpu(root->dx_count))
+                        *p_next_hash =
+                                le32_to_cpu(root->dx_entries[i+1].de_hash);
+                else
+                        *p_next_hash = (unsigned long)STAMFS_DX_HASH_MAX + 1;
+        }
+        brelse(root_bh);
+
+        if (block_offset < 1 || block_offset >= stamfs_dir_num_blocks(dir)) {
+                printk("stamfs: directory %lu has an index entry for a "
+                       "bad leaf %d.\n", dir->i_ino, block_offset);
+                return -EIO;
+        }
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir %lu, hash 0x%x is in leaf %d\n",
+                             dir->i_ino, hash, block_offset);
+
+        *p_block_offset = block_offset;
+        return 0;
+}
+
+/*
+ * Turn the given (linear, single block) directory into an indexed
+ * directory, with all its entries in a single leaf.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dx_make_index(struct inode *dir)
+{
+        int err = 0;
+        struct buffer_head *root_bh = NULL;
+        struct buffer_head *leaf_bh = NULL;
+        struct stamfs_dx_root *root = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset = 0;
+        unsigned int hint = 0;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: indexing directory %lu\n", dir->i_ino);
+
+        if (stamfs_dir_num_blocks(dir) != 1)
+                return -EINVAL;
+
+        if (!(root_bh = stamfs_dir_bread(dir, 0)))
+                return -EIO;
+
+        /* the new block becomes the directory's single leaf. */
+        err = stamfs_dir_add_block(dir, &leaf_bh);
+        if (err)
+                goto ret;
+
+        /* move the live entries of the first block into the leaf. */
+        while (stamfs_dirent_next(dir->i_sb, root_bh->b_data, &offset, &de))
+                stamfs_dirent_add(dir->i_sb, leaf_bh->b_data, de.de_name,
+                                  de.de_name_len, de.de_ino, de.de_ftype,
+                                  &hint);
+        mark_buffer_dirty(leaf_bh);
+        buffer_insert_inode_data_queue(leaf_bh, dir);
+
+        /* and turn the first block into the root, pointing at the leaf. */
+        memset(root_bh->b_data, 0, STAMFS_BLOCK_SIZE);
+        root = (struct stamfs_dx_root *)((char*)(root_bh->b_data));
+        root->dx_count = cpu_to_le16(1);
+        root->dx_entries[0].de_hash = cpu_to_le32(0);
+        root->dx_entries[0].de_block = cpu_to_le32(1);
+        mark_buffer_dirty(root_bh);
+        buffer_insert_inode_data_queue(root_bh, dir);
+
+        STAMFS_INODE_META(dir)->i_flags |= STAMFS_INODE_FL_INDEX;
+        /* readdir positions change from byte offsets to hashes. */
+        dir->i_version++;
+        mark_inode_dirty(dir);
+        stamfs_names_invalidate(dir);
+        stamfs_dir_free_invalidate(dir);
+        stamfs_dir_bloom_invalidate(dir);
+
+  ret:
+        if (leaf_bh)
+                brelse(leaf_bh);
+        brelse(root_bh);
+        return err;
+}
+
+/*
+ * Sort the given entries by their hashes (there are few of them, so an
+ * insertion sort will do).
+ */
+static void stamfs_dx_sort(struct stamfs_dx_sort_rec *recs, int count)
+{
+        struct stamfs_dx_sort_rec tmp;
+        int i, j;
+
+        for (i = 1; i < count; i++) {
+                if (recs[i-1].sr_hash <= recs[i].sr_hash)
+                        continue;
+                memcpy(&tmp, &recs[i], sizeof(tmp));
+                for (j = i; j > 0 && recs[j-1].sr_hash > tmp.sr_hash; j--)
+                        memcpy(&recs[j], &recs[j-1], sizeof(tmp));
+                memcpy(&recs[j], &tmp, sizeof(tmp));
+        }
+}
+
+/*
+ * Fill the given leaf with the given (sorted) entries of the given copy of
+ * a leaf.
+ * @return 0 on success, -ENOSPC if they don't all fit.
+ */
+static int stamfs_dx_fill_leaf(struct inode *dir, struct buffer_head *bh,
+                               const char *copy,
+                               struct stamfs_dx_sort_rec *recs, int count)
+{
+        struct super_block *sb = dir->i_sb;
+        struct stamfs_dirent de;
+        unsigned int hint = 0;
+        int err = 0;
+        int i;
+
+        stamfs_dirent_init_block(sb, bh->b_data);
+        for (i = 0; i < count; i++) {
+                stamfs_dirent_get(sb, copy, recs[i].sr_offset, &de);
+                if (stamfs_dirent_add(sb, bh->b_data, de.de_name,
+                                      de.de_name_len, de.de_ino,
+                                      de.de_ftype, &hint) < 0)
+                        err = -ENOSPC;
+        }
+        mark_buffer_dirty(bh);
+        buffer_insert_inode_data_queue(bh, dir);
+
+        return err;
+}
+
+/*
+ * Split the leaf of the given indexed directory that holds the names with
+ * the given hash, moving the upper half of its hashes into a new leaf.
+ * @return 0 on success, a negative error code on failure (-ENOSPC if the
+ *         index is full, or the leaf holds a single hash).
+ */
+int stamfs_dx_split_leaf(struct inode *dir, __u32 hash)
+{
+        int err = 0;
+        struct buffer_head *root_bh = NULL;
+        struct buffer_head *leaf_bh = NULL;
+        struct buffer_head *new_bh = NULL;
+        struct stamfs_dx_root *root = NULL;
+        struct stamfs_dx_sort_rec *recs = NULL;
+        char *copy = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset = 0;
+        int count, split, nrecs = 0;
+        int block_offset, new_block_offset;
+        __u32 split_hash;
+        int i;
+
+        if (!(root_bh = stamfs_dx_read_root(dir)))
+                return -EIO;
+        root = (struct stamfs_dx_root *)((char*)(root_bh->b_data));
+        count = le16_to_cpu(root->dx_count);
+        if (count >= stamfs_dx_limit(dir->i_sb)) {
+                err = -ENOSPC;
+                goto ret;
+        }
+
+        i = stamfs_dx_search(root, hash);
+        block_offset = le32_to_cpu(root->dx_entries[i].de_block);
+        if (!(leaf_bh = stamfs_dir_bread(dir, block_offset))) {
+                err = -EIO;
+                goto ret;
+        }
+
+        /* collect the live entries of (a copy of) the leaf, sorted by hash. */
+        copy = kmalloc(STAMFS_BLOCK_SIZE +
+                       STAMFS_DIR_MAX_ENTRIES_PER_BLOCK * sizeof(*recs),
+                       GFP_KERNEL);
+        if (!copy) {
+                err = -ENOMEM;
+                goto ret;
+        }
+        recs = (struct stamfs_dx_sort_rec *)(copy + STAMFS_BLOCK_SIZE);
+        memcpy(copy, leaf_bh->b_data, STAMFS_BLOCK_SIZE);
+        while (nrecs < STAMFS_DIR_MAX_ENTRIES_PER_BLOCK &&
+               stamfs_dirent_next(dir->i_sb, copy, &offset, &de)) {
+                recs[nrecs].sr_hash = stamfs_dir_hash(de.de_name,
+                                                      de.de_name_len);
+                recs[nrecs].sr_offset = de.de_offset;
+                nrecs++;
+        }
+        stamfs_dx_sort(recs, nrecs);
+
+        /* split near the middle - but never between names of equal hash,
+         * as lookups search a single leaf. */
+        split = nrecs / 2;
+        while (split < nrecs && split > 0 &&
+               recs[split].sr_hash == recs[split-1].sr_hash)
+                split++;
+        if (split == nrecs) {
+                split = nrecs / 2;
+                while (split > 0 &&
+                       recs[split].sr_hash == recs[split-1].sr_hash)
+                        split--;
+        }
+        if (split == 0) {
+                /* just free space to compact - or a single hash. */
+                stamfs_dx_fill_leaf(dir, leaf_bh, copy, recs, nrecs);
+                stamfs_names_invalidate(dir);
+                stamfs_dir_free_invalidate(dir);
+                stamfs_dir_bloom_invalidate(dir);
+                err = (stamfs_dirent_long(dir->i_sb) ||
+                       nrecs < STAMFS_DIR_RECS_PER_BLOCK ? 0 : -ENOSPC);
+                goto ret;
+        }
+        split_hash = recs[split].sr_hash;
+
+        err = stamfs_dir_add_block(dir, &new_bh);
+        if (err)
+                goto ret;
+        new_block_offset = stamfs_dir_num_blocks(dir) - 1;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir %lu, splitting leaf %d at hash "
+                             "0x%x into leaf %d\n",
+                             dir->i_ino, block_offset, split_hash,
+                             new_block_offset);
+
+        stamfs_dx_fill_leaf(dir, leaf_bh, copy, recs, split);
+        stamfs_dx_fill_leaf(dir, new_bh, copy, recs + split, nrecs - split);
+        stamfs_names_invalidate(dir);
+        stamfs_dir_free_invalidate(dir);
+        stamfs_dir_bloom_invalidate(dir);
+
+        /* add the new leaf right after the split one. */
+        memmove(&root->dx_entries[i+2], &root->dx_entries[i+1],
+                (count - i - 1) * sizeof(struct stamfs_dx_entry));
+        root->dx_entries[i+1].de_hash = cpu_to_le32(split_hash);
+        root->dx_entries[i+1].de_block = cpu_to_le32(new_block_offset);
+        root->dx_count = cpu_to_le16(count + 1);
+        mark_buffer_dirty(root_bh);
+        buffer_insert_inode_data_queue(root_bh, dir);
+
+  ret:
+        if (copy)
+                kfree(copy);
+        if (new_bh)
+                brelse(new_bh);
+        if (leaf_bh)
+                brelse(leaf_bh);
+        brelse(root_bh);
+        return err;
+}
@@ -0,0 +1,89 @@
+
+#ifndef STAMFS_DIR_INDEX_H
+#define STAMFS_DIR_INDEX_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+
+/*
+ * Functions that maintain the hash index of large directories
+ * (STAMFS_FEATURE_RO_COMPAT_DIR_INDEX).
+ */
+
+/* is the given directory indexed? without
+ * STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS, a leftover flag is not trusted. */
+static inline int stamfs_dx_indexed(struct inode *dir)
+{
+        return (stamfs_inode_flags_enabled(dir->i_sb) &&
+                (STAMFS_INODE_META(dir)->i_flags & STAMFS_INODE_FL_INDEX));
+}
+
+/*
+ * The block offset of the first block of the given directory that holds
+ * entries - an index root holds none.
+ */
+static inline int stamfs_dx_first_block(struct inode *dir)
+{
+        return (stamfs_dx_indexed(dir) ? 1 : 0);
+}
+
+/* may directories be indexed on the given file-system? the index flag
+ * must be kept on disk, or the index root would later be read as entries. */
+static inline int stamfs_dx_enabled(struct super_block *sb)
+{
+        return ((STAMFS_META(sb)->s_feature_ro_compat &
+                 STAMFS_FEATURE_RO_COMPAT_DIR_INDEX) &&
+                stamfs_inode_flags_enabled(sb));
+}
+
+/*
+ * The readdir position of an entry of an indexed directory - past the 2
+ * positions of '.' and '..', the hash of its name, and its index among the
+ * entries with that hash, in the order they are read. a directory can't
+ * hold 2^16 entries, so the index never overflows.
+ */
+#define STAMFS_DX_POS_IDX_BITS  16
+#define STAMFS_DX_POS(hash, idx) \
+        (2 + (((loff_t)(hash) << STAMFS_DX_POS_IDX_BITS) | (idx)))
+#define STAMFS_DX_POS_HASH(pos) \
+        ((__u32)(((pos) - 2) >> STAMFS_DX_POS_IDX_BITS))
+#define STAMFS_DX_POS_IDX(pos) \
+        ((unsigned int)((pos) - 2) & ((1 << STAMFS_DX_POS_IDX_BITS) - 1))
+/* the position after the last entry. */
+#define STAMFS_DX_POS_EOF       STAMFS_DX_POS((loff_t)STAMFS_DX_HASH_MAX + 1, 0)
+
+/*
+ * Calculate the hash of the given name - a number between 0 and
+ * STAMFS_DX_HASH_MAX.
+ */
+__u32 stamfs_dir_hash(const char *name, int namelen);
+
+/*
+ * Given an indexed directory and a name hash, find the block offset of the
+ * leaf that holds the names with this hash.
+ * if p_next_hash is not NULL, it gets the lowest hash held by the following
+ * leaves (STAMFS_DX_HASH_MAX + 1 for the last leaf).
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dx_find_leaf(struct inode *dir, __u32 hash, int *p_block_offset,
+                        unsigned long *p_next_hash);
+
+/*
+ * Turn the given (linear, single block) directory into an indexed
+ * directory, with all its entries in a single leaf.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_dx_make_index(struct inode *dir);
+
+/*
+ * Split the leaf of the given indexed directory that holds the names with
+ * the given hash, moving the upper half of its hashes into a new leaf.
+ * @return 0 on success, a negative error code on failure (-ENOSPC if the
+ *         index is full, or the leaf holds a single hash).
+ */
+int stamfs_dx_split_leaf(struct inode *dir, __u32 hash);
+
+#endif /* STAMFS_DIR_INDEX_H */
@@ -0,0 +1,313 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/list.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_dir_sort.h"
+#include "stamfs_names.h"
+#include "stamfs_dir_bloom.h"
+#include "stamfs_dirent.h"
+
+/*
+ * A directory that is written once and then only read can be sorted
+ * (STAMFS_IOC_SORT_DIR): its entries are rewritten in the order of their names
+ * (see stamfs_dirent_name_cmp()), filling its data blocks from the first,
+ * and it's marked with STAMFS_INODE_FL_SORTED. a lookup in a sorted
+ * directory then binary-searches its blocks by their first entries, and
+ * binary-searches the entries of the one block that may hold the name. the
+ * first change to the directory's entries clears the flag, and lookups go
+ * back to scanning. indexed directories are already looked up by the hash of
+ * the name, and are not sorted.
+ */
+
+/* an entry of a directory being sorted - its name is in a copy of the
+ * directory's data. */
+struct stamfs_sort_ent {
+        const char *se_name;
+        unsigned long se_ino;
+        __u8 se_name_len;
+        __u8 se_ftype;
+};
+
+static inline int stamfs_sort_ent_cmp(struct stamfs_sort_ent *ent1,
+                                      struct stamfs_sort_ent *ent2)
+{
+        return stamfs_dirent_name_cmp(ent1->se_name, ent1->se_name_len,
+                                      ent2->se_name, ent2->se_name_len);
+}
+
+/* move the given entry down the given heap, until its children are not
+ * greater than it. */
+static void stamfs_sort_sift(struct stamfs_sort_ent *ents, int root, int n)
+{
+        struct stamfs_sort_ent tmp;
+        int child;
+
+        while ((child = 2 * root + 1) < n) {
+                if (child + 1 < n &&
+                    stamfs_sort_ent_cmp(&ents[child], &ents[child+1]) < 0)
+                        child++;
+                if (stamfs_sort_ent_cmp(&ents[root], &ents[child]) >= 0)
+                        return;
+                tmp = ents[root];
+                ents[root] = ents[child];
+                ents[child] = tmp;
+                root = child;
+        }
+}
+
+/* sort the given entries by name - a heap sort, as directories may hold
+ * tens of thousands of entries, and the kernel stack is small. */
+static void stamfs_sort_ents(struct stamfs_sort_ent *ents, int n)
+{
+        struct stamfs_sort_ent tmp;
+        int i;
+
+        for (i = n / 2 - 1; i >= 0; i--)
+                stamfs_sort_sift(ents, i, n);
+        for (i = n - 1; i > 0; i--) {
+                tmp = ents[0];
+                ents[0] = ents[i];
+                ents[i] = tmp;
+                stamfs_sort_sift(ents, 0, i);
+        }
+}
+
+/*
+ * Find the entry with the given name (whose stamfs_dir_hash() is hash) in
+ * the given sorted directory.
+ * on success, *p_bh holds the entry's block (to be released by the caller),
+ * *p_block_offset its block offset, and *de the entry inside it.
+ * @return 0 on success, -ENOENT if there is no such entry, another negative
+ *         error code on failure.
+ */
+int stamfs_dir_sorted_find(struct inode *dir, const char *name, int namelen,
+                           __u32 hash, struct buffer_head **p_bh,
+                           int *p_block_offset, struct stamfs_dirent *de)
+{
+        struct super_block *sb = dir->i_sb;
+        struct buffer_head *bh = NULL;
+        unsigned int offset;
+        int lo = 0, hi = stamfs_dir_num_blocks(dir) - 1, mid;
+        int cmp;
+
+        /* find the last block whose first entry is not above the name. */
+        while (lo < hi) {
+                mid = (lo + hi + 1) / 2;
+                if (!(bh = stamfs_dir_bread(dir, mid)))
+                        return -EIO;
+                offset = 0;
+                if (!stamfs_dirent_next(sb, bh->b_data, &offset, de))
+                        cmp = -1; /* only trailing blocks are empty. */
+                else
+                        cmp = stamfs_dirent_name_cmp(name, namelen,
+                                                     de->de_name,
+                                                     de->de_name_len);
+                if (cmp == 0) {
+                        *p_bh = bh;
+                        *p_block_offset = mid;
+                        return 0;
+                }
+                brelse(bh);
+                if (cmp < 0)
+                        hi = mid - 1;
+                else
+                        lo = mid;
+        }
+
+        if (!(bh = stamfs_dir_bread(dir, lo)))
+                return -EIO;
+        if (stamfs_dirent_find_sorted(sb, bh->b_data, name, namelen, hash,
+                                      de)) {
+                *p_bh = bh;
+                *p_block_offset = lo;
+                return 0;
+        }
+        brelse(bh);
+
+        return -ENOENT;
+}
+
+/*
+ * Is the given directory being read through an open file? its entries
+ * move to other blocks when it's sorted, so a readdir in the middle of the
+ * directory would skip or repeat entries. the caller holds the directory's
+ * i_sem, which readdir holds too.
+ */
+static int stamfs_dir_sort_busy(struct inode *dir)
+{
+        struct list_head *p;
+        struct file *filp;
+        int busy = 0;
+
+        /* note: the phony "." and ".." entries take positions 0 and 1. */
+        file_list_lock();
+        list_for_each(p, &dir->i_sb->s_files) {
+                filp = list_entry(p, struct file, f_list);
+                if (filp->f_dentry && filp->f_dentry->d_inode == dir &&
+                    filp->f_pos > 2)
+                        busy = 1;
+        }
+        file_list_unlock();
+
+        return busy;
+}
+
+/*
+ * Sort the entries of the given (linear) directory by name, and mark it
+ * sorted. the caller holds the directory's i_sem and the BKL.
+ * @return 0 on success, a negative error code on failure (-EBUSY if the
+ *         directory is being read through an open file).
+ */
+int stamfs_dir_sort(struct inode *dir)
+{
+        int err = 0;
+        struct super_block *sb = dir->i_sb;
+        int max_blocks = STAMFS_MAX_BLOCKS_PER_FILE;
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct buffer_head **bhs = NULL;
+        struct stamfs_sort_ent *ents = NULL;
+        char *copy = NULL;
+        char *block = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset;
+        int nents = 0;
+        int need_blocks;
+        int trim_err;
+        int i, j;
+
+        /* the order is only kept with the sorted flag on disk. */
+        if (stamfs_dx_indexed(dir) || !stamfs_inode_flags_enabled(sb))
+                return -EOPNOTSUPP;
+        if (stamfs_dir_sorted(dir))
+                return 0;
+        if (stamfs_dir_sort_busy(dir))
+                return -EBUSY;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: sorting dir %lu, %d blocks\n",
+                             dir->i_ino, num_blocks);
+
+        /* the directory's blocks are all held, so once they are rewritten,
+         * nothing can fail midway. */
+        bhs = kmalloc(max_blocks * sizeof(struct buffer_head *), GFP_NOFS);
+        block = kmalloc(STAMFS_BLOCK_SIZE, GFP_NOFS);
+        copy = vmalloc(num_blocks * STAMFS_BLOCK_SIZE);
+        ents = vmalloc(num_blocks * STAMFS_DIR_MAX_ENTRIES_PER_BLOCK *
+                       sizeof(struct stamfs_sort_ent));
+        if (!bhs || !block || !copy || !ents) {
+                err = -ENOMEM;
+                goto ret;
+        }
+        memset(bhs, 0, max_blocks * sizeof(struct buffer_head *));
+
+        for (i = 0; i < num_blocks; i++) {
+                if (!(bhs[i] = stamfs_dir_bread(dir, i))) {
+                        err = -EIO;
+                        goto ret;
+                }
+                memcpy(copy + i * STAMFS_BLOCK_SIZE, bhs[i]->b_data,
+                       STAMFS_BLOCK_SIZE);
+
+                offset = 0;
+                while (stamfs_dirent_next(sb, copy + i * STAMFS_BLOCK_SIZE,
+                                          &offset, &de)) {
+                        ents[nents].se_name = de.de_name;
+                        ents[nents].se_ino = de.de_ino;
+                        ents[nents].se_name_len = de.de_name_len;
+                        ents[nents].se_ftype = de.de_ftype;
+                        nents++;
+                }
+        }
+
+        stamfs_sort_ents(ents, nents);
+
+        /* variable-length entries may pack worse in their new order - count
+         * the blocks they need, and add the missing ones up front. */
+        need_blocks = 1;
+        stamfs_dirent_init_block(sb, block);
+        for (j = 0; j < nents; j++) {
+                if (stamfs_dirent_add(sb, block, ents[j].se_name,
+                                      ents[j].se_name_len, ents[j].se_ino,
+                                      ents[j].se_ftype, NULL) >= 0)
+                        continue;
+                need_blocks++;
+                stamfs_dirent_init_block(sb, block);
+                stamfs_dirent_add(sb, block, ents[j].se_name,
+                                  ents[j].se_name_len, ents[j].se_ino,
+                                  ents[j].se_ftype, NULL);
+        }
+        while (num_blocks < need_blocks) {
+                err = stamfs_dir_add_block(dir, &bhs[num_blocks]);
+                if (err)
+                        goto ret;
+                num_blocks++;
+        }
+
+        /* rewrite the blocks - the ones past the entries become empty. */
+        for (i = 0, j = 0; i < num_blocks; i++) {
+                stamfs_dirent_init_block(sb, bhs[i]->b_data);
+                for ( ; j < nents; j++) {
+                        if (stamfs_dirent_add(sb, bhs[i]->b_data,
+                                              ents[j].se_name,
+                                              ents[j].se_name_len,
+                                              ents[j].se_ino,
+                                              ents[j].se_ftype, NULL) < 0)
+                                break;
+                }
+                mark_buffer_dirty(bhs[i]);
+                buffer_insert_inode_data_queue(bhs[i], dir);
+        }
+
+        stamfs_names_invalidate(dir);
+        stamfs_dir_free_invalidate(dir);
+        stamfs_dir_bloom_invalidate(dir);
+        STAMFS_INODE_META(dir)->i_flags |= STAMFS_INODE_FL_SORTED;
+        mark_inode_dirty(dir);
+
+        /* older versions would change the directory without dropping the
+         * order. */
+        stamfs_set_feature_ro_compat(sb, STAMFS_FEATURE_RO_COMPAT_SORTED_DIR);
+
+  ret:
+        if (bhs) {
+                for (i = 0; i < num_blocks; i++) {
+                        if (bhs[i])
+                                brelse(bhs[i]);
+                }
+                kfree(bhs);
+        }
+        if (ents)
+                vfree(ents);
+        if (copy)
+                vfree(copy);
+        if (block)
+                kfree(block);
+
+        /* free the blocks that were emptied (or added in vain). */
+        trim_err = stamfs_dir_trim(dir);
+        return (err ? err : trim_err);
+}
+
+/*
+ * The entries of the given directory are about to change - it's no longer
+ * sorted.
+ */
+void stamfs_dir_unsort(struct inode *dir)
+{
+        if (!stamfs_dir_sorted(dir))
+                return;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: dir %lu is no longer sorted\n",
+                             dir->i_ino);
+        STAMFS_INODE_META(dir)->i_flags &= ~STAMFS_INODE_FL_SORTED;
+        mark_inode_dirty(dir);
+}
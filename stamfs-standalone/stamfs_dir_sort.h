@@ -0,0 +1,51 @@
+
+#ifndef STAMFS_DIR_SORT_H
+#define STAMFS_DIR_SORT_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dirent.h"
+
+/*
+ * Functions that maintain directories sorted by name (STAMFS_INODE_FL_SORTED,
+ * see STAMFS_IOC_SORT_DIR).
+ */
+
+/* is the given directory sorted? a leftover flag is not trusted without
+ * STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS. */
+static inline int stamfs_dir_sorted(struct inode *dir)
+{
+        return (stamfs_inode_flags_enabled(dir->i_sb) &&
+                (STAMFS_INODE_META(dir)->i_flags & STAMFS_INODE_FL_SORTED));
+}
+
+/*
+ * Find the entry with the given name (whose stamfs_dir_hash() is hash) in
+ * the given sorted directory.
+ * on success, *p_bh holds the entry's block (to be released by the caller),
+ * *p_block_offset its block offset, and *de the entry inside it.
+ * @return 0 on success, -ENOENT if there is no such entry, another negative
+ *         error code on failure.
+ */
+int stamfs_dir_sorted_find(struct inode *dir, const char *name, int namelen,
+                           __u32 hash, struct buffer_head **p_bh,
+                           int *p_block_offset, struct stamfs_dirent *de);
+
+/*
+ * Sort the entries of the given (linear) directory by name, and mark it
+ * sorted. the caller holds the directory's i_sem and the BKL.
+ * @return 0 on success, a negative error code on failure (-EBUSY if the
+ *         directory is being read through an open file).
+ */
+int stamfs_dir_sort(struct inode *dir);
+
+/*
+ * The entries of the given directory are about to change - it's no longer
+ * sorted.
+ */
+void stamfs_dir_unsort(struct inode *dir);
+
+#endif /* STAMFS_DIR_SORT_H */
@@ -0,0 +1,583 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/string.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_dirent.h"
+
+/*
+ * Fixed-length entries (struct stamfs_dir_rec) fill a block from its start.
+ * the first entry with dr_ino 0 marks the end of the list, and a removed
+ * entry in the middle of the list is marked with STAMFS_FREE_DIR_REC_MARKER.
+ *
+ * Variable-length entries (struct stamfs_dir_entry) chain through the whole
+ * block by their de_rec_len. see stamfs.h.
+ *
+ * With STAMFS_FEATURE_RO_COMPAT_NAME_HASH, entries also hold the hashes of
+ * their names, and lookups compare the hashes before the names.
+ */
+
+/*
+ * Fixed-length entries.
+ */
+
+static void stamfs_dirent_fixed_decode(const char *block, int slot,
+                                       struct stamfs_dirent *de)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block + slot;
+
+        de->de_offset = slot * sizeof(struct stamfs_dir_rec);
+        de->de_ino = le32_to_cpu(dir_rec->dr_ino);
+        de->de_name_len = dir_rec->dr_name_len;
+        de->de_ftype = dir_rec->dr_ftype;
+        de->de_name = dir_rec->dr_name;
+}
+
+static int stamfs_dirent_fixed_next(const char *block, unsigned int *p_offset,
+                                    struct stamfs_dirent *de)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int slot;
+
+        /* scan from the start, as the list may end before the offset. */
+        for (slot = 0; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0)
+                        return 0; /* last entry of this block. */
+                if (le32_to_cpu(dir_rec[slot].dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
+                        continue; /* empty entry. */
+                if (slot * sizeof(struct stamfs_dir_rec) < *p_offset)
+                        continue;
+                stamfs_dirent_fixed_decode(block, slot, de);
+                *p_offset = (slot + 1) * sizeof(struct stamfs_dir_rec);
+                return 1;
+        }
+
+        return 0;
+}
+
+static int stamfs_dirent_fixed_find(const char *block, const char *name,
+                                    int namelen, int hashed, __u32 hash,
+                                    struct stamfs_dirent *de)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        __u16 rec_hash = cpu_to_le16(hash & 0xffff);
+        int slot;
+
+        /* removed entries have an empty name, so they never match. */
+        for (slot = 0; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0)
+                        return 0; /* last entry of this block. */
+                if (hashed && dir_rec[slot].dr_hash != rec_hash)
+                        continue;
+                if (dir_rec[slot].dr_name_len != namelen ||
+                    memcmp(dir_rec[slot].dr_name, name, namelen) != 0)
+                        continue;
+                if (le32_to_cpu(dir_rec[slot].dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
+                        continue;
+                stamfs_dirent_fixed_decode(block, slot, de);
+                return 1;
+        }
+
+        return 0;
+}
+
+static int stamfs_dirent_fixed_find_sorted(const char *block, const char *name,
+                                           int namelen, struct stamfs_dirent *de)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int lo = 0, hi = 0, mid, cmp;
+
+        while (hi < STAMFS_DIR_RECS_PER_BLOCK && dir_rec[hi].dr_ino != 0)
+                hi++;
+
+        /* the name, if it's there, is in slots [lo, hi). */
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                cmp = stamfs_dirent_name_cmp(name, namelen,
+                                             dir_rec[mid].dr_name,
+                                             dir_rec[mid].dr_name_len);
+                if (cmp == 0) {
+                        stamfs_dirent_fixed_decode(block, mid, de);
+                        return 1;
+                }
+                if (cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        return 0;
+}
+
+static int stamfs_dirent_fixed_add(char *block, const char *name, int namelen,
+                                   unsigned long ino_num, int ftype,
+                                   __u32 hash, unsigned int *p_hint)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int slot = (p_hint ? *p_hint / sizeof(struct stamfs_dir_rec) : 0);
+        int end_of_list;
+
+        /* take the first free entry from the hint on - a removed entry in
+         * the middle of the list, or the end of the list. */
+        for ( ; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0 ||
+                    le32_to_cpu(dir_rec[slot].dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
+                        break;
+        }
+        if (slot >= STAMFS_DIR_RECS_PER_BLOCK) {
+                if (p_hint)
+                        *p_hint = STAMFS_BLOCK_SIZE;
+                return -ENOSPC;
+        }
+        end_of_list = (dir_rec[slot].dr_ino == 0);
+
+        dir_rec[slot].dr_ino = cpu_to_le32(ino_num);
+        dir_rec[slot].dr_name_len = namelen;
+        dir_rec[slot].dr_ftype = ftype;
+        memcpy(dir_rec[slot].dr_name, name, namelen);
+        dir_rec[slot].dr_hash = cpu_to_le16(hash & 0xffff);
+
+        /* mark the next entry as the last one, in case it contains
+         * stale data. */
+        if (end_of_list && slot + 1 < STAMFS_DIR_RECS_PER_BLOCK)
+                dir_rec[slot+1].dr_ino = cpu_to_le32(0);
+
+        if (p_hint)
+                *p_hint = (slot + 1 < STAMFS_DIR_RECS_PER_BLOCK ?
+                           (slot + 1) * sizeof(struct stamfs_dir_rec) :
+                           STAMFS_BLOCK_SIZE);
+        return slot * sizeof(struct stamfs_dir_rec);
+}
+
+static unsigned int stamfs_dirent_fixed_del(char *block, unsigned int offset)
+{
+        int slot = offset / sizeof(struct stamfs_dir_rec);
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block + slot;
+
+        /* mark this entry as free, unless it's the last one in its block. */
+        if (slot + 1 < STAMFS_DIR_RECS_PER_BLOCK &&
+            le32_to_cpu(dir_rec[1].dr_ino) != 0)
+                dir_rec->dr_ino = cpu_to_le32(STAMFS_FREE_DIR_REC_MARKER);
+        else
+                dir_rec->dr_ino = cpu_to_le32(0);
+
+        /* clear up the fields, just for safety. */
+        dir_rec->dr_name_len = 0;
+        dir_rec->dr_ftype = STAMFS_DIR_REC_FTYPE_UNKNOWN;
+        dir_rec->dr_name[0] = '\0';
+        dir_rec->dr_hash = 0;
+
+        return offset;
+}
+
+static void stamfs_dirent_fixed_count(const char *block, int *p_live,
+                                      int *p_removed)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int slot;
+
+        *p_live = *p_removed = 0;
+        for (slot = 0; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0)
+                        break;
+                if (le32_to_cpu(dir_rec[slot].dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
+                        (*p_removed)++;
+                else
+                        (*p_live)++;
+        }
+}
+
+static unsigned int stamfs_dirent_fixed_pack_offset(const char *block,
+                                                    unsigned int offset)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int slot, live = 0;
+
+        /* the live entries keep their order, so the ones below the offset
+         * are packed below it. */
+        for (slot = 0; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0 ||
+                    slot * sizeof(struct stamfs_dir_rec) >= offset)
+                        break;
+                if (le32_to_cpu(dir_rec[slot].dr_ino) != STAMFS_FREE_DIR_REC_MARKER)
+                        live++;
+        }
+
+        return live * sizeof(struct stamfs_dir_rec);
+}
+
+static unsigned int stamfs_dirent_fixed_pack(char *block)
+{
+        struct stamfs_dir_rec *dir_rec = (struct stamfs_dir_rec *)block;
+        int slot, live = 0;
+
+        for (slot = 0; slot < STAMFS_DIR_RECS_PER_BLOCK; slot++) {
+                if (dir_rec[slot].dr_ino == 0)
+                        break;
+                if (le32_to_cpu(dir_rec[slot].dr_ino) == STAMFS_FREE_DIR_REC_MARKER)
+                        continue;
+                if (slot != live)
+                        memcpy(&dir_rec[live], &dir_rec[slot],
+                               sizeof(struct stamfs_dir_rec));
+                live++;
+        }
+
+        /* the first entry past the live ones marks the end of the list. */
+        if (live < STAMFS_DIR_RECS_PER_BLOCK) {
+                memset(&dir_rec[live], 0, (STAMFS_DIR_RECS_PER_BLOCK - live) *
+                                          sizeof(struct stamfs_dir_rec));
+                return live * sizeof(struct stamfs_dir_rec);
+        }
+        return STAMFS_BLOCK_SIZE;
+}
+
+/*
+ * Variable-length entries.
+ */
+
+/* the length of a live entry with a name of the given length. */
+static inline unsigned int stamfs_dirent_long_len(int hashed, int name_len)
+{
+        return (hashed ? STAMFS_DIR_ENTRY_HASH_LEN(name_len) :
+                         STAMFS_DIR_ENTRY_LEN(name_len));
+}
+
+/* the hash of the name of the given live entry (on a hashed file-system). */
+static inline __u32 *stamfs_dirent_long_hash(struct stamfs_dir_entry *entry)
+{
+        return (__u32 *)((char *)entry +
+                         STAMFS_DIR_ENTRY_LEN(entry->de_name_len));
+}
+
+/*
+ * Get the entry at the given offset of the given block, making sure it
+ * doesn't stretch beyond the block.
+ * returns the entry, or NULL if it's corrupt.
+ */
+static struct stamfs_dir_entry *stamfs_dirent_long_at(const char *block,
+                                                      unsigned int offset,
+                                                      int hashed)
+{
+        struct stamfs_dir_entry *entry =
+                (struct stamfs_dir_entry *)(block + offset);
+        unsigned int rec_len = le16_to_cpu(entry->de_rec_len);
+
+        if (rec_len < STAMFS_DIR_ENTRY_LEN(0) || (rec_len & 3) ||
+            offset + rec_len > STAMFS_BLOCK_SIZE ||
+            (entry->de_ino != 0 &&
+             rec_len < stamfs_dirent_long_len(hashed, entry->de_name_len))) {
+                printk("stamfs: corrupt directory entry at offset %u, "
+                       "rec_len=%u.\n", offset, rec_len);
+                return NULL;
+        }
+
+        return entry;
+}
+
+static void stamfs_dirent_long_decode(struct stamfs_dir_entry *entry,
+                                      unsigned int offset,
+                                      struct stamfs_dirent *de)
+{
+        de->de_offset = offset;
+        de->de_ino = le32_to_cpu(entry->de_ino);
+        de->de_name_len = entry->de_name_len;
+        de->de_ftype = entry->de_ftype;
+        de->de_name = entry->de_name;
+}
+
+static int stamfs_dirent_long_next(const char *block, unsigned int *p_offset,
+                                   int hashed, struct stamfs_dirent *de)
+{
+        struct stamfs_dir_entry *entry;
+        unsigned int offset = 0;
+
+        /* entries can only be found by following the chain from the start. */
+        while (offset < STAMFS_BLOCK_SIZE) {
+                if (!(entry = stamfs_dirent_long_at(block, offset, hashed)))
+                        return 0;
+                if (offset >= *p_offset && entry->de_ino != 0) {
+                        stamfs_dirent_long_decode(entry, offset, de);
+                        *p_offset = offset + le16_to_cpu(entry->de_rec_len);
+                        return 1;
+                }
+                offset += le16_to_cpu(entry->de_rec_len);
+        }
+
+        return 0;
+}
+
+static int stamfs_dirent_long_find(const char *block, const char *name,
+                                   int namelen, int hashed, __u32 hash,
+                                   struct stamfs_dirent *de)
+{
+        struct stamfs_dir_entry *entry;
+        __u32 entry_hash = cpu_to_le32(hash);
+        unsigned int offset = 0;
+
+        while (offset < STAMFS_BLOCK_SIZE) {
+                if (!(entry = stamfs_dirent_long_at(block, offset, hashed)))
+                        return 0;
+                if (entry->de_ino != 0 && entry->de_name_len == namelen &&
+                    (!hashed || *stamfs_dirent_long_hash(entry) == entry_hash) &&
+                    memcmp(entry->de_name, name, namelen) == 0) {
+                        stamfs_dirent_long_decode(entry, offset, de);
+                        return 1;
+                }
+                offset += le16_to_cpu(entry->de_rec_len);
+        }
+
+        return 0;
+}
+
+static int stamfs_dirent_long_add(char *block, const char *name, int namelen,
+                                  unsigned long ino_num, int ftype,
+                                  int hashed, __u32 hash,
+                                  unsigned int *p_hint)
+{
+        struct stamfs_dir_entry *entry;
+        struct stamfs_dir_entry *new_entry;
+        unsigned int need = stamfs_dirent_long_len(hashed, namelen);
+        unsigned int offset = (p_hint ? *p_hint : 0);
+        unsigned int first_room = STAMFS_BLOCK_SIZE;
+        unsigned int rec_len, used;
+
+        while (offset < STAMFS_BLOCK_SIZE) {
+                if (!(entry = stamfs_dirent_long_at(block, offset, hashed)))
+                        return -ENOSPC;
+                rec_len = le16_to_cpu(entry->de_rec_len);
+                used = (entry->de_ino == 0 ? 0 :
+                        stamfs_dirent_long_len(hashed, entry->de_name_len));
+
+                /* an unused entry that is large enough - take it. */
+                if (entry->de_ino == 0 && rec_len >= need) {
+                        new_entry = entry;
+                        break;
+                }
+                /* an entry with enough slack - split it. */
+                if (entry->de_ino != 0 && rec_len - used >= need) {
+                        entry->de_rec_len = cpu_to_le16(used);
+                        offset += used;
+                        new_entry = (struct stamfs_dir_entry *)(block + offset);
+                        new_entry->de_rec_len = cpu_to_le16(rec_len - used);
+                        break;
+                }
+                /* remember the first entry with room for a shorter name. */
+                if (rec_len - used >= stamfs_dirent_long_len(hashed, 1) &&
+                    first_room == STAMFS_BLOCK_SIZE)
+                        first_room = offset;
+                offset += rec_len;
+        }
+        if (offset >= STAMFS_BLOCK_SIZE) {
+                if (p_hint)
+                        *p_hint = first_room;
+                return -ENOSPC;
+        }
+
+        new_entry->de_ino = cpu_to_le32(ino_num);
+        new_entry->de_name_len = namelen;
+        new_entry->de_ftype = ftype;
+        memcpy(new_entry->de_name, name, namelen);
+        if (hashed)
+                *stamfs_dirent_long_hash(new_entry) = cpu_to_le32(hash);
+
+        if (p_hint)
+                *p_hint = (first_room < offset ? first_room : offset);
+        return offset;
+}
+
+static unsigned int stamfs_dirent_long_del(char *block, unsigned int offset,
+                                           int hashed)
+{
+        struct stamfs_dir_entry *entry;
+        struct stamfs_dir_entry *prev = NULL;
+        unsigned int prev_offset = 0;
+        unsigned int cur = 0;
+
+        while (cur < offset) {
+                if (!(prev = stamfs_dirent_long_at(block, cur, hashed)))
+                        return 0;
+                prev_offset = cur;
+                cur += le16_to_cpu(prev->de_rec_len);
+        }
+        if (cur != offset ||
+            !(entry = stamfs_dirent_long_at(block, offset, hashed)))
+                return 0;
+
+        /* merge the entry into the one before it - or mark it unused. */
+        if (prev) {
+                prev->de_rec_len = cpu_to_le16(le16_to_cpu(prev->de_rec_len) +
+                                               le16_to_cpu(entry->de_rec_len));
+                return prev_offset;
+        }
+        entry->de_ino = cpu_to_le32(0);
+        return offset;
+}
+
+/*
+ * Initialize the given directory data block as an empty block.
+ */
+void stamfs_dirent_init_block(struct super_block *sb, char *block)
+{
+        struct stamfs_dir_entry *entry = (struct stamfs_dir_entry *)block;
+
+        memset(block, 0, STAMFS_BLOCK_SIZE);
+        if (stamfs_dirent_long(sb))
+                entry->de_rec_len = cpu_to_le16(STAMFS_BLOCK_SIZE);
+}
+
+/*
+ * Find the first live entry of the given block at or after the given
+ * offset, and advance the offset past it.
+ * @return 1 if an entry was found, 0 at the end of the block.
+ */
+int stamfs_dirent_next(struct super_block *sb, const char *block,
+                       unsigned int *p_offset, struct stamfs_dirent *de)
+{
+        if (stamfs_dirent_long(sb))
+                return stamfs_dirent_long_next(block, p_offset,
+                                               stamfs_dirent_hashed(sb), de);
+        else
+                return stamfs_dirent_fixed_next(block, p_offset, de);
+}
+
+/*
+ * Decode the live entry at the given offset of the given block.
+ * @return 1 if there is such an entry, 0 otherwise.
+ */
+int stamfs_dirent_get(struct super_block *sb, const char *block,
+                      unsigned int offset, struct stamfs_dirent *de)
+{
+        unsigned int next_offset = offset;
+
+        if (!stamfs_dirent_next(sb, block, &next_offset, de))
+                return 0;
+        return de->de_offset == offset;
+}
+
+/*
+ * Find the live entry with the given name in the given block. hash is the
+ * name's stamfs_dir_hash().
+ * @return 1 if there is such an entry, 0 otherwise.
+ */
+int stamfs_dirent_find(struct super_block *sb, const char *block,
+                       const char *name, int namelen, __u32 hash,
+                       struct stamfs_dirent *de)
+{
+        if (stamfs_dirent_long(sb))
+                return stamfs_dirent_long_find(block, name, namelen,
+                                               stamfs_dirent_hashed(sb),
+                                               hash, de);
+        else
+                return stamfs_dirent_fixed_find(block, name, namelen,
+                                                stamfs_dirent_hashed(sb),
+                                                hash, de);
+}
+
+/*
+ * Like stamfs_dirent_find(), for a block whose entries are sorted by name
+ * (see stamfs_dirent_name_cmp()), without removed entries among them.
+ */
+int stamfs_dirent_find_sorted(struct super_block *sb, const char *block,
+                              const char *name, int namelen, __u32 hash,
+                              struct stamfs_dirent *de)
+{
+        /* variable-length entries can only be reached one by one. */
+        if (stamfs_dirent_long(sb))
+                return stamfs_dirent_find(sb, block, name, namelen, hash, de);
+        else
+                return stamfs_dirent_fixed_find_sorted(block, name, namelen,
+                                                       de);
+}
+
+/*
+ * Add an entry with the given name and inode to the given block.
+ * if p_hint is not NULL, the block has no room below the offset it points
+ * to; the search starts there, and it is updated for the next search
+ * (STAMFS_BLOCK_SIZE if the block has no room left).
+ * @return the offset of the new entry, or -ENOSPC if the block has no room
+ *         for it.
+ */
+int stamfs_dirent_add(struct super_block *sb, char *block,
+                      const char *name, int namelen,
+                      unsigned long ino_num, int ftype,
+                      unsigned int *p_hint)
+{
+        int hashed = stamfs_dirent_hashed(sb);
+        __u32 hash = (hashed ? stamfs_dir_hash(name, namelen) : 0);
+
+        if (stamfs_dirent_long(sb))
+                return stamfs_dirent_long_add(block, name, namelen, ino_num,
+                                              ftype, hashed, hash, p_hint);
+        else
+                return stamfs_dirent_fixed_add(block, name, namelen, ino_num,
+                                               ftype, hash, p_hint);
+}
+
+/*
+ * Remove the entry at the given offset of the given block.
+ * @return the offset at which the block now has room.
+ */
+unsigned int stamfs_dirent_del(struct super_block *sb, char *block,
+                               unsigned int offset)
+{
+        if (stamfs_dirent_long(sb))
+                return stamfs_dirent_long_del(block, offset,
+                                              stamfs_dirent_hashed(sb));
+        else
+                return stamfs_dirent_fixed_del(block, offset);
+}
+
+/*
+ * Count the entries of the given block - the live ones in *p_live, and the
+ * removed ones, whose room is reclaimed only when the block is packed, in
+ * *p_removed.
+ */
+void stamfs_dirent_count(struct super_block *sb, const char *block,
+                         int *p_live, int *p_removed)
+{
+        struct stamfs_dirent de;
+        unsigned int offset = 0;
+
+        if (!stamfs_dirent_long(sb)) {
+                stamfs_dirent_fixed_count(block, p_live, p_removed);
+                return;
+        }
+
+        /* removed variable-length entries are merged into their neighbours. */
+        *p_live = *p_removed = 0;
+        while (stamfs_dirent_next(sb, block, &offset, &de))
+                (*p_live)++;
+}
+
+/*
+ * Get the offset that the first live entry at or after the given offset of
+ * the given block will have, once the block is packed.
+ */
+unsigned int stamfs_dirent_pack_offset(struct super_block *sb,
+                                       const char *block, unsigned int offset)
+{
+        if (stamfs_dirent_long(sb))
+                return offset;
+        else
+                return stamfs_dirent_fixed_pack_offset(block, offset);
+}
+
+/*
+ * Pack the live entries of the given block at its start, in their order,
+ * dropping the removed entries.
+ * @return the offset below which the packed block has no room (see
+ *         stamfs_dirent_add).
+ */
+unsigned int stamfs_dirent_pack(struct super_block *sb, char *block)
+{
+        if (stamfs_dirent_long(sb))
+                return 0;
+        else
+                return stamfs_dirent_fixed_pack(block);
+}
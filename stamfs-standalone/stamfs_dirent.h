@@ -0,0 +1,142 @@
+
+#ifndef STAMFS_DIRENT_H
+#define STAMFS_DIRENT_H
+
+#include <linux/fs.h>
+#include <linux/string.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+
+/*
+ * Functions that handle the entries inside a single data block of a
+ * directory - fixed-length entries (struct stamfs_dir_rec), or
+ * variable-length entries (struct stamfs_dir_entry) on a file-system with
+ * STAMFS_FEATURE_INCOMPAT_LONG_NAMES. entries are identified by their byte
+ * offset inside the block.
+ */
+
+/* a (live) entry of a directory data block, decoded. */
+struct stamfs_dirent {
+        unsigned int de_offset;         /* of the entry inside its block. */
+        unsigned long de_ino;
+        int de_name_len;
+        int de_ftype;                   /* STAMFS_DIR_REC_FTYPE_*. */
+        const char *de_name;            /* inside the block's buffer. */
+};
+
+/* does the given file-system use variable-length entries? */
+static inline int stamfs_dirent_long(struct super_block *sb)
+{
+        return (STAMFS_META(sb)->s_feature_incompat &
+                STAMFS_FEATURE_INCOMPAT_LONG_NAMES) != 0;
+}
+
+/* do the entries on the given file-system hold the hashes of their names? */
+static inline int stamfs_dirent_hashed(struct super_block *sb)
+{
+        return (STAMFS_META(sb)->s_feature_ro_compat &
+                STAMFS_FEATURE_RO_COMPAT_NAME_HASH) != 0;
+}
+
+/* the longest file name on the given file-system. */
+static inline int stamfs_dirent_max_name_len(struct super_block *sb)
+{
+        return (stamfs_dirent_long(sb) ? STAMFS_MAX_LONG_FNAME_LEN :
+                                         STAMFS_MAX_FNAME_LEN);
+}
+
+/*
+ * Compare two names, in the order of sorted directories (STAMFS_IOC_SORT_DIR) -
+ * by their bytes, and a name before the longer names it is a prefix of.
+ * @return a negative, zero or positive value, like memcmp().
+ */
+static inline int stamfs_dirent_name_cmp(const char *name1, int len1,
+                                         const char *name2, int len2)
+{
+        int cmp = memcmp(name1, name2, (len1 < len2 ? len1 : len2));
+
+        return (cmp != 0 ? cmp : len1 - len2);
+}
+
+/*
+ * Initialize the given (zeroed) directory data block as an empty block.
+ */
+void stamfs_dirent_init_block(struct super_block *sb, char *block);
+
+/*
+ * Find the first live entry of the given block at or after the given
+ * offset, and advance the offset past it.
+ * @return 1 if an entry was found, 0 at the end of the block.
+ */
+int stamfs_dirent_next(struct super_block *sb, const char *block,
+                       unsigned int *p_offset, struct stamfs_dirent *de);
+
+/*
+ * Decode the live entry at the given offset of the given block.
+ * @return 1 if there is such an entry, 0 otherwise.
+ */
+int stamfs_dirent_get(struct super_block *sb, const char *block,
+                      unsigned int offset, struct stamfs_dirent *de);
+
+/*
+ * Find the live entry with the given name in the given block. hash is the
+ * name's stamfs_dir_hash().
+ * @return 1 if there is such an entry, 0 otherwise.
+ */
+int stamfs_dirent_find(struct super_block *sb, const char *block,
+                       const char *name, int namelen, __u32 hash,
+                       struct stamfs_dirent *de);
+
+/*
+ * Like stamfs_dirent_find(), for a block whose entries are sorted by name
+ * (see stamfs_dirent_name_cmp()), without removed entries among them.
+ */
+int stamfs_dirent_find_sorted(struct super_block *sb, const char *block,
+                              const char *name, int namelen, __u32 hash,
+                              struct stamfs_dirent *de);
+
+/*
+ * Add an entry with the given name and inode to the given block.
+ * if p_hint is not NULL, the block has no room below the offset it points
+ * to; the search starts there, and it is updated for the next search
+ * (STAMFS_BLOCK_SIZE if the block has no room left).
+ * @return the offset of the new entry, or -ENOSPC if the block has no room
+ *         for it.
+ */
+int stamfs_dirent_add(struct super_block *sb, char *block,
+                      const char *name, int namelen,
+                      unsigned long ino_num, int ftype,
+                      unsigned int *p_hint);
+
+/*
+ * Remove the entry at the given offset of the given block.
+ * @return the offset at which the block now has room.
+ */
+unsigned int stamfs_dirent_del(struct super_block *sb, char *block,
+                               unsigned int offset);
+
+/*
+ * Count the entries of the given block - the live ones in *p_live, and the
+ * removed ones, whose room is reclaimed only when the block is packed, in
+ * *p_removed.
+ */
+void stamfs_dirent_count(struct super_block *sb, const char *block,
+                         int *p_live, int *p_removed);
+
+/*
+ * Get the offset that the first live entry at or after the given offset of
+ * the given block will have, once the block is packed.
+ */
+unsigned int stamfs_dirent_pack_offset(struct super_block *sb,
+                                       const char *block, unsigned int offset);
+
+/*
+ * Pack the live entries of the given block at its start, in their order,
+ * dropping the removed entries.
+ * @return the offset below which the packed block has no room (see
+ *         stamfs_dirent_add).
+ */
+unsigned int stamfs_dirent_pack(struct super_block *sb, char *block);
+
+#endif /* STAMFS_DIRENT_H */
@@ -3,12 +3,19 @@
 
 #include <linux/fs.h>
 #include <linux/dcache.h>
+#include <linux/string.h>
+#include <linux/slab.h>
 
 #include "stamfs.h"
 #include "stamfs_super.h"
 #include "stamfs_inode.h"
 #include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_dirent.h"
 #include "stamfs_fops.h"
+#include "stamfs_usage.h"
+#include "stamfs_changelog.h"
+#include "stamfs_ioctl.h"
 #include "stamfs_util.h"
 
 /*
@@ -16,9 +23,10 @@
  */
 
 struct file_operations stamfs_dir_fops = {
+        llseek:         stamfs_dir_llseek,
         read:           generic_read_dir,
         readdir:        stamfs_readdir,
-        /*ioctl: we don't support any ioctls. */
+        ioctl:          stamfs_ioctl,
         fsync:          stamfs_sync_file
 };
 
@@ -28,15 +36,256 @@ struct file_operations stamfs_dir_fops = {
  */
 struct file_operations stamfs_file_fops = {
         llseek:         generic_file_llseek,
-        read:           generic_file_read,
-        write:          generic_file_write,
-        /*ioctl: we don't support any ioctls. */
-        mmap:           generic_file_mmap,
+        read:           stamfs_file_read,
+        write:          stamfs_file_write,
+        ioctl:          stamfs_ioctl,
+        mmap:           stamfs_file_mmap,
         open:           generic_file_open,
         fsync:          stamfs_sync_file,
 };
 
 
+/*
+ * Read from a file - the generic code does all the work, except for
+ * updating the access time, which follows our mount options.
+ */
+ssize_t stamfs_file_read(struct file *filp, char *buf, size_t count,
+                         loff_t *ppos)
+{
+        ssize_t ret;
+
+        ret = generic_file_read(filp, buf, count, ppos);
+        stamfs_inode_update_atime(filp->f_dentry->d_inode);
+
+        return ret;
+}
+
+/*
+ * Write to a file - the generic code does all the work, and we then account
+ * for the change in the file's size and blocks in its directories' usage,
+ * and log it.
+ */
+ssize_t stamfs_file_write(struct file *filp, const char *buf, size_t count,
+                          loff_t *ppos)
+{
+        struct inode *ino = filp->f_dentry->d_inode;
+        ssize_t ret;
+
+        ret = generic_file_write(filp, buf, count, ppos);
+        stamfs_usage_sync(ino);
+        if (ret > 0)
+                stamfs_changelog_record(ino, STAMFS_CHANGE_WRITE);
+
+        return ret;
+}
+
+/*
+ * Map a file into memory - see stamfs_file_read.
+ */
+int stamfs_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        int err;
+
+        err = generic_file_mmap(filp, vma);
+        if (!err)
+                stamfs_inode_update_atime(filp->f_dentry->d_inode);
+
+        return err;
+}
+
+/*
+ * the maximal number of inode blocks we prefetch in one batch, when reading
+ * a directory.
+ */
+#define STAMFS_READDIR_PREFETCH_MAX 32
+
+/*
+ * Issue asynchronous read-ahead (rw is READA), or reads (READ), for the
+ * blocks containing the given inodes, which readdir just returned - they
+ * are likely to be stat()-ed next. blocks already in the buffer cache (e.g.
+ * of inodes in core) are skipped, and the rest are submitted in ascending
+ * order.
+ */
+static void stamfs_readdir_prefetch(struct super_block *sb, int rw,
+                                    unsigned long *ino_nums, int count)
+{
+        struct buffer_head *bhs[STAMFS_READDIR_PREFETCH_MAX];
+        struct buffer_head *bh;
+        unsigned long block_num;
+        int nr_bhs = 0;
+        int i, j;
+
+        for (i = 0; i < count; i++) {
+                block_num = stamfs_ino_num_to_block_num(sb, ino_nums[i]);
+                if (block_num == 0)
+                        continue;
+                bh = getblk(sb->s_dev, block_num, STAMFS_BLOCK_SIZE);
+                if (!bh)
+                        continue;
+                if (buffer_uptodate(bh) || buffer_locked(bh)) {
+                        brelse(bh);
+                        continue;
+                }
+
+                /* insert sorted by block number, so the I/O is batched. */
+                for (j = nr_bhs; j > 0 && bhs[j-1]->b_blocknr > bh->b_blocknr; j--)
+                        bhs[j] = bhs[j-1];
+                bhs[j] = bh;
+                nr_bhs++;
+        }
+
+        STAMFS_DBG(DEB_STAM, "stamfs: readdir prefetching %d inode blocks\n",
+                             nr_bhs);
+
+        if (nr_bhs > 0)
+                ll_rw_block(rw, nr_bhs, bhs);
+        for (i = 0; i < nr_bhs; i++)
+                brelse(bhs[i]);
+}
+
+/* the type of the file the given directory entry refers to, for readdir. */
+static inline unsigned char stamfs_dirent_dtype(struct stamfs_dirent *de)
+{
+        if (de->de_ftype == STAMFS_DIR_REC_FTYPE_DIR)
+                return DT_DIR;
+        if (de->de_ftype == STAMFS_DIR_REC_FTYPE_FILE)
+                return DT_REG;
+        return DT_UNKNOWN;
+}
+
+/* the working space of stamfs_readdir_index - too big for the stack. */
+struct stamfs_readdir_index_buf {
+        __u32 ri_hashes[STAMFS_DIR_MAX_ENTRIES_PER_BLOCK];
+        __u16 ri_order[STAMFS_DIR_MAX_ENTRIES_PER_BLOCK];
+        unsigned long ri_prefetch_inos[STAMFS_READDIR_PREFETCH_MAX];
+};
+
+/*
+ * Read the entries of an indexed directory, in the order of their name
+ * hashes. the position of an entry is made of the hash of its name, and of
+ * its index among the entries with that hash (see STAMFS_DX_POS), so it
+ * stays valid while leaves are split between calls - a split never
+ * separates equal hashes - and a call may end among names with equal
+ * hashes.
+ */
+static int stamfs_readdir_index(struct file *filp, void *dirent,
+                                filldir_t filldir)
+{
+        struct inode *dir = filp->f_dentry->d_inode;
+        struct super_block* sb = dir->i_sb;
+        struct buffer_head *bh = NULL;
+        struct stamfs_dirent de;
+        unsigned int offset;
+        struct stamfs_readdir_index_buf *rib;
+        __u32 *hashes;
+        __u16 *order;
+        unsigned long *prefetch_inos;
+        int nr_prefetch = 0;
+        unsigned long next_hash;
+        int block_offset;
+        __u32 hash, rec_hash;
+        unsigned int skip, idx;
+        int nrecs, j;
+        int err = 0;
+        int over;
+
+        rib = kmalloc(sizeof(*rib), GFP_KERNEL);
+        if (!rib)
+                return -ENOMEM;
+        hashes = rib->ri_hashes;
+        order = rib->ri_order;
+        prefetch_inos = rib->ri_prefetch_inos;
+
+        while (filp->f_pos < STAMFS_DX_POS_EOF) {
+                hash = STAMFS_DX_POS_HASH(filp->f_pos);
+                skip = STAMFS_DX_POS_IDX(filp->f_pos);
+                err = stamfs_dx_find_leaf(dir, hash, &block_offset,
+                                          &next_hash);
+                if (err)
+                        goto done;
+                if (!(bh = stamfs_dir_bread(dir, block_offset))) {
+                        err = -EIO;
+                        goto done;
+                }
+
+                /* sort the leaf's entries from the current position on. */
+                nrecs = 0;
+                offset = 0;
+                while (nrecs < STAMFS_DIR_MAX_ENTRIES_PER_BLOCK &&
+                       stamfs_dirent_next(sb, bh->b_data, &offset, &de)) {
+                        rec_hash = stamfs_dir_hash(de.de_name, de.de_name_len);
+                        if (rec_hash < hash)
+                                continue;
+                        for (j = nrecs; j > 0 && hashes[j-1] > rec_hash; j--) {
+                                hashes[j] = hashes[j-1];
+                                order[j] = order[j-1];
+                        }
+                        hashes[j] = rec_hash;
+                        order[j] = de.de_offset;
+                        nrecs++;
+                }
+
+                for (j = 0, idx = 0; j < nrecs; j++) {
+                        idx = (j > 0 && hashes[j] == hashes[j-1] ? idx + 1 : 0);
+                        /* returned by the previous call. */
+                        if (hashes[j] == hash && idx < skip)
+                                continue;
+                        stamfs_dirent_get(sb, bh->b_data, order[j], &de);
+                        filp->f_pos = STAMFS_DX_POS(hashes[j], idx);
+                        over = filldir(dirent, de.de_name, de.de_name_len,
+                                       filp->f_pos, de.de_ino,
+                                       stamfs_dirent_dtype(&de));
+                        if (over < 0)
+                                goto done;
+
+                        prefetch_inos[nr_prefetch++] = de.de_ino;
+                        if (nr_prefetch == STAMFS_READDIR_PREFETCH_MAX) {
+                                stamfs_readdir_prefetch(sb, READA,
+                                                        prefetch_inos,
+                                                        nr_prefetch);
+                                nr_prefetch = 0;
+                        }
+                }
+
+                /* skip to the first hash of the next leaf. */
+                brelse(bh);
+                bh = NULL;
+                filp->f_pos = STAMFS_DX_POS(next_hash, 0);
+        }
+
+  done:
+        if (nr_prefetch > 0)
+                stamfs_readdir_prefetch(sb, READA, prefetch_inos, nr_prefetch);
+        if (bh)
+                brelse(bh);
+        kfree(rib);
+        return err;
+}
+
+/*
+ * Set the readdir position of a directory. the new position is taken to be
+ * one of the directory's current layout (see stamfs_readdir()).
+ */
+loff_t stamfs_dir_llseek(struct file *filp, loff_t offset, int origin)
+{
+        struct inode *dir = filp->f_dentry->d_inode;
+
+        switch (origin) {
+                case 2:
+                        offset += dir->i_size;
+                        break;
+                case 1:
+                        offset += filp->f_pos;
+                        break;
+        }
+        if (offset < 0)
+                return -EINVAL;
+
+        filp->f_pos = offset;
+        filp->f_version = dir->i_version;
+        return offset;
+}
+
 /*
  * This function is used for reading the contents of a directory, and
  * passing it back to the user.
@@ -48,8 +297,10 @@ int stamfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
         struct super_block* sb = dir->i_sb;
         int need_revalidation = (filp->f_version != dir->i_version);
         struct buffer_head *bh = NULL;
-        int data_block_num = 0;
-        struct stamfs_dir_rec *dir_rec;
+        int bh_block_offset = -1;
+        struct stamfs_dirent de;
+        unsigned long prefetch_inos[STAMFS_READDIR_PREFETCH_MAX];
+        int nr_prefetch = 0;
         int err = 0;
         int over;
 
@@ -58,16 +309,20 @@ int stamfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 
         /* we have no problem with an empty dir (which should contain '.'
          * and '..', since we always allocate one block for the dir's data. */
-        if (filp->f_pos > dir->i_size - sizeof(struct stamfs_dir_rec)) {
+        if (!stamfs_dx_indexed(dir) && filp->f_pos - 2 >= dir->i_size) {
                 STAMFS_DBG(DEB_STAM,
                            "stamfs: file pos larger then dir size.\n");
                 goto done;
         }
 
-        /* TODO - what does this revalidation, and version information,
-         * mean at all? */
+        /* the directory was indexed since the last call - a position in
+         * its linear layout means nothing in the hash order, so start over.
+         * entries may be returned twice, but none is skipped. (positions
+         * in the linear layout need no fixing - the scan below always
+         * moves on to the next live entry.) */
         if (need_revalidation) {
-                /* TODO - make sure 'pos' points to the beginning of a dir rec. */
+                if (stamfs_dx_indexed(dir) && filp->f_pos > 2)
+                        filp->f_pos = 2;
                 need_revalidation = 0;
         }
 
@@ -93,58 +348,67 @@ int stamfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
                 filp->f_pos++;
         }
 
-        /* read in the data block of this directory. */
-        err = stamfs_dir_get_data_block_num(dir, &data_block_num);
-        STAMFS_DBG(DEB_STAM, "stamfs: block index in block %d\n",
-                             data_block_num);
-        if (!(bh = bread(sb->s_dev, data_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read block-index block.\n");
-                err = -EIO;
+        /* indexed directories are read in hash order. */
+        if (stamfs_dx_indexed(dir)) {
+                err = stamfs_readdir_index(filp, dirent, filldir);
                 goto done;
         }
 
-        /* loop over the dir entries, until we finish scanning, or until
-         * we finish filling the dirent's available space */
+        /* loop over the dir entries, block by block, until we finish
+         * scanning, or until we finish filling the dirent's available
+         * space. the position of an entry is its byte offset in the
+         * directory's data. */
         /* note: the '- 2' is because of the phony "." and ".." entries. */
-        dir_rec = (struct stamfs_dir_rec *)(((char*)(bh->b_data)) + filp->f_pos - 2);
-        while (1) {
-                unsigned char d_type = DT_UNKNOWN;
-                /* dr_ino == 0 implies end-of-list. */
-                if (dir_rec->dr_ino == 0)
-                        break;
+        while (filp->f_pos - 2 < dir->i_size) {
+                unsigned long pos = filp->f_pos - 2;
+                int block_offset = pos >> sb->s_blocksize_bits;
+                unsigned int offset = pos & (STAMFS_BLOCK_SIZE - 1);
+                loff_t block_pos = filp->f_pos - offset;
 
-                /* add this entry, unless it's marked as 'free'. */
-                if (dir_rec->dr_ino != STAMFS_FREE_DIR_REC_MARKER) {
-                        if (dir_rec->dr_ftype == STAMFS_DIR_REC_FTYPE_DIR)
-                                d_type = DT_DIR;
-                        if (dir_rec->dr_ftype == STAMFS_DIR_REC_FTYPE_FILE)
-                                d_type = DT_REG;
-
-                        over = filldir(dirent, dir_rec->dr_name,
-                                       dir_rec->dr_name_len, filp->f_pos,
-                                       le32_to_cpu(dir_rec->dr_ino), d_type);
-                        if(over < 0)
+                /* read in the current data block of this directory. */
+                if (!bh || bh_block_offset != block_offset) {
+                        if (bh)
+                                brelse(bh);
+                        bh_block_offset = block_offset;
+                        if (!(bh = stamfs_dir_bread(dir, block_offset))) {
+                                err = -EIO;
                                 goto done;
-
-                        STAMFS_DBG(DEB_STAM, "stamfs: readdir, f_pos == %lld, "
-                                        "adding '%s', ino=%u\n",
-                                        filp->f_pos, dir_rec->dr_name,
-                                        le32_to_cpu(dir_rec->dr_ino));
+                        }
                 }
 
-                /* skip to the next entry. */
-                filp->f_pos += sizeof(struct stamfs_dir_rec);
+                /* past the last entry of this block - skip to the next. */
+                if (!stamfs_dirent_next(sb, bh->b_data, &offset, &de)) {
+                        filp->f_pos = block_pos + STAMFS_BLOCK_SIZE;
+                        continue;
+                }
 
-                /* note: again, the '+ 2' is because of the
-                 * phony "." and ".." entries. */
-                if (filp->f_pos >= STAMFS_BLOCK_SIZE + 2)
+                over = filldir(dirent, de.de_name, de.de_name_len,
+                               block_pos + de.de_offset, de.de_ino,
+                               stamfs_dirent_dtype(&de));
+                if(over < 0)
                         goto done;
-                dir_rec++;
+
+                prefetch_inos[nr_prefetch++] = de.de_ino;
+                if (nr_prefetch == STAMFS_READDIR_PREFETCH_MAX) {
+                        stamfs_readdir_prefetch(sb, READA, prefetch_inos,
+                                                nr_prefetch);
+                        nr_prefetch = 0;
+                }
+
+                STAMFS_DBG(DEB_STAM, "stamfs: readdir, f_pos == %lld, "
+                                "adding entry, ino=%lu\n",
+                                block_pos + de.de_offset, de.de_ino);
+
+                /* skip to the next entry. */
+                filp->f_pos = block_pos + offset;
         }
 
   done:
+        if (nr_prefetch > 0)
+                stamfs_readdir_prefetch(sb, READA, prefetch_inos, nr_prefetch);
+
         filp->f_version = dir->i_version;
-        UPDATE_ATIME(dir);
+        stamfs_inode_update_atime(dir);
 
         if (bh)
                 brelse(bh);
@@ -152,6 +416,128 @@ int stamfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
         return err;
 }
 
+/* the entries collected by a STAMFS_IOC_READDIRPLUS call. */
+struct stamfs_readdirplus_buf {
+        char *rb_buf;
+        unsigned int rb_len;            /* the length of rb_buf. */
+        unsigned int rb_used;
+        int rb_count;
+        int rb_full;                    /* an entry didn't fit. */
+};
+
+/*
+ * The filldir of STAMFS_IOC_READDIRPLUS - add an entry to the buffer, with
+ * its attributes still blank.
+ */
+static int stamfs_readdirplus_filldir(void *buf, const char *name,
+                                      int namelen, loff_t pos,
+                                      ino_t ino_num, unsigned int d_type)
+{
+        struct stamfs_readdirplus_buf *rb = buf;
+        struct stamfs_direntplus *dp;
+        unsigned int reclen = STAMFS_DIRENTPLUS_LEN(namelen);
+
+        if (rb->rb_used + reclen > rb->rb_len) {
+                rb->rb_full = 1;
+                return -EINVAL;
+        }
+
+        dp = (struct stamfs_direntplus *)(rb->rb_buf + rb->rb_used);
+        memset(dp, 0, reclen);
+        dp->dp_ino = ino_num;
+        dp->dp_reclen = reclen;
+        dp->dp_name_len = namelen;
+        memcpy(dp->dp_name, name, namelen);
+
+        rb->rb_used += reclen;
+        rb->rb_count++;
+        return 0;
+}
+
+/*
+ * Fill the attributes of the given entry from its inode. an entry whose
+ * inode can't be read keeps a dp_mode of 0.
+ */
+static void stamfs_readdirplus_stat(struct super_block *sb,
+                                    struct stamfs_direntplus *dp)
+{
+        struct inode *ino;
+
+        if (stamfs_ino_num_to_block_num(sb, dp->dp_ino) == 0)
+                return;
+        ino = iget(sb, dp->dp_ino);
+        if (!ino)
+                return;
+
+        if (!is_bad_inode(ino)) {
+                dp->dp_size = ino->i_size;
+                dp->dp_mode = ino->i_mode;
+                dp->dp_nlink = ino->i_nlink;
+                dp->dp_uid = ino->i_uid;
+                dp->dp_gid = ino->i_gid;
+                dp->dp_mtime = ino->i_mtime;
+                dp->dp_blocks = ino->i_blocks;
+        }
+        iput(ino);
+}
+
+/*
+ * Read the next entries of the given directory, from its file position on,
+ * into the given buffer (struct stamfs_direntplus records), together with
+ * the attributes of their inodes - see STAMFS_IOC_READDIRPLUS. *p_len holds
+ * the length of the buffer, and gets the length of the entries. the entries
+ * are collected by a single readdir pass, and the blocks of their inodes
+ * are then read in batches, in ascending order, before the inodes are got.
+ * the caller holds the directory's i_sem and the BKL, like for readdir.
+ * @return the number of entries on success, a negative error code on
+ *         failure (-EINVAL if the buffer can't hold the next entry).
+ */
+int stamfs_readdirplus(struct file *filp, char *buf, unsigned int *p_len)
+{
+        struct inode *dir = filp->f_dentry->d_inode;
+        struct super_block *sb = dir->i_sb;
+        struct stamfs_readdirplus_buf rb;
+        struct stamfs_direntplus *dp;
+        unsigned long prefetch_inos[STAMFS_READDIR_PREFETCH_MAX];
+        int nr_prefetch = 0;
+        unsigned int pos;
+        int err;
+
+        rb.rb_buf = buf;
+        rb.rb_len = *p_len;
+        rb.rb_used = 0;
+        rb.rb_count = 0;
+        rb.rb_full = 0;
+
+        err = stamfs_readdir(filp, &rb, stamfs_readdirplus_filldir);
+        if (err)
+                return err;
+        if (rb.rb_count == 0 && rb.rb_full)
+                return -EINVAL;
+
+        /* readdir only issued read-ahead for the inode blocks, which may be
+         * dropped - make sure all of them are on their way. */
+        for (pos = 0; pos < rb.rb_used; pos += dp->dp_reclen) {
+                dp = (struct stamfs_direntplus *)(buf + pos);
+                prefetch_inos[nr_prefetch++] = dp->dp_ino;
+                if (nr_prefetch == STAMFS_READDIR_PREFETCH_MAX) {
+                        stamfs_readdir_prefetch(sb, READ, prefetch_inos,
+                                                nr_prefetch);
+                        nr_prefetch = 0;
+                }
+        }
+        if (nr_prefetch > 0)
+                stamfs_readdir_prefetch(sb, READ, prefetch_inos, nr_prefetch);
+
+        for (pos = 0; pos < rb.rb_used; pos += dp->dp_reclen) {
+                dp = (struct stamfs_direntplus *)(buf + pos);
+                stamfs_readdirplus_stat(sb, dp);
+        }
+
+        *p_len = rb.rb_used;
+        return rb.rb_count;
+}
+
 /*
  * This function is used for syncing the contents of a file to the disk
  * (i.e. force writing all dirty pages and buffer_head-s of this file
@@ -19,12 +19,44 @@ extern struct file_operations stamfs_dir_fops;
  */
 extern struct file_operations stamfs_file_fops;
 
+/*
+ * Read from a file, or map it into memory. the generic code does all the
+ * work, except for updating the access time, which follows our mount
+ * options.
+ */
+ssize_t stamfs_file_read(struct file *filp, char *buf, size_t count,
+                         loff_t *ppos);
+int stamfs_file_mmap(struct file *filp, struct vm_area_struct *vma);
+
+/*
+ * Write to a file - the generic code does all the work, and we then account
+ * for the change in the file's size and blocks in its directories' usage.
+ */
+ssize_t stamfs_file_write(struct file *filp, const char *buf, size_t count,
+                          loff_t *ppos);
+
+/*
+ * Set the readdir position of a directory. the new position is taken to be
+ * one of the directory's current layout (see stamfs_readdir()).
+ */
+loff_t stamfs_dir_llseek(struct file *filp, loff_t offset, int origin);
+
 /*
  * This function is used for reading the contents of a directory, and
  * passing it back to the user.
  */
 int stamfs_readdir(struct file *filp, void *dirent, filldir_t filldir);
 
+/*
+ * Read the next entries of the given directory into the given buffer,
+ * together with the attributes of their inodes (STAMFS_IOC_READDIRPLUS).
+ * *p_len holds the length of the buffer, and gets the length of the
+ * entries. the caller holds the directory's i_sem.
+ * @return the number of entries on success, a negative error code on
+ *         failure.
+ */
+int stamfs_readdirplus(struct file *filp, char *buf, unsigned int *p_len);
+
 /*
  * This function is used for syncing the contents of a file to the disk
  * (i.e. forcing writing all dirty pages and buffer_head-s of this file
@@ -21,6 +21,277 @@
 #include "stamfs_iops.h"
 #include "stamfs_fops.h"
 #include "stamfs_aops.h"
+#include "stamfs_usage.h"
+#include "stamfs_changelog.h"
+#include "stamfs_cache.h"
+#include "stamfs_names.h"
+#include "stamfs_dir_bloom.h"
+#include "stamfs_dir.h"
+
+/*
+ * Slab cache from which the per-inode STAMFS meta data is allocated, and
+ * the number of such objects currently in use. Each meta struct lives
+ * exactly as long as its VFS inode - it is freed from clear_inode(), so
+ * it is reclaimed together with the VFS's inode cache.
+ */
+static kmem_cache_t *stamfs_inode_cachep = NULL;
+static atomic_t stamfs_inode_meta_count = ATOMIC_INIT(0);
+
+/*
+ * Create the slab cache used for the per-inode meta data.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_inode_init_cache(void)
+{
+        stamfs_inode_cachep =
+                kmem_cache_create("stamfs_inode_meta",
+                                  sizeof(struct stamfs_inode_meta_data),
+                                  0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+        if (!stamfs_inode_cachep)
+                return -ENOMEM;
+
+        return 0;
+}
+
+/*
+ * Destroy the slab cache used for the per-inode meta data. all inodes must
+ * have been cleared by now.
+ */
+void stamfs_inode_destroy_cache(void)
+{
+        if (kmem_cache_destroy(stamfs_inode_cachep))
+                printk(KERN_WARNING "stamfs: %d inode meta structs leaked.\n",
+                       atomic_read(&stamfs_inode_meta_count));
+        stamfs_inode_cachep = NULL;
+}
+
+/*
+ * Allocate and initialize the meta data of an inode, whose info is stored
+ * in the given block, and whose block index is in the given block.
+ * @return the new meta struct, or NULL if out of memory.
+ */
+struct stamfs_inode_meta_data *stamfs_inode_alloc_meta(unsigned long block_num,
+                                                       unsigned long bi_block_num)
+{
+        struct stamfs_inode_meta_data *inode_meta = NULL;
+
+        inode_meta = kmem_cache_alloc(stamfs_inode_cachep, SLAB_KERNEL);
+        if (!inode_meta)
+                return NULL;
+        atomic_inc(&stamfs_inode_meta_count);
+
+        inode_meta->i_block_num = block_num;
+        inode_meta->i_bi_block_num = bi_block_num;
+        inode_meta->i_bh = NULL;
+        spin_lock_init(&inode_meta->i_bmap_lock);
+        inode_meta->i_bmap = NULL;
+        inode_meta->i_names = NULL;
+        inode_meta->i_dir_free = NULL;
+        inode_meta->i_dir_bloom = NULL;
+        inode_meta->i_dir_free_block = 0;
+        inode_meta->i_dir_entries = 0;
+        INIT_LIST_HEAD(&inode_meta->i_cache_lru);
+        inode_meta->i_lazy_times = 0;
+        inode_meta->i_lazy_since = 0;
+        INIT_LIST_HEAD(&inode_meta->i_lazy_list);
+        inode_meta->i_lazy_ino = NULL;
+        inode_meta->i_parent_ino = 0;
+        inode_meta->i_flags = 0;
+        inode_meta->i_tree_bytes = 0;
+        inode_meta->i_tree_blocks = 0;
+        inode_meta->i_tree_inodes = 1;
+        inode_meta->i_acct_bytes = 0;
+        inode_meta->i_acct_blocks = 0;
+
+        return inode_meta;
+}
+
+/*
+ * Free an inode's meta data, previously allocated by stamfs_inode_alloc_meta.
+ */
+void stamfs_inode_free_meta(struct stamfs_inode_meta_data *inode_meta)
+{
+        if (inode_meta->i_bh)
+                brelse(inode_meta->i_bh);
+        if (inode_meta->i_bmap)
+                kfree(inode_meta->i_bmap);
+        if (inode_meta->i_names)
+                stamfs_names_free(inode_meta->i_names);
+        if (inode_meta->i_dir_free)
+                kfree(inode_meta->i_dir_free);
+        if (inode_meta->i_dir_bloom)
+                stamfs_dir_bloom_free(inode_meta->i_dir_bloom);
+        kmem_cache_free(stamfs_inode_cachep, inode_meta);
+        atomic_dec(&stamfs_inode_meta_count);
+}
+
+/*
+ * Report the number of inode meta structs in use, via the proc file-system.
+ */
+int stamfs_inode_read_proc(char *page, char **start, off_t off, int count,
+                           int *eof, void *data)
+{
+        int len;
+
+        len = sprintf(page, "%d\n", atomic_read(&stamfs_inode_meta_count));
+        *eof = 1;
+
+        return len;
+}
+
+/*
+ * Read the inode's block index from disk, and keep a decoded copy of it in
+ * the inode's meta data, so that later lookups need not touch the buffer
+ * cache at all.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int stamfs_inode_bmap_load(struct inode *ino)
+{
+        int err = 0;
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+        unsigned long bi_block_num = inode_meta->i_bi_block_num;
+        struct buffer_head *bibh = NULL;
+        unsigned long *bmap = NULL;
+        __u32 ptr;
+        int i;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: loading block map of inode %lu\n",
+                             ino->i_ino);
+
+        bmap = kmalloc(sizeof(unsigned long) * STAMFS_MAX_BLOCKS_PER_FILE,
+                       GFP_NOFS);
+        if (!bmap) {
+                /* under memory pressure, give back all the cached maps. */
+                stamfs_cache_shrink(sb, ~0UL);
+                bmap = kmalloc(sizeof(unsigned long) * STAMFS_MAX_BLOCKS_PER_FILE,
+                               GFP_NOFS);
+        }
+        if (!bmap) {
+                printk("stamfs: not enough memory to allocate block map.\n");
+                err = -ENOMEM;
+                goto ret;
+        }
+
+        /* read the inode's block index. */
+        if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
+                printk("stamfs: unable to read inode block index, block %lu.\n",
+                       bi_block_num);
+                err = -EIO;
+                goto ret;
+        }
+
+        /* unmapped offsets are kept as 0, whatever their on-disk marker. */
+        for (i = 0; i < STAMFS_MAX_BLOCKS_PER_FILE; i++) {
+                ptr = stamfs_get_block_ptr(bibh->b_data, i);
+                bmap[i] = (ptr == STAMFS_FREE_BLOCK_MARKER ? 0 : ptr);
+        }
+
+        /* someone else might have loaded the map while we were reading. */
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (!inode_meta->i_bmap) {
+                inode_meta->i_bmap = bmap;
+                bmap = NULL;
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+        stamfs_cache_insert(ino);
+
+  ret:
+        if (bmap)
+                kfree(bmap);
+        if (bibh)
+                brelse(bibh);
+        return err;
+}
+
+/*
+ * Find the block number mapped at the given block offset of the inode,
+ * using the in-memory copy of its block index (loading it on first use).
+ * sets *p_block_num to 0 if the offset is not mapped.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_inode_bmap_lookup(struct inode *ino, int block_offset,
+                             unsigned long *p_block_num)
+{
+        int err = 0;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        if (block_offset < 0 ||
+            block_offset >= STAMFS_MAX_BLOCKS_PER_FILE) {
+                *p_block_num = 0;
+                return 0;
+        }
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_bmap) {
+                *p_block_num = inode_meta->i_bmap[block_offset];
+                spin_unlock(&inode_meta->i_bmap_lock);
+                stamfs_cache_hit(ino);
+                return 0;
+        }
+        /* it may be evicted again right after loading - so retry. */
+        while (!inode_meta->i_bmap) {
+                spin_unlock(&inode_meta->i_bmap_lock);
+                err = stamfs_inode_bmap_load(ino);
+                if (err)
+                        return err;
+                spin_lock(&inode_meta->i_bmap_lock);
+        }
+        *p_block_num = inode_meta->i_bmap[block_offset];
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        return 0;
+}
+
+/*
+ * Update the in-memory copy of the inode's block index (if loaded), after
+ * the on-disk block index was changed at the given block offset.
+ */
+void stamfs_inode_bmap_update(struct inode *ino, int block_offset,
+                              unsigned long block_num)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        if (block_num == (unsigned long)STAMFS_FREE_BLOCK_MARKER)
+                block_num = 0;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_bmap)
+                inode_meta->i_bmap[block_offset] = block_num;
+        spin_unlock(&inode_meta->i_bmap_lock);
+}
+
+/*
+ * Allocate a block for offset 0 of the given inode - right after its block
+ * index, which stamfs_alloc_inode_cluster() allocated right after the
+ * inode's block, if that block is still free.
+ * returns the block number, or 0 if no free blocks are available.
+ */
+unsigned long stamfs_inode_alloc_first_block(struct inode *ino)
+{
+        return stamfs_alloc_block_near(ino->i_sb,
+                                       STAMFS_INODE_META(ino)->i_bi_block_num + 1);
+}
+
+/*
+ * Drop the in-memory copy of the inode's block index - it will be re-read
+ * from disk on the next lookup.
+ */
+void stamfs_inode_bmap_invalidate(struct inode *ino)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+        unsigned long *bmap;
+
+        stamfs_cache_remove(ino);
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        bmap = inode_meta->i_bmap;
+        inode_meta->i_bmap = NULL;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (bmap)
+                kfree(bmap);
+}
 
 /*
  * Given a VFS inode and the inode's block on disk, read the inode's contents
@@ -36,7 +307,6 @@ int stamfs_inode_read_ino (struct inode *ino, unsigned long block_num)
         unsigned long bi_block_num = 0;
         struct stamfs_inode_meta_data *stamfs_inode_meta = NULL;
 
-
         STAMFS_DBG(DEB_STAM, "stamfs: do-reading inode %ld\n", ino->i_ino);
 
         /* read the inode's block from disk. */
@@ -51,14 +321,14 @@ int stamfs_inode_read_ino (struct inode *ino, unsigned long block_num)
                              ino->i_ino, bi_block_num);
 
         /* init the inode's meta data. */
-        stamfs_inode_meta = kmalloc(sizeof(struct stamfs_inode_meta_data),
-                                    GFP_KERNEL);
+        stamfs_inode_meta = stamfs_inode_alloc_meta(block_num, bi_block_num);
         if (!stamfs_inode_meta) {
                 printk("stamfs: not enough memory to allocate inode meta struct.\n");
                 goto ret_err;
         }
-        stamfs_inode_meta->i_block_num = block_num;
-        stamfs_inode_meta->i_bi_block_num = bi_block_num;
+        /* keep the inode's block around, for writing the inode back. */
+        stamfs_inode_meta->i_bh = ibh;
+        ibh = NULL;
 
         ino->i_mode = le16_to_cpu(stamfs_ino->i_mode);
         ino->i_nlink = le16_to_cpu(stamfs_ino->i_num_links);
@@ -72,6 +342,47 @@ int stamfs_inode_read_ino (struct inode *ino, unsigned long block_num)
         ino->i_mtime = le32_to_cpu(stamfs_ino->i_mtime);
         ino->i_ctime = le32_to_cpu(stamfs_ino->i_ctime);
         ino->i_attr_flags = 0;
+        if (STAMFS_META(sb)->s_feature_ro_compat &
+            STAMFS_FEATURE_RO_COMPAT_PARENT)
+                stamfs_inode_meta->i_parent_ino =
+                        le32_to_cpu(stamfs_ino->i_parent_ino);
+        if (STAMFS_META(sb)->s_feature_ro_compat &
+            STAMFS_FEATURE_RO_COMPAT_DIR_USAGE) {
+                stamfs_inode_meta->i_tree_bytes =
+                        le32_to_cpu(stamfs_ino->i_tree_bytes) |
+                        (__u64)le32_to_cpu(stamfs_ino->i_tree_bytes_hi) << 32;
+                stamfs_inode_meta->i_tree_blocks =
+                        le32_to_cpu(stamfs_ino->i_tree_blocks) |
+                        (__u64)le32_to_cpu(stamfs_ino->i_tree_blocks_hi) << 32;
+                stamfs_inode_meta->i_tree_inodes =
+                        le32_to_cpu(stamfs_ino->i_tree_inodes);
+                /* the on-disk size and blocks are accounted for already. */
+                stamfs_inode_meta->i_acct_bytes = ino->i_size;
+                stamfs_inode_meta->i_acct_blocks = ino->i_blocks;
+        }
+        /* access times are updated by us - see stamfs_inode_update_atime. */
+        ino->i_flags |= S_NOATIME;
+        /* without the feature, these fields may hold leftovers of an older
+           layout - they stay 0. */
+        if (stamfs_inode_flags_enabled(sb)) {
+                stamfs_inode_meta->i_flags =
+                        le32_to_cpu(stamfs_ino->i_flags) &
+                        ~STAMFS_INODE_FL_SEALED;
+                if (le32_to_cpu(stamfs_ino->i_flags) & STAMFS_INODE_FL_SEALED)
+                        ino->i_flags |= S_IMMUTABLE;
+                /* a hint past the directory's end would skip blocks added
+                   later. */
+                if (S_ISDIR(ino->i_mode)) {
+                        stamfs_inode_meta->i_dir_free_block =
+                                le32_to_cpu(stamfs_ino->i_dir_free_block);
+                        if (stamfs_inode_meta->i_dir_free_block >
+                            stamfs_dir_num_blocks(ino))
+                                stamfs_inode_meta->i_dir_free_block =
+                                        stamfs_dir_num_blocks(ino);
+                }
+                stamfs_inode_meta->i_dir_entries =
+                        le32_to_cpu(stamfs_ino->i_dir_entries);
+        }
         ino->u.generic_ip = stamfs_inode_meta;
 
         /* set the inode operations structs. */
@@ -100,13 +411,29 @@ int stamfs_inode_read_ino (struct inode *ino, unsigned long block_num)
         /* mark the inode to be invalid. */
         make_bad_inode(ino);
         if (stamfs_inode_meta)
-                kfree(stamfs_inode_meta);
+                stamfs_inode_free_meta(stamfs_inode_meta);
   ret:
         if (ibh)
                 brelse(ibh);
         return err;
 }
 
+/*
+ * The inode's times were written to its block, or the inode is going away -
+ * take it off the lazytime list.
+ */
+static void stamfs_inode_lazy_done(struct inode *ino)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(ino->i_sb);
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        spin_lock(&stamfs_meta->s_lazy_lock);
+        inode_meta->i_lazy_times = 0;
+        list_del_init(&inode_meta->i_lazy_list);
+        inode_meta->i_lazy_ino = NULL;
+        spin_unlock(&stamfs_meta->s_lazy_lock);
+}
+
 /*
  * Update the on-disk copy of the given inode, based on the data in the given
  * VFS inode struct.
@@ -118,22 +445,15 @@ int stamfs_inode_write_ino (struct inode *ino, int do_sync)
 {
 
         int err = 0;
-        struct super_block *sb = ino->i_sb;
         ino_t ino_num = ino->i_ino;
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(ino->i_sb);
         struct stamfs_inode_meta_data *stamfs_inode_meta = STAMFS_INODE_META(ino);
-        __u32 inode_block_num = stamfs_inode_meta->i_block_num;
-        struct buffer_head *ibh = NULL;
+        struct buffer_head *ibh = stamfs_inode_meta->i_bh;
         struct stamfs_inode *stamfs_ino = NULL;
 
         STAMFS_DBG(DEB_STAM, "stamfs: do-writing inode %ld\n", ino_num);
 
-        /* load the inode's block. */
-        if (!(ibh = bread(sb->s_dev, inode_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read block %d.\n", inode_block_num);
-                err = -EIO;
-                goto ret;
-        }
-
+        /* the inode's block is held for as long as the inode is in core. */
         stamfs_ino = (struct stamfs_inode*)((char*)(ibh->b_data));
 
         /* copy data from the VFS's inode to the on-disk inode. */
@@ -146,9 +466,35 @@ int stamfs_inode_write_ino (struct inode *ino, int do_sync)
         stamfs_ino->i_ctime = cpu_to_le32(ino->i_ctime);
         stamfs_ino->i_num_blocks = cpu_to_le32(ino->i_blocks);
         stamfs_ino->i_size = cpu_to_le32(ino->i_size);
-        /* write this even thought it doesn't change - to be on the safe side. */
-        stamfs_ino->i_index_block = cpu_to_le32(stamfs_inode_meta->i_bi_block_num);
+        if (stamfs_meta->s_feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT)
+                stamfs_ino->i_parent_ino =
+                        cpu_to_le32(stamfs_inode_meta->i_parent_ino);
+        if (stamfs_meta->s_feature_ro_compat &
+            STAMFS_FEATURE_RO_COMPAT_DIR_USAGE) {
+                stamfs_ino->i_tree_bytes =
+                        cpu_to_le32((__u32)stamfs_inode_meta->i_tree_bytes);
+                stamfs_ino->i_tree_bytes_hi =
+                        cpu_to_le32((__u32)(stamfs_inode_meta->i_tree_bytes >> 32));
+                stamfs_ino->i_tree_blocks =
+                        cpu_to_le32((__u32)stamfs_inode_meta->i_tree_blocks);
+                stamfs_ino->i_tree_blocks_hi =
+                        cpu_to_le32((__u32)(stamfs_inode_meta->i_tree_blocks >> 32));
+                stamfs_ino->i_tree_inodes =
+                        cpu_to_le32(stamfs_inode_meta->i_tree_inodes);
+        }
+        if (stamfs_meta->s_feature_ro_compat &
+            STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS) {
+                stamfs_ino->i_flags =
+                        cpu_to_le32(stamfs_inode_meta->i_flags |
+                                    (IS_IMMUTABLE(ino) ?
+                                     STAMFS_INODE_FL_SEALED : 0));
+                stamfs_ino->i_dir_free_block =
+                        cpu_to_le32(stamfs_inode_meta->i_dir_free_block);
+                stamfs_ino->i_dir_entries =
+                        cpu_to_le32(stamfs_inode_meta->i_dir_entries);
+        }
         mark_buffer_dirty_inode(ibh, ino);
+        stamfs_inode_lazy_done(ino);
 
         /* for a synchronous operation - write the buffer immediately. */
         if (do_sync) {
@@ -162,8 +508,6 @@ int stamfs_inode_write_ino (struct inode *ino, int do_sync)
         }
 
   ret:
-        if (ibh)
-                brelse(ibh);
         return err;
 }
 
@@ -176,8 +520,8 @@ int stamfs_inode_free_inode(struct inode *ino)
         int err = 0;
         struct super_block *sb = ino->i_sb;
         struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
-        int inode_block_num = stamfs_inode_to_block_num(ino);
-        int bi_block_num = inode_meta->i_bi_block_num;
+        unsigned long inode_block_num = stamfs_inode_to_block_num(ino);
+        unsigned long bi_block_num = inode_meta->i_bi_block_num;
 
         STAMFS_DBG(DEB_STAM, "stamfs: freeing inode %lu\n", ino->i_ino);
 
@@ -186,6 +530,13 @@ int stamfs_inode_free_inode(struct inode *ino)
         if (err < 0)
                 goto ret;
 
+        /* the inode's block is going away - drop our hold on its buffer,
+         * so that it doesn't get written back over a reused block. */
+        if (inode_meta->i_bh) {
+                bforget(inode_meta->i_bh);
+                inode_meta->i_bh = NULL;
+        }
+
         /* if we fail freeing the blocks - a file-system check program will
          * need to reclaim these blocks (which no one points to now). */
         stamfs_release_block(sb, inode_block_num);
@@ -207,13 +558,12 @@ int stamfs_inode_do_truncate(struct inode *ino)
         int err = 0;
         struct super_block *sb = ino->i_sb;
         struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
-        int bi_block_num = inode_meta->i_bi_block_num;
+        unsigned long bi_block_num = inode_meta->i_bi_block_num;
         struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
-        int ino_size = ino->i_size;
+        loff_t ino_size = ino->i_size;
         int block_size;
         int i;
-        unsigned int curr_block_num;
+        __u32 curr_block_num;
         int freed_blocks_count = 0;
 
         STAMFS_DBG(DEB_STAM,
@@ -222,12 +572,11 @@ int stamfs_inode_do_truncate(struct inode *ino)
 
         /* read the inode's block index. */
         if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
+                printk("stamfs: unable to read inode block index, block %lu.\n",
                        bi_block_num);
                 err = -EIO;
                 goto ret;
         }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
 
         /* free each data block which is fully beyond the inode's data size. */
         /* NOTE: one block might now be "half-truncated" - this is handled   */
@@ -241,11 +590,12 @@ int stamfs_inode_do_truncate(struct inode *ino)
 
         STAMFS_DBG(DEB_STAM, "stamfs: freeing from block offset %d\n", i);
         for ( ; i < STAMFS_MAX_BLOCKS_PER_FILE; i++) {
-                curr_block_num = stamfs_bi->index[i];
+                curr_block_num = stamfs_get_block_ptr(bibh->b_data, i);
                 if (curr_block_num != STAMFS_FREE_BLOCK_MARKER && curr_block_num != 0) {
-                        stamfs_bi->index[i] = STAMFS_FREE_BLOCK_MARKER;
-                        STAMFS_DBG(DEB_STAM, "stamfs: freeing block %u\n",
-                                             curr_block_num);
+                        stamfs_set_block_ptr(bibh->b_data, i,
+                                             STAMFS_FREE_BLOCK_MARKER);
+                        STAMFS_DBG(DEB_STAM, "stamfs: freeing block %lu\n",
+                                             (unsigned long)curr_block_num);
                         /* if we fail freeing the block - a file-system check
                          * program will need to reclaim these blocks (which
                          * no one points to now). */
@@ -257,11 +607,13 @@ int stamfs_inode_do_truncate(struct inode *ino)
         STAMFS_DBG(DEB_STAM, "stamfs: freed %d blocks\n", freed_blocks_count);
 
         mark_buffer_dirty_inode(bibh, ino);
+        stamfs_inode_bmap_invalidate(ino);
 
         /* the VFS already handled the update of the _size_ of the inode. */
         ino->i_blocks -= freed_blocks_count;
         ino->i_mtime = ino->i_ctime = CURRENT_TIME;
         mark_inode_dirty(ino);
+        stamfs_usage_sync(ino);
 
         /* all went well... */
         err = 0;
@@ -275,11 +627,298 @@ int stamfs_inode_do_truncate(struct inode *ino)
 
 /*
  * free all data blocks of the given inode, making it refer to a
- * 0-length file.
+ * 0-length file, and log the change. like ext2, a sealed or append-only
+ * file is left alone - deleting an inode frees its blocks through
+ * stamfs_inode_do_truncate directly.
  */
 void stamfs_inode_truncate(struct inode *ino)
 {
-        stamfs_inode_do_truncate(ino);
+        if (IS_IMMUTABLE(ino) || IS_APPEND(ino))
+                return;
+        if (stamfs_inode_do_truncate(ino) == 0)
+                stamfs_changelog_record(ino, STAMFS_CHANGE_TRUNCATE);
+}
+
+/*
+ * Move the data blocks of the given regular file into a single run of
+ * adjacent blocks. the caller must hold ino->i_sem, and make sure the file
+ * is not written meanwhile (i.e. seal it first).
+ * the data is copied to the new blocks and written out, and only then is
+ * the block index switched to point to them - with a single write of the
+ * index block - after which the old blocks are released. a crash in between
+ * leaves the file intact, and at most leaks the new blocks.
+ * @return 0 on success (including when the blocks are adjacent already),
+ *         -ENOSPC if there is no room for such a run, another negative
+ *         error code on failure.
+ */
+int stamfs_inode_relayout(struct inode *ino)
+{
+        int err = 0;
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+        struct buffer_head *bibh = NULL;
+        struct buffer_head *old_bh = NULL;
+        struct buffer_head **new_bhs = NULL;
+        unsigned long *old_block_nums = NULL;
+        unsigned long *new_block_nums = NULL;
+        __u32 curr_block_num;
+        int count = 0;
+        int adjacent = 1;
+        int allocated = 0;
+        int i;
+        int j;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: relayout of inode %lu\n", ino->i_ino);
+
+        /* the page cache refers to the old blocks - it can't be dropped
+         * from under a mapping. */
+        if (ino->i_mapping->i_mmap || ino->i_mapping->i_mmap_shared)
+                return -EBUSY;
+
+        /* get the file's data on disk, where we will copy it from. */
+        err = filemap_fdatasync(ino->i_mapping);
+        err |= fsync_inode_data_buffers(ino);
+        err |= filemap_fdatawait(ino->i_mapping);
+        if (err) {
+                err = -EIO;
+                goto ret;
+        }
+
+        if (!(bibh = bread(sb->s_dev, inode_meta->i_bi_block_num,
+                           STAMFS_BLOCK_SIZE))) {
+                printk("stamfs: unable to read inode block index, block %lu.\n",
+                       inode_meta->i_bi_block_num);
+                err = -EIO;
+                goto ret;
+        }
+
+        old_block_nums = kmalloc(STAMFS_MAX_BLOCKS_PER_FILE * sizeof(unsigned long),
+                                 GFP_KERNEL);
+        if (!old_block_nums) {
+                err = -ENOMEM;
+                goto ret;
+        }
+
+        /* nothing to do if the mapped blocks are adjacent already. */
+        for (i = 0; i < STAMFS_MAX_BLOCKS_PER_FILE; i++) {
+                curr_block_num = stamfs_get_block_ptr(bibh->b_data, i);
+                if (curr_block_num == 0 ||
+                    curr_block_num == STAMFS_FREE_BLOCK_MARKER)
+                        continue;
+                if (count > 0 && curr_block_num != old_block_nums[count-1] + 1)
+                        adjacent = 0;
+                old_block_nums[count++] = curr_block_num;
+        }
+        if (count <= 1 || adjacent)
+                goto ret;
+
+        new_block_nums = kmalloc(count * sizeof(unsigned long), GFP_KERNEL);
+        new_bhs = kmalloc(count * sizeof(struct buffer_head *), GFP_KERNEL);
+        if (!new_block_nums || !new_bhs) {
+                err = -ENOMEM;
+                goto ret;
+        }
+        memset(new_bhs, 0, count * sizeof(struct buffer_head *));
+
+        if (!stamfs_alloc_block_run(sb, count, new_block_nums)) {
+                STAMFS_DBG(DEB_STAM, "stamfs: no room for %d adjacent blocks\n",
+                                     count);
+                err = -ENOSPC;
+                goto ret;
+        }
+        allocated = 1;
+
+        /* copy the data, and write it out. */
+        for (j = 0; j < count; j++) {
+                if (!(old_bh = bread(sb->s_dev, old_block_nums[j],
+                                     STAMFS_BLOCK_SIZE))) {
+                        printk("stamfs: unable to read data block %lu.\n",
+                               old_block_nums[j]);
+                        err = -EIO;
+                        goto ret;
+                }
+                new_bhs[j] = getblk(sb->s_dev, new_block_nums[j],
+                                    STAMFS_BLOCK_SIZE);
+                if (!new_bhs[j]) {
+                        err = -EIO;
+                        goto ret;
+                }
+                memcpy(new_bhs[j]->b_data, old_bh->b_data, STAMFS_BLOCK_SIZE);
+                mark_buffer_uptodate(new_bhs[j], 1);
+                mark_buffer_dirty(new_bhs[j]);
+                brelse(old_bh);
+                old_bh = NULL;
+        }
+        ll_rw_block(WRITE, count, new_bhs);
+        for (j = 0; j < count; j++) {
+                wait_on_buffer(new_bhs[j]);
+                if (!buffer_uptodate(new_bhs[j])) {
+                        printk("stamfs: IO error writing data block %lu.\n",
+                               new_block_nums[j]);
+                        err = -EIO;
+                        goto ret;
+                }
+        }
+
+        /* switch to the new blocks. */
+        for (i = 0, j = 0; i < STAMFS_MAX_BLOCKS_PER_FILE && j < count; i++) {
+                curr_block_num = stamfs_get_block_ptr(bibh->b_data, i);
+                if (curr_block_num == 0 ||
+                    curr_block_num == STAMFS_FREE_BLOCK_MARKER)
+                        continue;
+                stamfs_set_block_ptr(bibh->b_data, i, new_block_nums[j++]);
+        }
+        mark_buffer_dirty(bibh);
+        ll_rw_block(WRITE, 1, &bibh);
+        wait_on_buffer(bibh);
+        stamfs_inode_bmap_invalidate(ino);
+        truncate_inode_pages(ino->i_mapping, 0);
+        if (!buffer_uptodate(bibh)) {
+                /* we can't tell which blocks the file uses now - keep both. */
+                printk("stamfs: IO error writing block index of inode %lu.\n",
+                       ino->i_ino);
+                allocated = 0;
+                err = -EIO;
+                goto ret;
+        }
+
+        for (j = 0; j < count; j++)
+                stamfs_release_block(sb, old_block_nums[j]);
+        allocated = 0;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: inode %lu moved to blocks %lu-%lu\n",
+                             ino->i_ino, new_block_nums[0],
+                             new_block_nums[count-1]);
+
+  ret:
+        if (old_bh)
+                brelse(old_bh);
+        if (new_bhs) {
+                for (j = 0; j < count; j++) {
+                        if (!new_bhs[j])
+                                continue;
+                        if (allocated)
+                                bforget(new_bhs[j]);
+                        else
+                                brelse(new_bhs[j]);
+                }
+                kfree(new_bhs);
+        }
+        /* on failure before the switch, give the new blocks back - from
+         * the last one, so that they are not put on the free list. */
+        if (allocated) {
+                for (j = count - 1; j >= 0; j--)
+                        stamfs_release_block(sb, new_block_nums[j]);
+        }
+        if (new_block_nums)
+                kfree(new_block_nums);
+        if (old_block_nums)
+                kfree(old_block_nums);
+        if (bibh)
+                brelse(bibh);
+        return err;
+}
+
+/*
+ * the longest time an access time updated under 'lazytime' may stay off the
+ * disk, and the age after which 'relatime' updates an access time anyway.
+ */
+#define STAMFS_LAZYTIME_MAX_AGE (12*60*60)
+#define STAMFS_RELATIME_MAX_AGE (24*60*60)
+
+/*
+ * Mark the given inode as accessed now, according to the FS's 'noatime',
+ * 'relatime' and 'lazytime' mount options. used instead of UPDATE_ATIME.
+ */
+void stamfs_inode_update_atime(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+        time_t now = CURRENT_TIME;
+
+        /* the generic flags still apply (our inodes are all S_NOATIME). */
+        if (IS_RDONLY(ino) || (sb->s_flags & MS_NOATIME))
+                return;
+        if (S_ISDIR(ino->i_mode) && (sb->s_flags & MS_NODIRATIME))
+                return;
+        if (stamfs_meta->s_atime_mode == STAMFS_ATIME_NOATIME)
+                return;
+        if (ino->i_atime == now)
+                return;
+
+        /* 'relatime' - only the first access after a change matters. */
+        if (stamfs_meta->s_atime_mode == STAMFS_ATIME_RELATIME &&
+            ino->i_atime > ino->i_mtime && ino->i_atime > ino->i_ctime &&
+            now - ino->i_atime < STAMFS_RELATIME_MAX_AGE)
+                return;
+
+        ino->i_atime = now;
+
+        if (!stamfs_meta->s_lazytime || !inode_meta) {
+                mark_inode_dirty_sync(ino);
+                return;
+        }
+
+        /* 'lazytime' - don't dirty the inode. the time reaches the disk
+         * (through stamfs_inode_write_ino()) with the next change of the
+         * inode, when the inode is released, or once it is old - see
+         * stamfs_inode_expire_lazy_times(). */
+        spin_lock(&stamfs_meta->s_lazy_lock);
+        if (!inode_meta->i_lazy_times) {
+                inode_meta->i_lazy_times = 1;
+                inode_meta->i_lazy_since = now;
+                inode_meta->i_lazy_ino = ino;
+                list_add(&inode_meta->i_lazy_list, &stamfs_meta->s_lazy_list);
+                /* have the periodic write-back call stamfs_write_super(). */
+                sb->s_dirt = 1;
+        }
+        spin_unlock(&stamfs_meta->s_lazy_lock);
+}
+
+/*
+ * Dirty the inode, if it holds times updated under 'lazytime'.
+ */
+void stamfs_inode_flush_lazy_times(struct inode *ino)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        if (!inode_meta || !inode_meta->i_lazy_times)
+                return;
+
+        mark_inode_dirty_sync(ino);
+}
+
+/*
+ * Dirty the inodes of the given FS whose times were updated under
+ * 'lazytime' longer than STAMFS_LAZYTIME_MAX_AGE ago.
+ * @return 1 if inodes with more recent lazy updates are left, 0 if not.
+ */
+int stamfs_inode_expire_lazy_times(struct super_block *sb)
+{
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_inode_meta_data *inode_meta = NULL;
+        time_t now = CURRENT_TIME;
+        int left;
+
+        spin_lock(&stamfs_meta->s_lazy_lock);
+        while (!list_empty(&stamfs_meta->s_lazy_list)) {
+                inode_meta = list_entry(stamfs_meta->s_lazy_list.prev,
+                                        struct stamfs_inode_meta_data,
+                                        i_lazy_list);
+                if (now - inode_meta->i_lazy_since < STAMFS_LAZYTIME_MAX_AGE)
+                        break;
+                /* the inode stays lazy until it is written - but it need
+                 * not be dirtied again. an inode on the list is in use, or
+                 * dirty (see stamfs_put_inode()), so it is not freed under
+                 * us - stamfs_inode_clear() takes it off the list first. */
+                list_del_init(&inode_meta->i_lazy_list);
+                mark_inode_dirty_sync(inode_meta->i_lazy_ino);
+        }
+        left = !list_empty(&stamfs_meta->s_lazy_list);
+        spin_unlock(&stamfs_meta->s_lazy_lock);
+
+        return left;
 }
 
 /*
@@ -291,6 +930,12 @@ void stamfs_inode_clear (struct inode *ino)
         struct stamfs_inode_meta_data *stamfs_inode_meta = STAMFS_INODE_META(ino);
 
         /* free memory used by this inode, on behalf of stamfs. */
-        kfree(stamfs_inode_meta);
+        if (!stamfs_inode_meta)
+                return;
+        /* lazily-updated times were flushed by stamfs_put_inode() - and
+         * the inode's buffers were already invalidated by clear_inode(). */
+        stamfs_inode_lazy_done(ino);
+        stamfs_cache_remove(ino);
+        stamfs_inode_free_meta(stamfs_inode_meta);
         ino->u.generic_ip = NULL;
 }
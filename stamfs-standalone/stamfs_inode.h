@@ -5,12 +5,50 @@
 
 #include <linux/stddef.h>
 #include <linux/fs.h>
+#include <linux/spinlock.h>
+
+struct stamfs_name_table;
+struct stamfs_dir_bloom;
 
 
 /* STAMFS meta-data to be attached to each VFS inode. */
 struct stamfs_inode_meta_data {
-        __u32  i_block_num;     /* block containing the inode.               */
-        __u32  i_bi_block_num;  /* block containing the inode's block index. */
+        unsigned long i_block_num;    /* block containing the inode.         */
+        unsigned long i_bi_block_num; /* block containing the inode's block  */
+                                      /* index.                              */
+        struct buffer_head *i_bh; /* the inode's block, held while the     */
+                                  /* inode is in core.                     */
+        spinlock_t i_bmap_lock; /* protects i_bmap, i_names, i_dir_free and */
+                                /* i_dir_bloom.                              */
+        unsigned long *i_bmap;  /* decoded copy of the block index, or NULL  */
+                                /* if it was not loaded yet.                 */
+        struct stamfs_name_table *i_names; /* a directory's name table (see */
+                                /* stamfs_names.c), or NULL.                 */
+        __u16 *i_dir_free;      /* per data block of a directory, the offset */
+                                /* below which it has no room, or NULL.      */
+        struct stamfs_dir_bloom *i_dir_bloom; /* a directory's Bloom     */
+                                /* filters (see stamfs_dir_bloom.c), or NULL. */
+        unsigned long i_dir_free_block; /* see struct stamfs_inode.        */
+        unsigned long i_dir_entries; /* see struct stamfs_inode.           */
+        struct list_head i_cache_lru; /* on the mount's LRU list while the */
+                                /* decoded meta-data above is in memory.     */
+        int i_lazy_times;       /* 'lazytime': times were updated in the VFS */
+                                /* inode, but the inode was not dirtied.     */
+        time_t i_lazy_since;    /* when i_lazy_times was set.                */
+        struct list_head i_lazy_list; /* on the mount's lazytime list while */
+                                /* i_lazy_times is set (and the inode was    */
+                                /* not yet dirtied for it).                  */
+        struct inode *i_lazy_ino; /* the VFS inode, while on that list.    */
+        unsigned long i_parent_ino; /* parent directory, or 0.            */
+        __u32 i_flags;          /* STAMFS_INODE_FL_*, except for SEALED,     */
+                                /* which follows S_IMMUTABLE.                */
+        /* usage of the subtree rooted at this inode (see stamfs_usage.c), */
+        /* and the inode's own size and blocks already accounted in it.    */
+        __u64 i_tree_bytes;
+        __u64 i_tree_blocks;
+        unsigned long i_tree_inodes;
+        loff_t i_acct_bytes;
+        unsigned long i_acct_blocks;
 };
 
 /* extract the STAMFS inode meta-data from a VFS inode. */
@@ -41,10 +79,102 @@ int stamfs_inode_free_inode(struct inode *ino);
 
 /*
  * free all data blocks of the given inode, making it refer to a
- * 0-length file.
+ * 0-length file/directory.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_inode_do_truncate(struct inode *ino);
+
+/*
+ * free all data blocks of the given inode, making it refer to a
+ * 0-length file, and log the change. does nothing to sealed or
+ * append-only files.
  */
 void stamfs_inode_truncate(struct inode *ino);
 
+/*
+ * Move the data blocks of the given regular file into a single run of
+ * adjacent blocks. the caller must hold ino->i_sem, and make sure the file
+ * is not written meanwhile (i.e. seal it first).
+ * @return 0 on success (including when the blocks are adjacent already),
+ *         -ENOSPC if there is no room for such a run, another negative
+ *         error code on failure.
+ */
+int stamfs_inode_relayout(struct inode *ino);
+
+/*
+ * Create/destroy the slab cache used for the per-inode meta data.
+ * stamfs_inode_init_cache returns 0 on success, a negative error code on
+ * failure.
+ */
+int stamfs_inode_init_cache(void);
+void stamfs_inode_destroy_cache(void);
+
+/*
+ * Allocate and initialize the meta data of an inode, whose info is stored
+ * in the given block, and whose block index is in the given block.
+ * @return the new meta struct, or NULL if out of memory.
+ */
+struct stamfs_inode_meta_data *stamfs_inode_alloc_meta(unsigned long block_num,
+                                                       unsigned long bi_block_num);
+
+/*
+ * Free an inode's meta data, previously allocated by stamfs_inode_alloc_meta.
+ */
+void stamfs_inode_free_meta(struct stamfs_inode_meta_data *inode_meta);
+
+/*
+ * Report the number of inode meta structs in use, via the proc file-system.
+ */
+int stamfs_inode_read_proc(char *page, char **start, off_t off, int count,
+                           int *eof, void *data);
+
+/*
+ * Find the block number mapped at the given block offset of the inode,
+ * using the in-memory copy of its block index (loading it on first use).
+ * sets *p_block_num to 0 if the offset is not mapped.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_inode_bmap_lookup(struct inode *ino, int block_offset,
+                             unsigned long *p_block_num);
+
+/*
+ * Update the in-memory copy of the inode's block index (if loaded), after
+ * the on-disk block index was changed at the given block offset.
+ */
+void stamfs_inode_bmap_update(struct inode *ino, int block_offset,
+                              unsigned long block_num);
+
+/*
+ * Allocate a block for offset 0 of the given inode, next to its block index
+ * if possible.
+ * returns the block number, or 0 if no free blocks are available.
+ */
+unsigned long stamfs_inode_alloc_first_block(struct inode *ino);
+
+/*
+ * Drop the in-memory copy of the inode's block index - it will be re-read
+ * from disk on the next lookup.
+ */
+void stamfs_inode_bmap_invalidate(struct inode *ino);
+
+/*
+ * Mark the given inode as accessed now, according to the FS's 'noatime',
+ * 'relatime' and 'lazytime' mount options. used instead of UPDATE_ATIME.
+ */
+void stamfs_inode_update_atime(struct inode *ino);
+
+/*
+ * Dirty the inode, if it holds times updated under 'lazytime'.
+ */
+void stamfs_inode_flush_lazy_times(struct inode *ino);
+
+/*
+ * Dirty the inodes of the given FS whose times were updated under
+ * 'lazytime' longer than STAMFS_LAZYTIME_MAX_AGE ago.
+ * @return 1 if inodes with more recent lazy updates are left, 0 if not.
+ */
+int stamfs_inode_expire_lazy_times(struct super_block *sb);
+
 /*
  * Clear any dynamically-allocated resources used by us for the given
  * VFS inode struct.
@@ -0,0 +1,449 @@
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <asm/page.h>
+#include <asm/uaccess.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dir.h"
+#include "stamfs_dir_sort.h"
+#include "stamfs_usage.h"
+#include "stamfs_changelog.h"
+#include "stamfs_cache.h"
+#include "stamfs_fops.h"
+#include "stamfs_ioctl.h"
+
+/*
+ * STAMFS_IOC_GET_USAGE - copy the usage of the subtree rooted at the given
+ * inode to user-space.
+ */
+static int stamfs_ioctl_get_usage(struct inode *ino, unsigned long arg)
+{
+        struct stamfs_usage usage;
+        int err;
+
+        err = stamfs_usage_get(ino, &usage);
+        if (err)
+                return err;
+
+        if (copy_to_user((void *)arg, &usage, sizeof(usage)))
+                return -EFAULT;
+
+        return 0;
+}
+
+/*
+ * Build the path of the inode with the given number into the end of the
+ * given buffer, by following the parent pointers up to the root.
+ * @return the offset of the path inside the buffer on success, a negative
+ *         error code on failure.
+ */
+static int stamfs_build_path(struct super_block *sb, unsigned long ino_num,
+                             char *buf, int buf_len)
+{
+        struct inode *ino = NULL;
+        struct inode *dir = NULL;
+        char name[STAMFS_MAX_LONG_FNAME_LEN];
+        int namelen;
+        int pos = buf_len - 1;
+        unsigned long depth = 0;
+        int err = 0;
+
+        buf[pos] = '\0';
+
+        /* don't iget() inode numbers that are not in use. */
+        if (stamfs_ino_num_to_block_num(sb, ino_num) == 0)
+                return -ENOENT;
+        ino = iget(sb, ino_num);
+        if (!ino)
+                return -ENOMEM;
+        if (is_bad_inode(ino) || ino->i_nlink == 0) {
+                err = -ENOENT;
+                goto ret;
+        }
+
+        while (ino->i_ino != STAMFS_ROOT_INODE_NUM) {
+                unsigned long parent_ino = STAMFS_INODE_META(ino)->i_parent_ino;
+
+                /* an unlinked inode, or a corrupt parent chain. */
+                if (parent_ino == 0 ||
+                    depth++ >= STAMFS_MAX_INODE_NUM) {
+                        err = -ENOENT;
+                        goto ret;
+                }
+
+                dir = iget(sb, parent_ino);
+                if (!dir) {
+                        err = -ENOMEM;
+                        goto ret;
+                }
+                if (is_bad_inode(dir) || !S_ISDIR(dir->i_mode)) {
+                        err = -EIO;
+                        goto ret;
+                }
+                err = stamfs_dir_get_name_by_ino(dir, ino->i_ino,
+                                                 name, &namelen);
+                if (err)
+                        goto ret;
+
+                /* prepend "/<name>". */
+                if (namelen + 1 > pos) {
+                        err = -ENAMETOOLONG;
+                        goto ret;
+                }
+                pos -= namelen;
+                memcpy(buf + pos, name, namelen);
+                buf[--pos] = '/';
+
+                iput(ino);
+                ino = dir;
+                dir = NULL;
+        }
+
+        /* the root's path. */
+        if (buf[pos] == '\0')
+                buf[--pos] = '/';
+        err = pos;
+
+  ret:
+        if (dir)
+                iput(dir);
+        if (ino)
+                iput(ino);
+        return err;
+}
+
+/*
+ * STAMFS_IOC_GET_PATH - copy the path of the requested inode to user-space.
+ * as it reveals names in directories the caller might not be able to
+ * search, this is a privileged operation.
+ */
+static int stamfs_ioctl_get_path(struct inode *ino, unsigned long arg)
+{
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_path *user_sp = (struct stamfs_path *)arg;
+        __u32 ino_num;
+        char *buf = NULL;
+        int pos;
+        int err = 0;
+
+        if (!(STAMFS_META(sb)->s_feature_ro_compat &
+              STAMFS_FEATURE_RO_COMPAT_PARENT))
+                return -EOPNOTSUPP;
+        if (!capable(CAP_DAC_READ_SEARCH))
+                return -EPERM;
+        if (get_user(ino_num, &user_sp->sp_ino))
+                return -EFAULT;
+
+        buf = kmalloc(STAMFS_PATH_MAX, GFP_KERNEL);
+        if (!buf)
+                return -ENOMEM;
+
+        pos = stamfs_build_path(sb, ino_num, buf, STAMFS_PATH_MAX);
+        if (pos < 0) {
+                err = pos;
+                goto ret;
+        }
+        if (copy_to_user(user_sp->sp_path, buf + pos, STAMFS_PATH_MAX - pos))
+                err = -EFAULT;
+
+  ret:
+        kfree(buf);
+        return err;
+}
+
+/*
+ * STAMFS_IOC_READ_CHANGES - copy a batch of change log records, starting at
+ * the requested sequence number, to user-space. the log only holds inode
+ * numbers, but it reveals activity in every directory - so this is a
+ * privileged operation, like STAMFS_IOC_GET_PATH.
+ */
+static int stamfs_ioctl_read_changes(struct inode *ino, unsigned long arg)
+{
+        struct stamfs_changes *user_changes = (struct stamfs_changes *)arg;
+        struct stamfs_changes *changes = NULL;
+        int err = 0;
+
+        if (!capable(CAP_DAC_READ_SEARCH))
+                return -EPERM;
+
+        changes = kmalloc(sizeof(*changes), GFP_KERNEL);
+        if (!changes)
+                return -ENOMEM;
+        memset(changes, 0, sizeof(*changes));
+
+        if (copy_from_user(&changes->sc_seq, &user_changes->sc_seq,
+                           sizeof(changes->sc_seq))) {
+                err = -EFAULT;
+                goto ret;
+        }
+
+        err = stamfs_changelog_read(ino->i_sb, changes);
+        if (err)
+                goto ret;
+
+        if (copy_to_user(user_changes, changes, sizeof(*changes)))
+                err = -EFAULT;
+
+  ret:
+        kfree(changes);
+        return err;
+}
+
+/*
+ * STAMFS_IOC_SEAL/STAMFS_IOC_UNSEAL - make the given regular file immutable
+ * and move its blocks into a single run, or make it mutable again. like
+ * setting the immutable flag on other file-systems, this is privileged.
+ * if the blocks can't be moved, a file that was not sealed stays that way.
+ */
+static int stamfs_ioctl_seal(struct inode *ino, int seal)
+{
+        int was_sealed;
+        int err = 0;
+
+        if (!S_ISREG(ino->i_mode))
+                return -EINVAL;
+        /* the sealed flag has nowhere to go on disk. */
+        if (!stamfs_inode_flags_enabled(ino->i_sb))
+                return -EOPNOTSUPP;
+        if (IS_RDONLY(ino))
+                return -EROFS;
+        if (!capable(CAP_LINUX_IMMUTABLE))
+                return -EPERM;
+
+        down(&ino->i_sem);
+
+        was_sealed = IS_IMMUTABLE(ino);
+        if (seal) {
+                ino->i_flags |= S_IMMUTABLE;
+                err = stamfs_inode_relayout(ino);
+                if (err && !was_sealed)
+                        ino->i_flags &= ~S_IMMUTABLE;
+        }
+        else
+                ino->i_flags &= ~S_IMMUTABLE;
+
+        if (!err && IS_IMMUTABLE(ino) != was_sealed) {
+                ino->i_ctime = CURRENT_TIME;
+                mark_inode_dirty(ino);
+        }
+
+        up(&ino->i_sem);
+
+        return err;
+}
+
+/*
+ * STAMFS_IOC_SORT_DIR/STAMFS_IOC_UNSORT_DIR - sort the entries of the given
+ * directory by name, or stop treating it as sorted. its contents don't
+ * change, but it's written to, so this takes write permission. the first
+ * sorted directory also turns on a file-system feature, which older
+ * kernels only mount read-only - that is left to the administrator.
+ */
+static int stamfs_ioctl_sort_dir(struct inode *ino, int sort)
+{
+        int err = 0;
+
+        if (!S_ISDIR(ino->i_mode))
+                return -ENOTDIR;
+        if (IS_RDONLY(ino))
+                return -EROFS;
+        err = permission(ino, MAY_WRITE);
+        if (err)
+                return err;
+        if (sort && !(STAMFS_META(ino->i_sb)->s_feature_ro_compat &
+                      STAMFS_FEATURE_RO_COMPAT_SORTED_DIR) &&
+            !capable(CAP_SYS_ADMIN))
+                return -EPERM;
+
+        down(&ino->i_sem);
+        if (sort)
+                err = stamfs_dir_sort(ino);
+        else
+                stamfs_dir_unsort(ino);
+        up(&ino->i_sem);
+
+        return err;
+}
+
+/*
+ * STAMFS_IOC_COMPACT_DIR - compact the given directory. its contents don't
+ * change, but it's written to, so this takes write permission.
+ */
+static int stamfs_ioctl_compact_dir(struct inode *ino)
+{
+        int err = 0;
+
+        if (!S_ISDIR(ino->i_mode))
+                return -ENOTDIR;
+        if (IS_RDONLY(ino))
+                return -EROFS;
+        err = permission(ino, MAY_WRITE);
+        if (err)
+                return err;
+
+        down(&ino->i_sem);
+        err = stamfs_dir_compact(ino);
+        up(&ino->i_sem);
+
+        return err;
+}
+
+/*
+ * STAMFS_IOC_GET_DIR_ENTRIES - copy the number of entries of the given
+ * directory to user-space.
+ */
+static int stamfs_ioctl_get_dir_entries(struct inode *ino, unsigned long arg)
+{
+        unsigned long count = 0;
+        int err;
+
+        if (!S_ISDIR(ino->i_mode))
+                return -ENOTDIR;
+
+        down(&ino->i_sem);
+        err = stamfs_dir_get_entries(ino, &count);
+        up(&ino->i_sem);
+        if (err)
+                return err;
+
+        return put_user((__u32)count, (__u32 *)arg);
+}
+
+/*
+ * STAMFS_IOC_READDIRPLUS - copy the next entries of the given directory,
+ * with the attributes of their inodes, to user-space. the entries are
+ * those getdents() would return, and the attributes those stat() would,
+ * so this takes search permission, on top of the read permission the
+ * directory was opened with. the entries are collected a page at a time,
+ * each page copied to user-space before the next is filled.
+ */
+static int stamfs_ioctl_readdirplus(struct inode *ino, struct file *filp,
+                                    unsigned long arg)
+{
+        struct stamfs_readdirplus *user_rp = (struct stamfs_readdirplus *)arg;
+        struct stamfs_readdirplus rp;
+        char *buf = NULL;
+        unsigned int buf_len;
+        unsigned int done = 0;
+        unsigned int len;
+        int total = 0;
+        int count;
+        int err = 0;
+
+        if (!S_ISDIR(ino->i_mode))
+                return -ENOTDIR;
+        err = permission(ino, MAY_EXEC);
+        if (err)
+                return err;
+        if (copy_from_user(&rp, user_rp, sizeof(rp)))
+                return -EFAULT;
+
+        buf_len = rp.rp_buf_len;
+        if (buf_len == 0)
+                return -EINVAL;
+        if (buf_len > STAMFS_READDIRPLUS_MAX_LEN)
+                buf_len = STAMFS_READDIRPLUS_MAX_LEN;
+        buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if (!buf)
+                return -ENOMEM;
+
+        /* a page holds an entry of any name length, so only the end of the
+         * user's buffer may be too short for the next entry. */
+        while (done < buf_len) {
+                len = buf_len - done;
+                if (len > PAGE_SIZE)
+                        len = PAGE_SIZE;
+                down(&ino->i_sem);
+                count = stamfs_readdirplus(filp, buf, &len);
+                up(&ino->i_sem);
+                if (count == -EINVAL && total > 0)
+                        break;
+                if (count < 0) {
+                        err = count;
+                        goto ret;
+                }
+                if (count == 0)
+                        break;
+
+                if (copy_to_user((void *)(unsigned long)(rp.rp_buf + done),
+                                 buf, len)) {
+                        err = -EFAULT;
+                        goto ret;
+                }
+                done += len;
+                total += count;
+        }
+
+        if (put_user((__u32)total, &user_rp->rp_count))
+                err = -EFAULT;
+
+  ret:
+        kfree(buf);
+        return err;
+}
+
+/*
+ * STAMFS_IOC_GET_CACHE_STATS - copy the statistics of the mount's cache of
+ * decoded meta-data to user-space.
+ */
+static int stamfs_ioctl_get_cache_stats(struct inode *ino, unsigned long arg)
+{
+        struct stamfs_cache_stats stats;
+
+        stamfs_cache_get_stats(ino->i_sb, &stats);
+        if (copy_to_user((void *)arg, &stats, sizeof(stats)))
+                return -EFAULT;
+
+        return 0;
+}
+
+/*
+ * Handling of the STAMFS-specific ioctls (see stamfs.h), for both files and
+ * directories.
+ * @return a non-negative value on success, a negative error code on failure.
+ */
+int stamfs_ioctl(struct inode *ino, struct file *filp, unsigned int cmd,
+                 unsigned long arg)
+{
+        STAMFS_DBG(DEB_STAM, "stamfs: ioctl 0x%x on inode %lu\n",
+                             cmd, ino->i_ino);
+
+        switch (cmd) {
+        case STAMFS_IOC_GET_USAGE:
+                return stamfs_ioctl_get_usage(ino, arg);
+        case STAMFS_IOC_GET_PATH:
+                return stamfs_ioctl_get_path(ino, arg);
+        case STAMFS_IOC_READ_CHANGES:
+                return stamfs_ioctl_read_changes(ino, arg);
+        case STAMFS_IOC_GET_CACHE_STATS:
+                return stamfs_ioctl_get_cache_stats(ino, arg);
+        case STAMFS_IOC_DROP_CACHE:
+                if (!capable(CAP_SYS_ADMIN))
+                        return -EPERM;
+                stamfs_cache_shrink(ino->i_sb, ~0UL);
+                return 0;
+        case STAMFS_IOC_SEAL:
+                return stamfs_ioctl_seal(ino, 1);
+        case STAMFS_IOC_UNSEAL:
+                return stamfs_ioctl_seal(ino, 0);
+        case STAMFS_IOC_COMPACT_DIR:
+                return stamfs_ioctl_compact_dir(ino);
+        case STAMFS_IOC_GET_DIR_ENTRIES:
+                return stamfs_ioctl_get_dir_entries(ino, arg);
+        case STAMFS_IOC_READDIRPLUS:
+                return stamfs_ioctl_readdirplus(ino, filp, arg);
+        case STAMFS_IOC_SORT_DIR:
+                return stamfs_ioctl_sort_dir(ino, 1);
+        case STAMFS_IOC_UNSORT_DIR:
+                return stamfs_ioctl_sort_dir(ino, 0);
+        default:
+                return -ENOTTY;
+        }
+}
@@ -0,0 +1,15 @@
+
+#ifndef STAMFS_IOCTL_H
+#define STAMFS_IOCTL_H
+
+#include <linux/fs.h>
+
+/*
+ * Handling of the STAMFS-specific ioctls (see stamfs.h), for both files and
+ * directories.
+ * @return a non-negative value on success, a negative error code on failure.
+ */
+int stamfs_ioctl(struct inode *ino, struct file *filp, unsigned int cmd,
+                 unsigned long arg);
+
+#endif /* STAMFS_IOCTL_H */
@@ -7,9 +7,11 @@
 #include "stamfs_super.h"
 #include "stamfs_inode.h"
 #include "stamfs_dir.h"
+#include "stamfs_dirent.h"
 #include "stamfs_iops.h"
 #include "stamfs_fops.h"
 #include "stamfs_aops.h"
+#include "stamfs_changelog.h"
 #include "stamfs_util.h"
 
 /*
@@ -38,25 +40,23 @@ struct inode_operations stamfs_file_iops = {
  */
 
 /*
- * initialize the block index of the given inode.
+ * initialize the block index of the given inode, in a freshly allocated block.
  * returns a negative error code, in case of an error, 0 on success.
  */
-int stamfs_inode_init_block_index(struct inode *inode, int bi_block_num)
+int stamfs_inode_init_block_index(struct inode *inode,
+                                  unsigned long bi_block_num)
 {
         int err = 0;
         struct super_block *sb = inode->i_sb;
         struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
 
-        /* read the inode's block index. */
-        if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
+        /* a zeroed block index maps no blocks - no need to read it. */
+        if (!(bibh = stamfs_getblk_zeroed(sb, bi_block_num))) {
+                printk("stamfs: unable to get inode block index, block %lu.\n",
                        bi_block_num);
                 err = -EIO;
                 goto ret;
         }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
-        memset(stamfs_bi->index, 0, sizeof(*stamfs_bi));
         mark_buffer_dirty_inode(bibh, inode);
 
   ret:
@@ -72,27 +72,16 @@ struct inode *stamfs_inode_new_inode(struct super_block *sb, int mode)
 {
         struct inode *child_ino = NULL;
         ino_t ino_num = 0;
-        int inode_block_num = 0;
-        int bi_block_num = 0;
+        unsigned long inode_block_num = 0;
+        unsigned long bi_block_num = 0;
         int err = 0;
         struct stamfs_inode_meta_data *stamfs_inode_meta = NULL;
+        struct stamfs_inode *stamfs_ino = NULL;
 
-        /* allocate a disk block to contain this inode's data. */
-        inode_block_num = stamfs_alloc_block(sb);
-        if (inode_block_num == 0) {
-                err = -ENOSPC;
-                goto ret_err;
-        }
-
-        /* allocate a disk block to contain the block index of this inode. */
-        bi_block_num = stamfs_alloc_block(sb);
-        if (bi_block_num == 0) {
-                err = -ENOSPC;
-                goto ret_err;
-        }
-
-        /* allocate a free inode number. */
-        ino_num = stamfs_alloc_inode_num(sb, inode_block_num);
+        /* allocate an inode number, a disk block to contain this inode's
+         * data, and a disk block to contain its block index - in one go. */
+        ino_num = stamfs_alloc_inode_cluster(sb, &inode_block_num,
+                                             &bi_block_num);
         if (ino_num == 0) {
                 err = -ENOSPC;
                 goto ret_err;
@@ -127,19 +116,31 @@ struct inode *stamfs_inode_new_inode(struct super_block *sb, int mode)
         child_ino->i_gid = current->fsgid;
         child_ino->i_atime = child_ino->i_mtime = child_ino->i_ctime = CURRENT_TIME;
         child_ino->i_attr_flags = 0;
+        child_ino->i_flags |= S_NOATIME;
 
         /* init the inode's STAMFS meta data. */
-        stamfs_inode_meta = kmalloc(sizeof(struct stamfs_inode_meta_data),
-                                    GFP_KERNEL);
+        stamfs_inode_meta = stamfs_inode_alloc_meta(inode_block_num,
+                                                    bi_block_num);
         if (!stamfs_inode_meta) {
                 printk("stamfs: not enough memory to allocate inode meta data.\n");
+                err = -ENOMEM;
                 goto ret_err;
         }
-        stamfs_inode_meta->i_block_num = inode_block_num;
-        stamfs_inode_meta->i_bi_block_num = bi_block_num;
 
         child_ino->u.generic_ip = stamfs_inode_meta;
 
+        /* hold the inode's (new) block for as long as the inode is in core.
+         * the block index number never changes, so it is stored only here. */
+        stamfs_inode_meta->i_bh = stamfs_getblk_zeroed(sb, inode_block_num);
+        if (!stamfs_inode_meta->i_bh) {
+                printk("stamfs: unable to get inode block %lu.\n",
+                       inode_block_num);
+                err = -EIO;
+                goto ret_err;
+        }
+        stamfs_ino = (struct stamfs_inode *)((char *)(stamfs_inode_meta->i_bh->b_data));
+        stamfs_ino->i_index_block = cpu_to_le32(bi_block_num);
+
         /* set the inode operations structs. */
         if (S_ISREG(child_ino->i_mode)) {
                 child_ino->i_op = &stamfs_file_iops;
@@ -175,51 +176,38 @@ struct inode *stamfs_inode_new_inode(struct super_block *sb, int mode)
 
 /*
  * Given an inode and a block offset, sets p_block_number to the block number
- * containing this block offset, or -1 if there is no block mapped at the
+ * containing this block offset, or 0 if there is no block mapped at the
  * given offset.
  * returns 0 on success or a negative error code on failure.
  */
 int stamfs_inode_block_offset_to_number(struct inode *ino, int block_offset,
-                                        int *p_block_num)
+                                        unsigned long *p_block_num)
 {
         int err = 0;
-        struct super_block *sb = ino->i_sb;
-        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
-        int bi_block_num = inode_meta->i_bi_block_num;
-        struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
-        unsigned int block_num;
+        unsigned long block_num;
 
         STAMFS_DBG(DEB_STAM, "stamfs: for inode %lu, "
                              "getting block number for block offset %d\n",
                              ino->i_ino, block_offset);
 
-        /* read the inode's block index. */
-        if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
-                       bi_block_num);
-                err = -EIO;
+        /* consult the in-memory copy of the inode's block index. */
+        err = stamfs_inode_bmap_lookup(ino, block_offset, &block_num);
+        if (err)
                 goto ret;
-        }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
 
-        block_num = le32_to_cpu(stamfs_bi->index[block_offset]);
-        if (block_num != STAMFS_FREE_BLOCK_MARKER && block_num != 0) {
-                STAMFS_DBG(DEB_STAM, "stamfs: block number %u\n", block_num);
-                *p_block_num = block_num;
+        if (block_num != 0) {
+                STAMFS_DBG(DEB_STAM, "stamfs: block number %lu\n", block_num);
         }
         else {
                 STAMFS_DBG(DEB_STAM, "stamfs: block not mapped\n");
-                *p_block_num = -1;
         }
+        *p_block_num = block_num;
 
         /* all went well... */
         err = 0;
         goto ret;
 
   ret:
-        if (bibh)
-                brelse(bibh);
         return err;
 }
 
@@ -228,31 +216,31 @@ int stamfs_inode_block_offset_to_number(struct inode *ino, int block_offset,
  * returns 0 on success or a negative error code on failure.
  */
 int stamfs_inode_map_block_offset_to_number(struct inode *ino,
-                                            int block_offset, int block_num)
+                                            int block_offset,
+                                            unsigned long block_num)
 {
         int err = 0;
         struct super_block *sb = ino->i_sb;
         struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
-        int bi_block_num = inode_meta->i_bi_block_num;
+        unsigned long bi_block_num = inode_meta->i_bi_block_num;
         struct buffer_head *bibh = NULL;
-        struct stamfs_inode_block_index *stamfs_bi = NULL;
 
         STAMFS_DBG(DEB_STAM, "stamfs: for inode %lu, "
-                             "mapping block offset %d to block number %d\n",
+                             "mapping block offset %d to block number %lu\n",
                              ino->i_ino, block_offset, block_num);
 
         /* read the inode's block index. */
         if (!(bibh = bread(sb->s_dev, bi_block_num, STAMFS_BLOCK_SIZE))) {
-                printk("stamfs: unable to read inode block index, block %d.\n",
+                printk("stamfs: unable to read inode block index, block %lu.\n",
                        bi_block_num);
                 err = -EIO;
                 goto ret;
         }
-        stamfs_bi = (struct stamfs_inode_block_index *)((char *)(bibh->b_data));
 
-        /* store the new mapping. */
-        stamfs_bi->index[block_offset] = cpu_to_le32(block_num);
+        /* store the new mapping, both on disk and in the inode's block map. */
+        stamfs_set_block_ptr(bibh->b_data, block_offset, block_num);
         mark_buffer_dirty_inode(bibh, ino);
+        stamfs_inode_bmap_update(ino, block_offset, block_num);
 
         /* the inode was changed as well - but not the size (which is a logical
          * value, thus not related to which of the blocks are actually
@@ -281,6 +269,7 @@ static int stamfs_add_file(struct inode *dir, struct inode *child,
                                       child_dentry->d_name.name,
                                       child_dentry->d_name.len);
         if (!err) {
+                stamfs_changelog_record(child, STAMFS_CHANGE_CREATE);
                 d_instantiate(child_dentry, child);
                 return 0;
         }
@@ -336,7 +325,7 @@ struct dentry *stamfs_iop_lookup(struct inode *dir, struct dentry *dentry)
                              dentry->d_name.name);
 
         /* sanity checks. */
-        if (dentry->d_name.len > STAMFS_MAX_FNAME_LEN) {
+        if (dentry->d_name.len > stamfs_dirent_max_name_len(dir->i_sb)) {
                 STAMFS_DBG(DEB_STAM, "stamfs: name too long.\n");
                 return ERR_PTR(-ENAMETOOLONG);
         }
@@ -385,6 +374,7 @@ int stamfs_iop_unlink(struct inode *dir, struct dentry *dentry)
         child->i_ctime = dir->i_ctime;
         child->i_nlink--;
         mark_inode_dirty(child);
+        stamfs_changelog_record(child, STAMFS_CHANGE_UNLINK);
         
         STAMFS_DBG(DEB_STAM, "stamfs: parent_i_nlink=%d, child_i_nlink=%d\n",
                              dir->i_nlink, child->i_nlink);
@@ -439,6 +429,7 @@ int stamfs_iop_mkdir(struct inode *parent_dir, struct dentry *dentry, int mode)
                                   dentry->d_name.name, dentry->d_name.len);
         if (err)
                 goto ret_err;
+        stamfs_changelog_record(child_dir, STAMFS_CHANGE_CREATE);
 
         /* finally, instantiate the child's dentry. */
         d_instantiate(dentry, child_dir);
@@ -17,7 +17,7 @@ extern struct inode_operations stamfs_file_iops;
  * given an inode, maps the given block offset to the given block number.
  * returns 0 on success or a negative error code on failure.
  */
-int stamfs_inode_map_block_offset_to_number(struct inode *ino, int block_offset, int block_num);
+int stamfs_inode_map_block_offset_to_number(struct inode *ino, int block_offset, unsigned long block_num);
 
 /*
  * given an inode and a block offset, sets p_block_number to the block number
@@ -25,7 +25,7 @@ int stamfs_inode_map_block_offset_to_number(struct inode *ino, int block_offset,
  * given offset.
  * returns 0 on success or a negative error code on failure.
  */
-int stamfs_inode_block_offset_to_number(struct inode *ino, int block_offset, int *p_block_num);
+int stamfs_inode_block_offset_to_number(struct inode *ino, int block_offset, unsigned long *p_block_num);
 
 /* the VFS inode-operation functions. */
 int stamfs_iop_create(struct inode *dir, struct dentry *dentry, int mode);
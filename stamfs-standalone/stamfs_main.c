@@ -13,6 +13,7 @@
 
 #include "stamfs_util.h"
 #include "stamfs_super.h"
+#include "stamfs_inode.h"
 
 #define VERSION_STRING "stamfs_0.1"
 
@@ -47,12 +48,23 @@ struct file_system_type stamfs_fstype = {
 
 static int init_fs(void)
 {
-        return register_filesystem(&stamfs_fstype);
+        int err;
+
+        err = stamfs_inode_init_cache();
+        if (err)
+                return err;
+
+        err = register_filesystem(&stamfs_fstype);
+        if (err)
+                stamfs_inode_destroy_cache();
+
+        return err;
 }
 
 static void cleanup_fs(void)
 {
         unregister_filesystem(&stamfs_fstype);
+        stamfs_inode_destroy_cache();
 }
 
 
@@ -81,14 +93,26 @@ static void init_debug(void)
 	res->write_proc = debug_write_proc; 
 	res->owner = THIS_MODULE; 
 
+	/* number of in-core inodes, as seen by stamfs. */
+	if (!(res = create_proc_read_entry("inodes", 0444, dir,
+					   stamfs_inode_read_proc, NULL))) {
+		printk("create_proc_read_entry 'inodes' failed\n"); 
+		goto out2; 
+	}
+
+	res->owner = THIS_MODULE; 
+
 	return; 
 	
+ out2: 
+	remove_proc_entry("debug", dir); 
  out1: 
 	remove_proc_entry(PROC_MODULE_NAME, NULL); 
 }
 
 static void cleanup_debug(void)
 {
+	remove_proc_entry("inodes", dir); 
 	remove_proc_entry("debug", dir); 
 	remove_proc_entry(PROC_MODULE_NAME, NULL); 
 }
@@ -0,0 +1,324 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_dir.h"
+#include "stamfs_dir_index.h"
+#include "stamfs_cache.h"
+#include "stamfs_names.h"
+#include "stamfs_dirent.h"
+
+/*
+ * With the 'name_cache' mount option, the first lookup in a directory reads
+ * all its entries into an in-memory hash table, mapping each name to its
+ * inode and to the position of its entry. from then on, lookups - of names
+ * that exist and of names that don't - are answered from the table, without
+ * reading the directory. the table is kept up to date when entries are
+ * added or removed, and dropped when entries are moved around on disk.
+ *
+ * the tables count as decoded meta-data of their directories, so they are
+ * evicted together with their block maps by the per-mount LRU cache (see
+ * stamfs_cache.c), and rebuilt on the next lookup. like the block maps,
+ * they are protected by the directory's i_bmap_lock. they are built and
+ * changed only under the directory's i_sem.
+ */
+
+/* the bounds of the number of buckets of a name table. */
+#define STAMFS_NAMES_MIN_BUCKETS        16
+#define STAMFS_NAMES_MAX_BUCKETS        4096
+
+struct stamfs_name_ent {
+        struct stamfs_name_ent *ne_next;
+        __u32 ne_hash;
+        unsigned long ne_ino_num;
+        int ne_block_offset;    /* the position of the entry on disk. */
+        int ne_offset;
+        int ne_namelen;
+        char ne_name[0];
+};
+
+struct stamfs_name_table {
+        unsigned long nt_count;
+        unsigned int nt_mask;   /* the number of buckets, minus 1. */
+        struct stamfs_name_ent *nt_buckets[0];
+};
+
+/*
+ * Allocate a table entry for the given name.
+ * returns the entry, or NULL if out of memory.
+ */
+static struct stamfs_name_ent *stamfs_names_alloc_ent(const char *name,
+                                                      int namelen,
+                                                      unsigned long ino_num,
+                                                      int block_offset,
+                                                      int offset)
+{
+        struct stamfs_name_ent *ent;
+
+        ent = kmalloc(sizeof(*ent) + namelen, GFP_NOFS);
+        if (!ent)
+                return NULL;
+
+        ent->ne_next = NULL;
+        ent->ne_hash = stamfs_dir_hash(name, namelen);
+        ent->ne_ino_num = ino_num;
+        ent->ne_block_offset = block_offset;
+        ent->ne_offset = offset;
+        ent->ne_namelen = namelen;
+        memcpy(ent->ne_name, name, namelen);
+
+        return ent;
+}
+
+/* add the given entry to the given table. */
+static void stamfs_names_insert(struct stamfs_name_table *table,
+                                struct stamfs_name_ent *ent)
+{
+        struct stamfs_name_ent **bucket;
+
+        bucket = &table->nt_buckets[ent->ne_hash & table->nt_mask];
+        ent->ne_next = *bucket;
+        *bucket = ent;
+        table->nt_count++;
+}
+
+/*
+ * Find the entry of the given name in the given table.
+ * returns a pointer to the link pointing at the entry, or NULL if the name
+ * is not in the table.
+ */
+static struct stamfs_name_ent **stamfs_names_find(struct stamfs_name_table *table,
+                                                  const char *name,
+                                                  int namelen)
+{
+        __u32 hash = stamfs_dir_hash(name, namelen);
+        struct stamfs_name_ent **link;
+
+        link = &table->nt_buckets[hash & table->nt_mask];
+        for ( ; *link; link = &(*link)->ne_next) {
+                if ((*link)->ne_hash == hash &&
+                    (*link)->ne_namelen == namelen &&
+                    memcmp((*link)->ne_name, name, namelen) == 0)
+                        return link;
+        }
+
+        return NULL;
+}
+
+/*
+ * Free the given name table, which is no longer attached to its directory.
+ */
+void stamfs_names_free(struct stamfs_name_table *table)
+{
+        struct stamfs_name_ent *ent;
+        unsigned int i;
+
+        for (i = 0; i <= table->nt_mask; i++) {
+                while ((ent = table->nt_buckets[i]) != NULL) {
+                        table->nt_buckets[i] = ent->ne_next;
+                        kfree(ent);
+                }
+        }
+        kfree(table);
+}
+
+/*
+ * Look the given name up in the name table of the given directory. on a
+ * hit, *p_ino_num gets the name's inode, and *p_block_offset and
+ * *p_offset get the position of its entry (if they are not NULL). on a miss,
+ * *p_ino_num gets 0.
+ * @return 1 if the directory has a name table (so a miss means there is no
+ *         such name), 0 if it has none.
+ */
+int stamfs_names_lookup(struct inode *dir, const char *name, int namelen,
+                        ino_t *p_ino_num, int *p_block_offset, int *p_offset)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_name_ent **link;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (!inode_meta->i_names) {
+                spin_unlock(&inode_meta->i_bmap_lock);
+                return 0;
+        }
+
+        *p_ino_num = 0;
+        link = stamfs_names_find(inode_meta->i_names, name, namelen);
+        if (link) {
+                *p_ino_num = (*link)->ne_ino_num;
+                if (p_block_offset)
+                        *p_block_offset = (*link)->ne_block_offset;
+                if (p_offset)
+                        *p_offset = (*link)->ne_offset;
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+        stamfs_cache_hit(dir);
+
+        return 1;
+}
+
+/*
+ * Build the name table of the given directory, from its entries on disk.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_names_build(struct inode *dir)
+{
+        int err = 0;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        int num_blocks = stamfs_dir_num_blocks(dir);
+        struct stamfs_name_table *table = NULL;
+        struct stamfs_name_ent *ent = NULL;
+        struct buffer_head *bh = NULL;
+        struct stamfs_dirent de;
+        unsigned int num_buckets = STAMFS_NAMES_MIN_BUCKETS;
+        unsigned int offset;
+        int i;
+
+        /* about one bucket per entry the directory can hold right now. */
+        while (num_buckets < STAMFS_NAMES_MAX_BUCKETS &&
+               num_buckets < num_blocks * STAMFS_DIR_RECS_PER_BLOCK)
+                num_buckets <<= 1;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: building name table of dir %lu, "
+                             "%u buckets\n", dir->i_ino, num_buckets);
+
+        table = kmalloc(sizeof(*table) +
+                        num_buckets * sizeof(struct stamfs_name_ent *),
+                        GFP_NOFS);
+        if (!table)
+                return -ENOMEM;
+        table->nt_count = 0;
+        table->nt_mask = num_buckets - 1;
+        memset(table->nt_buckets, 0,
+               num_buckets * sizeof(struct stamfs_name_ent *));
+
+        for (i = stamfs_dx_first_block(dir); i < num_blocks; i++) {
+                if (!(bh = stamfs_dir_bread(dir, i))) {
+                        err = -EIO;
+                        goto ret_err;
+                }
+
+                offset = 0;
+                while (stamfs_dirent_next(dir->i_sb, bh->b_data, &offset, &de)) {
+                        ent = stamfs_names_alloc_ent(de.de_name, de.de_name_len,
+                                                     de.de_ino, i,
+                                                     de.de_offset);
+                        if (!ent) {
+                                err = -ENOMEM;
+                                goto ret_err;
+                        }
+                        stamfs_names_insert(table, ent);
+                }
+
+                brelse(bh);
+                bh = NULL;
+        }
+
+        /* the directory can't change meanwhile - we hold its i_sem. */
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (!inode_meta->i_names) {
+                inode_meta->i_names = table;
+                table = NULL;
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+        stamfs_cache_insert(dir);
+
+  ret_err:
+        if (bh)
+                brelse(bh);
+        if (table)
+                stamfs_names_free(table);
+        return err;
+}
+
+/*
+ * An entry was added to the given directory - add it to its name table,
+ * if the directory has one.
+ */
+void stamfs_names_add(struct inode *dir, const char *name, int namelen,
+                      unsigned long ino_num, int block_offset, int offset)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_name_ent *ent;
+        int grown = 0;
+
+        if (!inode_meta->i_names)
+                return;
+
+        /* without memory for the entry, the table can't be complete. */
+        ent = stamfs_names_alloc_ent(name, namelen, ino_num,
+                                     block_offset, offset);
+        if (!ent) {
+                stamfs_names_invalidate(dir);
+                return;
+        }
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_names) {
+                stamfs_names_insert(inode_meta->i_names, ent);
+                ent = NULL;
+                /* a table that outgrew its buckets is rebuilt bigger. */
+                grown = (inode_meta->i_names->nt_count >
+                         4 * (inode_meta->i_names->nt_mask + 1) &&
+                         inode_meta->i_names->nt_mask + 1 <
+                         STAMFS_NAMES_MAX_BUCKETS);
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (ent)
+                kfree(ent);
+        if (grown)
+                stamfs_names_invalidate(dir);
+}
+
+/*
+ * An entry was removed from the given directory - remove it from its name
+ * table, if the directory has one.
+ */
+void stamfs_names_del(struct inode *dir, const char *name, int namelen)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_name_ent **link;
+        struct stamfs_name_ent *ent = NULL;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        if (inode_meta->i_names) {
+                link = stamfs_names_find(inode_meta->i_names, name, namelen);
+                if (link) {
+                        ent = *link;
+                        *link = ent->ne_next;
+                        inode_meta->i_names->nt_count--;
+                }
+        }
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (ent)
+                kfree(ent);
+}
+
+/*
+ * Entries of the given directory were moved around on disk - drop its name
+ * table. it will be rebuilt on the next lookup.
+ */
+void stamfs_names_invalidate(struct inode *dir)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(dir);
+        struct stamfs_name_table *table;
+
+        spin_lock(&inode_meta->i_bmap_lock);
+        table = inode_meta->i_names;
+        inode_meta->i_names = NULL;
+        spin_unlock(&inode_meta->i_bmap_lock);
+
+        if (table)
+                stamfs_names_free(table);
+}
@@ -0,0 +1,64 @@
+
+#ifndef STAMFS_NAMES_H
+#define STAMFS_NAMES_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_super.h"
+
+/*
+ * Functions that maintain the in-memory name tables of directories (the
+ * 'name_cache' mount option).
+ */
+
+struct stamfs_name_table;
+
+/* are name tables kept on the given file-system? */
+static inline int stamfs_names_enabled(struct super_block *sb)
+{
+        return STAMFS_META(sb)->s_name_cache;
+}
+
+/*
+ * Look the given name up in the name table of the given directory. on a
+ * hit, *p_ino_num gets the name's inode, and *p_block_offset and
+ * *p_offset get the position of its entry (if they are not NULL). on a miss,
+ * *p_ino_num gets 0.
+ * @return 1 if the directory has a name table (so a miss means there is no
+ *         such name), 0 if it has none.
+ */
+int stamfs_names_lookup(struct inode *dir, const char *name, int namelen,
+                        ino_t *p_ino_num, int *p_block_offset, int *p_offset);
+
+/*
+ * Build the name table of the given directory, from its entries on disk.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_names_build(struct inode *dir);
+
+/*
+ * An entry was added to the given directory - add it to its name table,
+ * if the directory has one.
+ */
+void stamfs_names_add(struct inode *dir, const char *name, int namelen,
+                      unsigned long ino_num, int block_offset, int offset);
+
+/*
+ * An entry was removed from the given directory - remove it from its name
+ * table, if the directory has one.
+ */
+void stamfs_names_del(struct inode *dir, const char *name, int namelen);
+
+/*
+ * Entries of the given directory were moved around on disk - drop its name
+ * table. it will be rebuilt on the next lookup.
+ */
+void stamfs_names_invalidate(struct inode *dir);
+
+/*
+ * Free the given name table, which is no longer attached to its directory.
+ */
+void stamfs_names_free(struct stamfs_name_table *table);
+
+#endif /* STAMFS_NAMES_H */
@@ -18,9 +18,10 @@
 #include "stamfs_util.h"
 #include "stamfs_super.h"
 #include "stamfs_inode.h"
-
-
-#define STAMFS_META(sb) ((struct stamfs_meta_data *)((sb)->u.generic_sbp))
+#include "stamfs_changelog.h"
+#include "stamfs_cache.h"
+#include "stamfs_dirent.h"
+#include "stamfs_usage.h"
 
 /*
  * Forward declerations.
@@ -56,20 +57,6 @@ static struct super_operations stamfs_super_ops = {
 };
 
 
-/*
- * Internal data structures.
- */
-
-struct stamfs_meta_data {
-        struct buffer_head *s_sbh;
-        struct stamfs_super_block *s_stamfs_sb;
-        struct buffer_head *s_iibh;
-        struct stamfs_inode_index *s_stamfs_ii;
-        struct buffer_head *s_flbh;
-        struct stamfs_free_list_index *s_stamfs_fl;
-};
-
-
 /*
  * Utility functions.
  */
@@ -85,87 +72,251 @@ void stamfs_sync_bh(struct buffer_head *bh)
 }
 
 /*
- * Allocates a free block number.
+ * Get a buffer for a block that was just allocated, without reading its
+ * stale contents from the device. The buffer is returned zeroed and
+ * up-to-date - it is up to the caller to fill it and mark it dirty.
+ * returns NULL on failure.
+ */
+struct buffer_head *stamfs_getblk_zeroed(struct super_block *sb,
+                                         unsigned long block_num)
+{
+        struct buffer_head *bh = NULL;
+
+        bh = getblk(sb->s_dev, block_num, STAMFS_BLOCK_SIZE);
+        if (!bh)
+                return NULL;
+
+        lock_buffer(bh);
+        memset(bh->b_data, 0, STAMFS_BLOCK_SIZE);
+        mark_buffer_uptodate(bh, 1);
+        unlock_buffer(bh);
+
+        return bh;
+}
+
+/*
+ * Store the (decoded) block counters back in the super-block's buffer, and
+ * mark it dirty. the super-block must be locked by the caller.
+ */
+static void stamfs_put_block_counters(struct super_block *sb)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
+
+        stamfs_sb->s_blocks_count = cpu_to_le32(stamfs_meta->s_blocks_count);
+        stamfs_sb->s_free_blocks_count =
+                cpu_to_le32(stamfs_meta->s_free_blocks_count);
+        stamfs_sb->s_highest_used_block_num =
+                cpu_to_le32(stamfs_meta->s_highest_used_block_num);
+
+        mark_buffer_dirty(stamfs_meta->s_sbh);
+        sb->s_dirt = 1;
+}
+
+/*
+ * Take the block number in the given slot of the free list off the list.
+ * the super-block must be locked by the caller.
+ */
+static void stamfs_take_free_list_slot(struct super_block *sb, int i)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        void *stamfs_fl = stamfs_meta->s_stamfs_fl;
+
+        if (i+1 == STAMFS_MAX_BLOCK_NUMS_PER_BLOCK ||
+            stamfs_get_block_ptr(stamfs_fl, i+1) == 0) {
+                STAMFS_DBG(DEB_STAM,
+                           "stamfs: was last, shrinking free "
+                           "list to size %d\n",
+                           i);
+                stamfs_set_block_ptr(stamfs_fl, i, 0);
+        }
+        else
+                stamfs_set_block_ptr(stamfs_fl, i,
+                                     STAMFS_FREE_BLOCK_MARKER);
+        mark_buffer_dirty(stamfs_meta->s_flbh);
+}
+
+/*
+ * Allocates a free block number. the super-block must be locked by the
+ * caller.
  * returns 0 if no free numbers are available.
  */
-int stamfs_alloc_block(struct super_block *sb)
+static unsigned long stamfs_do_alloc_block(struct super_block *sb)
 {
         kdev_t dev = sb->s_dev;
         struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
-        struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
-        struct stamfs_free_list_index *stamfs_fl = stamfs_meta->s_stamfs_fl;
-        struct buffer_head *sbh = stamfs_meta->s_sbh;
-        struct buffer_head *flbh = stamfs_meta->s_flbh;
-        int block_num = 0;
+        void *stamfs_fl = stamfs_meta->s_stamfs_fl;
+        unsigned long block_num = 0;
+        __u32 entry;
         int i;
 
         STAMFS_DBG(DEB_INIT, "stamfs: allocating block, dev='%d:%d'\n",
                              major(dev), minor(dev));
 
-        lock_super(sb);
-
-        if (stamfs_sb->s_free_blocks_count == 0) {
+        if (stamfs_meta->s_free_blocks_count == 0) {
                 STAMFS_DBG(DEB_STAM, "stamfs: no more free blocks.\n");
                 goto ret;
         }
 
         /* first, scan the list of free blocks. */
-        if (stamfs_fl->index[0] != 0) {
+        if (stamfs_get_block_ptr(stamfs_fl, 0) != 0) {
                 STAMFS_DBG(DEB_STAM, "stamfs: scanning the free list...\n");
-                for (i=0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK; ++i)
-                        if (stamfs_fl->index[i] == 0 || stamfs_fl->index[i] != STAMFS_FREE_BLOCK_MARKER)
+                for (i=0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK; ++i) {
+                        entry = stamfs_get_block_ptr(stamfs_fl, i);
+                        if (entry == 0 || entry != STAMFS_FREE_BLOCK_MARKER)
                                 break;
+                }
                 /* so, did we find a free block? */
-                if (stamfs_fl->index[i] != 0 && stamfs_fl->index[i] != STAMFS_FREE_BLOCK_MARKER) {
+                if (i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK && entry != 0 && entry != STAMFS_FREE_BLOCK_MARKER) {
                         STAMFS_DBG(DEB_STAM,
                                    "stamfs: allocating from the free list, "
                                    "pos=%d\n",
                                    i);
-                        block_num = stamfs_fl->index[i];
-                        if (i+1 == STAMFS_MAX_BLOCK_NUMS_PER_BLOCK || stamfs_fl->index[i+1] == 0) {
-                                STAMFS_DBG(DEB_STAM,
-                                           "stamfs: was last, shrinking free "
-                                           "list to size %d\n",
-                                           i);
-                                stamfs_fl->index[i] = 0;
-                        }
-                        else
-                                stamfs_fl->index[i] = STAMFS_FREE_BLOCK_MARKER;
-                        mark_buffer_dirty(flbh);
+                        block_num = entry;
+                        stamfs_take_free_list_slot(sb, i);
                 }
         }
         /* there was none on the free list - allocate past the highest used. */
-        if (block_num == 0) {
-                block_num = ++stamfs_sb->s_highest_used_block_num;
-                /* no need to mark sbh as dirty - we do that below anyway. */
+        if (block_num == 0)
+                block_num = ++stamfs_meta->s_highest_used_block_num;
+
+        stamfs_meta->s_free_blocks_count--;
+        stamfs_put_block_counters(sb);
+
+        STAMFS_DBG(DEB_STAM, "stamfs: allocated block number %lu\n", block_num);
+
+  ret:
+        return block_num;
+}
+
+/*
+ * Allocates a free block number.
+ * returns 0 if no free numbers are available.
+ */
+unsigned long stamfs_alloc_block(struct super_block *sb)
+{
+        unsigned long block_num;
+
+        lock_super(sb);
+        block_num = stamfs_do_alloc_block(sb);
+        unlock_super(sb);
+
+        return block_num;
+}
+
+/*
+ * Allocates the given block number if it is free, or any free block number
+ * otherwise.
+ * returns 0 if no free numbers are available.
+ */
+unsigned long stamfs_alloc_block_near(struct super_block *sb,
+                                      unsigned long goal)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        void *stamfs_fl = stamfs_meta->s_stamfs_fl;
+        unsigned long block_num = 0;
+        __u32 entry;
+        int i;
+
+        lock_super(sb);
+
+        if (stamfs_meta->s_free_blocks_count == 0)
+                goto ret;
+
+        /* the goal is the next block past the highest used one. */
+        if (goal == stamfs_meta->s_highest_used_block_num + 1 &&
+            goal < stamfs_meta->s_blocks_count) {
+                block_num = ++stamfs_meta->s_highest_used_block_num;
+                stamfs_meta->s_free_blocks_count--;
+                stamfs_put_block_counters(sb);
+                goto ret;
         }
 
-        stamfs_sb->s_free_blocks_count--;
-        mark_buffer_dirty(sbh);
-        sb->s_dirt = 1;
+        /* the goal is on the free list. */
+        for (i = 0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK; i++) {
+                entry = stamfs_get_block_ptr(stamfs_fl, i);
+                if (entry == 0)
+                        break;
+                if (entry == goal) {
+                        stamfs_take_free_list_slot(sb, i);
+                        block_num = goal;
+                        stamfs_meta->s_free_blocks_count--;
+                        stamfs_put_block_counters(sb);
+                        goto ret;
+                }
+        }
 
-        STAMFS_DBG(DEB_STAM, "stamfs: allocated block number %d\n", block_num);
+        block_num = stamfs_do_alloc_block(sb);
 
   ret:
         unlock_super(sb);
+
+        STAMFS_DBG(DEB_STAM, "stamfs: allocated block %lu, goal was %lu\n",
+                             block_num, goal);
+
         return block_num;
 }
 
+/*
+ * Allocates 'count' adjacent blocks past the highest used block, storing
+ * their numbers in 'block_nums'. the super-block must be locked by the
+ * caller.
+ * returns 1 on success, 0 if there is not enough room for such a run (in
+ * which case nothing was allocated).
+ */
+static int stamfs_do_alloc_block_run(struct super_block *sb, int count,
+                                     unsigned long *block_nums)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        int i;
+
+        if (stamfs_meta->s_free_blocks_count < count ||
+            stamfs_meta->s_highest_used_block_num + count >= stamfs_meta->s_blocks_count)
+                return 0;
+
+        for (i = 0; i < count; i++)
+                block_nums[i] = ++stamfs_meta->s_highest_used_block_num;
+        stamfs_meta->s_free_blocks_count -= count;
+        stamfs_put_block_counters(sb);
+
+        STAMFS_DBG(DEB_STAM, "stamfs: allocated blocks %lu-%lu\n",
+                             block_nums[0], block_nums[count-1]);
+
+        return 1;
+}
+
+/*
+ * Allocates 'count' adjacent blocks past the highest used block, storing
+ * their numbers in 'block_nums'.
+ * returns 1 on success, 0 if there is not enough room for such a run (in
+ * which case nothing was allocated).
+ */
+int stamfs_alloc_block_run(struct super_block *sb, int count,
+                           unsigned long *block_nums)
+{
+        int ok;
+
+        lock_super(sb);
+        ok = stamfs_do_alloc_block_run(sb, count, block_nums);
+        unlock_super(sb);
+
+        return ok;
+}
+
 /*
  * Frees a previously allocated block number.
  * returns 0 on success, a negative error code on failure.
  */
-int stamfs_release_block(struct super_block *sb, int block_num)
+int stamfs_release_block(struct super_block *sb, unsigned long block_num)
 {
         kdev_t dev = sb->s_dev;
         struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
-        struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
-        struct stamfs_free_list_index *stamfs_fl = stamfs_meta->s_stamfs_fl;
-        struct buffer_head *sbh = stamfs_meta->s_sbh;
+        void *stamfs_fl = stamfs_meta->s_stamfs_fl;
         struct buffer_head *flbh = stamfs_meta->s_flbh;
+        __u32 entry = 0;
         int i;
 
-        STAMFS_DBG(DEB_INIT, "stamfs: freeing block %d, dev='%d:%d'\n",
+        STAMFS_DBG(DEB_INIT, "stamfs: freeing block %lu, dev='%d:%d'\n",
                              block_num, major(dev), minor(dev));
 
         /* sanity check - don't allow freeing any of the mandatory blocks. */
@@ -179,89 +330,167 @@ int stamfs_release_block(struct super_block *sb, int block_num)
         lock_super(sb);
 
         /* this is the highest used block number - no need to use the free list. */
-        if (block_num == stamfs_sb->s_highest_used_block_num) {
+        if (block_num == stamfs_meta->s_highest_used_block_num) {
                 STAMFS_DBG(DEB_STAM, "stamfs: freed highest used block.\n");
-                stamfs_sb->s_highest_used_block_num--;
-                /* no need to mark sbh as dirty - we do that below anyway. */
+                stamfs_meta->s_highest_used_block_num--;
         }
         else {
                 /* add it to the free list. */
 
                 /* scan the list of free blocks for an empty slot. */
-                for (i=0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK; ++i)
-                        if (stamfs_fl->index[i] == 0 || stamfs_fl->index[i] == STAMFS_FREE_BLOCK_MARKER)
+                for (i=0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK; ++i) {
+                        entry = stamfs_get_block_ptr(stamfs_fl, i);
+                        if (entry == 0 || entry == STAMFS_FREE_BLOCK_MARKER)
                                 break;
+                }
                 /* so, did we find a free slot? */
                 if (i >= STAMFS_MAX_BLOCK_NUMS_PER_BLOCK) {
                         printk("stamfs: free blocks list is full!");
                         BUG();
                 }
 
-                if (stamfs_fl->index[i] == 0) {
+                if (entry == 0) {
                         STAMFS_DBG(DEB_STAM,
                                    "stamfs: free list increased, "
                                    "new len - %d.\n",
                                    i+1);
                         if (i+1 < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK)
-                                stamfs_fl->index[i+1] = 0;
+                                stamfs_set_block_ptr(stamfs_fl, i+1, 0);
                 }
                 STAMFS_DBG(DEB_STAM, "stamfs: adding to free list at pos %d\n",
                                      i);
-                stamfs_fl->index[i] = block_num;
+                stamfs_set_block_ptr(stamfs_fl, i, block_num);
                 mark_buffer_dirty(flbh);
         }
 
-        stamfs_sb->s_free_blocks_count++;
-        mark_buffer_dirty(sbh);
-        sb->s_dirt = 1;
+        stamfs_meta->s_free_blocks_count++;
+        stamfs_put_block_counters(sb);
 
         unlock_super(sb);
 
-        STAMFS_DBG(DEB_STAM, "stamfs: block %d freed\n", block_num);
+        STAMFS_DBG(DEB_STAM, "stamfs: block %lu freed\n", block_num);
 
         return 0;
 }
 
 /*
- * Allocates a free inode number, mapping it to the given block number.
+ * Allocates a free inode number, mapping it to the given block number. the
+ * super-block must be locked by the caller.
  * returns 0 if no free numbers are available.
  */
-ino_t stamfs_alloc_inode_num(struct super_block *sb, int block_num)
+static ino_t stamfs_do_alloc_inode_num(struct super_block *sb,
+                                       unsigned long block_num)
 {
         kdev_t dev = sb->s_dev;
         struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
         struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
-        struct stamfs_inode_index *stamfs_ii = stamfs_meta->s_stamfs_ii;
+        void *stamfs_ii = stamfs_meta->s_stamfs_ii;
         struct buffer_head *sbh = stamfs_meta->s_sbh;
         struct buffer_head *iibh = stamfs_meta->s_iibh;
         ino_t ino_num = 0;
         int i;
 
         STAMFS_DBG(DEB_INIT,
-                   "stamfs: allocating inode, block=%d, dev='%d:%d'\n",
+                   "stamfs: allocating inode, block=%lu, dev='%d:%d'\n",
                    block_num, major(dev), minor(dev));
 
-        lock_super(sb);
-
-        if (stamfs_sb->s_free_inodes_count == 0) {
+        if (le32_to_cpu(stamfs_sb->s_free_inodes_count) == 0) {
                 STAMFS_DBG(DEB_STAM, "stamfs: no more free inodes.\n");
                 goto ret;
         }
 
         /* scan the list, find the first free inode. */
         for (i=0; i < STAMFS_MAX_INODE_NUM - 1; ++i)
-                if (stamfs_ii->index[i] == 0)
+                if (stamfs_get_block_ptr(stamfs_ii, i) == 0)
                         break;
+        if (i >= STAMFS_MAX_INODE_NUM - 1) {
+                printk("stamfs: inode index is full, but the super-block "
+                       "says %u inodes are free.\n",
+                       le32_to_cpu(stamfs_sb->s_free_inodes_count));
+                goto ret;
+        }
 
         ino_num = i+1;
-        stamfs_ii->index[i] = block_num;
+        stamfs_set_block_ptr(stamfs_ii, i, block_num);
         mark_buffer_dirty(iibh);
-        stamfs_sb->s_free_inodes_count--;
+        stamfs_sb->s_free_inodes_count =
+                cpu_to_le32(le32_to_cpu(stamfs_sb->s_free_inodes_count) - 1);
         mark_buffer_dirty(sbh);
         sb->s_dirt = 1;
 
         STAMFS_DBG(DEB_STAM, "stamfs: allocated inode number '%lu'\n", ino_num);
 
+  ret:
+        return ino_num;
+}
+
+/*
+ * Allocates a free inode number, mapping it to the given block number.
+ * returns 0 if no free numbers are available.
+ */
+ino_t stamfs_alloc_inode_num(struct super_block *sb, unsigned long block_num)
+{
+        ino_t ino_num;
+
+        lock_super(sb);
+        ino_num = stamfs_do_alloc_inode_num(sb, block_num);
+        unlock_super(sb);
+
+        return ino_num;
+}
+
+/*
+ * Allocates everything a new inode needs on disk, under a single lock of
+ * the super-block: an inode number, the inode's block and its block index.
+ * the two blocks are taken as one adjacent run when there is room for it
+ * past the highest used block. the first data block is allocated only when
+ * it's used, right after the block index if it's still free (see
+ * stamfs_alloc_block_near()), so that a small file's inode, index and data
+ * are read sequentially - a block reserved ahead of time would leak on a
+ * crash, as nothing on disk records it.
+ * returns the inode number, or 0 if no free blocks or inode numbers are
+ * available (in which case nothing was allocated).
+ */
+ino_t stamfs_alloc_inode_cluster(struct super_block *sb,
+                                 unsigned long *p_inode_block_num,
+                                 unsigned long *p_bi_block_num)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        unsigned long block_nums[2] = { 0, 0 };
+        ino_t ino_num = 0;
+        int i;
+
+        lock_super(sb);
+
+        if (le32_to_cpu(stamfs_meta->s_stamfs_sb->s_free_inodes_count) == 0 ||
+            stamfs_meta->s_free_blocks_count < 2) {
+                STAMFS_DBG(DEB_STAM, "stamfs: no room for a new inode.\n");
+                goto ret;
+        }
+
+        /* prefer an adjacent run - fall back to any two free blocks. */
+        if (!stamfs_do_alloc_block_run(sb, 2, block_nums)) {
+                for (i = 0; i < 2; i++) {
+                        block_nums[i] = stamfs_do_alloc_block(sb);
+                        if (block_nums[i] == 0)
+                                goto ret_err;
+                }
+        }
+
+        ino_num = stamfs_do_alloc_inode_num(sb, block_nums[0]);
+        if (ino_num == 0)
+                goto ret_err;
+
+        *p_inode_block_num = block_nums[0];
+        *p_bi_block_num = block_nums[1];
+        goto ret;
+
+  ret_err:
+        unlock_super(sb);
+        for (i = 0; i < 2; i++)
+                if (block_nums[i] > 0)
+                        stamfs_release_block(sb, block_nums[i]);
+        return 0;
   ret:
         unlock_super(sb);
         return ino_num;
@@ -275,7 +504,7 @@ int stamfs_release_inode_num(struct super_block *sb, ino_t ino_num)
         kdev_t dev = sb->s_dev;
         struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
         struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
-        struct stamfs_inode_index *stamfs_ii = stamfs_meta->s_stamfs_ii;
+        void *stamfs_ii = stamfs_meta->s_stamfs_ii;
         struct buffer_head *sbh = stamfs_meta->s_sbh;
         struct buffer_head *iibh = stamfs_meta->s_iibh;
 
@@ -292,9 +521,10 @@ int stamfs_release_inode_num(struct super_block *sb, ino_t ino_num)
         lock_super(sb);
 
         /* mark this inode as free. */
-        stamfs_ii->index[ino_num-1] = 0;
+        stamfs_set_block_ptr(stamfs_ii, ino_num-1, 0);
         mark_buffer_dirty(iibh);
-        stamfs_sb->s_free_inodes_count++;
+        stamfs_sb->s_free_inodes_count =
+                cpu_to_le32(le32_to_cpu(stamfs_sb->s_free_inodes_count) + 1);
         mark_buffer_dirty(sbh);
         sb->s_dirt = 1;
 
@@ -305,25 +535,59 @@ int stamfs_release_inode_num(struct super_block *sb, ino_t ino_num)
         return 0;
 }
 
+/*
+ * Turn on the given read-only compatible feature, if it's not on yet - for
+ * features that get used on demand (e.g. STAMFS_FEATURE_RO_COMPAT_LARGE_DIR).
+ */
+void stamfs_set_feature_ro_compat(struct super_block *sb, __u32 feature)
+{
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
+        struct stamfs_super_block* stamfs_sb = stamfs_meta->s_stamfs_sb;
+
+        if (stamfs_meta->s_feature_ro_compat & feature)
+                return;
+
+        lock_super(sb);
+
+        STAMFS_DBG(DEB_INIT, "stamfs: turning on ro_compat feature 0x%x\n",
+                             feature);
+        stamfs_meta->s_feature_ro_compat |= feature;
+        stamfs_sb->s_feature_ro_compat =
+                cpu_to_le32(stamfs_meta->s_feature_ro_compat);
+        mark_buffer_dirty(stamfs_meta->s_sbh);
+        sb->s_dirt = 1;
+
+        unlock_super(sb);
+}
+
 /*
  * Finds the block that the given inode's info is stored in.
  * returns the block number, or 0 on error.
  */
 unsigned long stamfs_inode_to_block_num(struct inode *ino)
 {
-        unsigned long ino_num = ino->i_ino;
+        return stamfs_ino_num_to_block_num(ino->i_sb, ino->i_ino);
+}
+
+/*
+ * Finds the block that the info of the inode with the given number is
+ * stored in.
+ * returns the block number, or 0 on error.
+ */
+unsigned long stamfs_ino_num_to_block_num(struct super_block *sb,
+                                          unsigned long ino_num)
+{
         unsigned long block_num = 0;
-        struct stamfs_inode_index *stamfs_ii;
+        struct stamfs_meta_data* stamfs_meta = STAMFS_META(sb);
 
-        if (ino_num < 1 || ino_num > STAMFS_MAX_INODE_NUM) {
+        if (ino_num < 1 || ino_num >= STAMFS_MAX_INODE_NUM) {
                 STAMFS_DBG(DEB_STAM,
                            "stamfs: inode number '%lu' is out of range\n",
                            ino_num);
                 return 0;
         }
 
-        stamfs_ii = STAMFS_META(ino->i_sb)->s_stamfs_ii;
-        block_num = le32_to_cpu(stamfs_ii->index[ino_num-1]);
+        block_num = stamfs_get_block_ptr(stamfs_meta->s_stamfs_ii, ino_num-1);
         STAMFS_DBG(DEB_STAM, "stamfs: inode number '%lu' is on block %lu\n",
                              ino_num, block_num);
 
@@ -334,6 +598,61 @@ unsigned long stamfs_inode_to_block_num(struct inode *ino)
  * super-block operations.
  */
 
+/*
+ * Parse the mount options into the given meta-data struct.
+ * returns 1 on success, 0 on an invalid option.
+ */
+static int stamfs_parse_options(char *options, struct stamfs_meta_data *meta)
+{
+        char *this_char;
+
+        meta->s_atime_mode = STAMFS_ATIME_STRICT;
+        meta->s_lazytime = 0;
+        meta->s_name_cache = 0;
+        meta->s_cache_limit = STAMFS_CACHE_DEFAULT_LIMIT;
+
+        if (!options)
+                return 1;
+
+        while ((this_char = strsep(&options, ",")) != NULL) {
+                if (!*this_char)
+                        continue;
+                if (!strcmp(this_char, "strictatime"))
+                        meta->s_atime_mode = STAMFS_ATIME_STRICT;
+                else if (!strcmp(this_char, "noatime"))
+                        meta->s_atime_mode = STAMFS_ATIME_NOATIME;
+                else if (!strcmp(this_char, "relatime"))
+                        meta->s_atime_mode = STAMFS_ATIME_RELATIME;
+                else if (!strcmp(this_char, "lazytime"))
+                        meta->s_lazytime = 1;
+                else if (!strcmp(this_char, "nolazytime"))
+                        meta->s_lazytime = 0;
+                else if (!strcmp(this_char, "name_cache"))
+                        meta->s_name_cache = 1;
+                else if (!strcmp(this_char, "noname_cache"))
+                        meta->s_name_cache = 0;
+                else if (!strncmp(this_char, "cache_limit=", 12)) {
+                        char *end;
+
+                        meta->s_cache_limit =
+                                simple_strtoul(this_char + 12, &end, 0);
+                        if (*end || end == this_char + 12 ||
+                            meta->s_cache_limit == 0) {
+                                printk("stamfs: invalid cache_limit '%s'.\n",
+                                       this_char + 12);
+                                return 0;
+                        }
+                }
+                else {
+                        printk("stamfs: unrecognized mount option '%s'.\n",
+                               this_char);
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
 /* this one is not static, since it's used from outside this file. */
 struct super_block *stamfs_read_super (struct super_block *sb, void *opt, int silent)
 {
@@ -347,6 +666,10 @@ struct super_block *stamfs_read_super (struct super_block *sb, void *opt, int si
         struct stamfs_inode_index *stamfs_ii = NULL;
         struct stamfs_free_list_index *stamfs_fl = NULL;
         struct stamfs_meta_data *stamfs_meta = NULL;
+        __u32 feature_compat = 0;
+        __u32 feature_incompat = 0;
+        __u32 feature_ro_compat = 0;
+        unsigned long blocks_count;
 
         MOD_INC_USE_COUNT;
 
@@ -387,6 +710,42 @@ struct super_block *stamfs_read_super (struct super_block *sb, void *opt, int si
                 goto ret_err;
         }
 
+        /* older file-systems have no feature fields at all. */
+        if (le32_to_cpu(stamfs_sb->s_feature_magic) == STAMFS_FEATURE_MAGIC) {
+                feature_compat = le32_to_cpu(stamfs_sb->s_feature_compat);
+                feature_incompat = le32_to_cpu(stamfs_sb->s_feature_incompat);
+                feature_ro_compat = le32_to_cpu(stamfs_sb->s_feature_ro_compat);
+        }
+        if (feature_incompat & ~STAMFS_FEATURE_INCOMPAT_SUPP) {
+                printk("stamfs: unsupported features (0x%x) on dev %s.\n",
+                       feature_incompat & ~STAMFS_FEATURE_INCOMPAT_SUPP,
+                       bdevname(dev));
+                goto ret_err;
+        }
+        if ((feature_ro_compat & ~STAMFS_FEATURE_RO_COMPAT_SUPP) &&
+            !(sb->s_flags & MS_RDONLY)) {
+                printk("stamfs: unsupported features (0x%x) on dev %s - "
+                       "it may only be mounted read-only.\n",
+                       feature_ro_compat & ~STAMFS_FEATURE_RO_COMPAT_SUPP,
+                       bdevname(dev));
+                goto ret_err;
+        }
+        /* usage is propagated to a directory through the parent pointers. */
+        if ((feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_USAGE) &&
+            !(feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT)) {
+                printk("stamfs: directory usage without parent pointers "
+                       "on dev %s.\n", bdevname(dev));
+                goto ret_err;
+        }
+
+        blocks_count = le32_to_cpu(stamfs_sb->s_blocks_count);
+        if (blocks_count > STAMFS_MAX_BLOCKS_COUNT) {
+                printk("stamfs: dev %s has too many blocks (%lu) for this "
+                       "kernel.\n",
+                       bdevname(dev), blocks_count);
+                goto ret_err;
+        }
+
         /* initialize our meta-data. */
         stamfs_meta = kmalloc(sizeof(struct stamfs_meta_data), GFP_KERNEL);
         if (!stamfs_meta) {
@@ -399,11 +758,29 @@ struct super_block *stamfs_read_super (struct super_block *sb, void *opt, int si
         stamfs_meta->s_stamfs_ii = stamfs_ii;
         stamfs_meta->s_flbh = flbh;
         stamfs_meta->s_stamfs_fl = stamfs_fl;
+        stamfs_meta->s_feature_compat = feature_compat;
+        stamfs_meta->s_feature_incompat = feature_incompat;
+        stamfs_meta->s_feature_ro_compat = feature_ro_compat;
+        init_MUTEX(&stamfs_meta->s_usage_sem);
+        stamfs_cache_init(stamfs_meta);
+        spin_lock_init(&stamfs_meta->s_lazy_lock);
+        INIT_LIST_HEAD(&stamfs_meta->s_lazy_list);
+        stamfs_meta->s_blocks_count = blocks_count;
+        stamfs_meta->s_free_blocks_count =
+                le32_to_cpu(stamfs_sb->s_free_blocks_count);
+        stamfs_meta->s_highest_used_block_num =
+                le32_to_cpu(stamfs_sb->s_highest_used_block_num);
+        if (!stamfs_parse_options((char *)opt, stamfs_meta))
+                goto ret_err;
+        if (!stamfs_changelog_init(stamfs_meta, stamfs_sb))
+                goto ret_err;
 
-        /* initialize the VFS's super-block struct. */
+        /* initialize the VFS's super-block struct. a file's size is limited
+         * by the number of blocks its block index can map. */
         sb->s_blocksize = STAMFS_BLOCK_SIZE;
         sb->s_blocksize_bits = 10;
-        sb->s_maxbytes = (STAMFS_BLOCK_SIZE / 4) * STAMFS_BLOCK_SIZE;
+        sb->s_maxbytes = (unsigned long long)STAMFS_MAX_BLOCKS_PER_FILE *
+                         STAMFS_BLOCK_SIZE;
         sb->s_magic = STAMFS_SUPER_MAGIC;
         sb->s_op = &stamfs_super_ops;
         sb->u.generic_sbp = stamfs_meta;
@@ -460,6 +837,10 @@ void stamfs_write_inode (struct inode *ino, int opts)
 {
         STAMFS_DBG(DEB_STAM, "stamfs: writing inode %ld\n", ino->i_ino);
 
+        /* blocks mapped via get_block (e.g. through mmap) are propagated
+           here. */
+        stamfs_usage_try_sync(ino);
+
         stamfs_inode_write_ino (ino, opts);
 }
 
@@ -476,7 +857,13 @@ void stamfs_put_inode (struct inode *ino)
                    "stamfs: the VFS deleted inode %ld from its cache\n",
                    ino->i_ino);
 
-        /* nothing to do. */
+        /* the last user is gone - account for the usage changes that
+         * write_inode could not, and let lazily-updated times reach the
+         * disk. */
+        if (atomic_read(&ino->i_count) == 1) {
+                stamfs_usage_release(ino);
+                stamfs_inode_flush_lazy_times(ino);
+        }
 }
 
 void stamfs_delete_inode (struct inode *ino)
@@ -493,7 +880,8 @@ void stamfs_delete_inode (struct inode *ino)
         ino->i_size = 0;
         if (ino->i_blocks) {
                 STAMFS_DBG(DEB_STAM, "stamfs: truncating, #blocks = %ld\n", ino->i_blocks);
-                stamfs_inode_truncate(ino);
+                /* not stamfs_inode_truncate - the unlink was logged. */
+                stamfs_inode_do_truncate(ino);
         }
 
         /* free the block index and the inode's block. */
@@ -529,10 +917,12 @@ void stamfs_write_super (struct super_block *sb)
                    "stamfs: writing superblock, dev='%d:%d'\n",
                    major(sb->s_dev), minor(sb->s_dev));
 
-        /* nothing to do - the super-block is stored in buffers, which */
-        /* get written to disk by the system anyway, and get synced    */
-        /* immediately by the VFS anyway when it needs umount this FS. */
-        sb->s_dirt = 0;
+        /* the super-block is stored in buffers, which get written to */
+        /* disk by the system anyway, and get synced immediately by   */
+        /* the VFS anyway when it needs umount this FS. but this is   */
+        /* also called periodically (by kupdate) while s_dirt is set - */
+        /* so old 'lazytime' updates are pushed out from here.        */
+        sb->s_dirt = stamfs_inode_expire_lazy_times(sb);
 }
 
 void stamfs_write_super_lockfs (struct super_block *sb)
@@ -557,12 +947,12 @@ int stamfs_statfs (struct super_block *sb, struct statfs *stat)
         memset(stat, 0, sizeof(struct statfs));
         stat->f_type = STAMFS_SUPER_MAGIC;
         stat->f_bsize = sb->s_blocksize;
-        stat->f_blocks = le32_to_cpu(stamfs_sb->s_blocks_count);
-        stat->f_bfree = le32_to_cpu(stamfs_sb->s_free_blocks_count);
+        stat->f_blocks = STAMFS_META(sb)->s_blocks_count;
+        stat->f_bfree = STAMFS_META(sb)->s_free_blocks_count;
         stat->f_bavail = stat->f_bfree;
         stat->f_files = le32_to_cpu(stamfs_sb->s_inodes_count);
         stat->f_ffree = le32_to_cpu(stamfs_sb->s_free_inodes_count);
-        stat->f_namelen = STAMFS_MAX_FNAME_LEN;
+        stat->f_namelen = stamfs_dirent_max_name_len(sb);
 
         printk("stamfs: f_blocks=%lu, f_bfree=%lu, f_bavail=%lu\n",
                stat->f_blocks, stat->f_bfree, stat->f_bavail);
@@ -5,6 +5,72 @@
 #include <linux/stddef.h>
 #include <linux/fs.h>
 
+#include "stamfs.h"
+
+
+/* how access times are updated (the 'noatime'/'relatime' mount options). */
+#define STAMFS_ATIME_STRICT     0       /* on every access.                  */
+#define STAMFS_ATIME_NOATIME    1       /* never.                            */
+#define STAMFS_ATIME_RELATIME   2       /* only if older than the mtime or   */
+                                        /* ctime, or a day old.              */
+
+/* STAMFS meta-data attached to the VFS super-block of each mounted FS. */
+struct stamfs_meta_data {
+        struct buffer_head *s_sbh;
+        struct stamfs_super_block *s_stamfs_sb;
+        struct buffer_head *s_iibh;
+        struct stamfs_inode_index *s_stamfs_ii;
+        struct buffer_head *s_flbh;
+        struct stamfs_free_list_index *s_stamfs_fl;
+        __u32 s_feature_compat;         /* features of this file-system.     */
+        __u32 s_feature_incompat;
+        __u32 s_feature_ro_compat;
+        /* the super-block's block counters, decoded. they are written back
+         * to the super-block's buffer whenever they change. */
+        unsigned long s_blocks_count;
+        unsigned long s_free_blocks_count;
+        unsigned long s_highest_used_block_num;
+        /* serializes updates of the directories' subtree usage. */
+        struct semaphore s_usage_sem;
+        /* the change log, decoded (see stamfs_changelog.c). */
+        struct semaphore s_changelog_sem;
+        unsigned long s_changelog_block_num;
+        unsigned long s_changelog_blocks;
+        unsigned long s_changelog_head;
+        __u64 s_changelog_seq;
+        unsigned long s_changelog_last_ino;
+        int s_changelog_last_op;
+        /* the LRU cache of the inodes' decoded meta-data (see
+         * stamfs_cache.c), and its statistics. */
+        spinlock_t s_cache_lock;
+        struct list_head s_cache_lru;
+        unsigned long s_cache_count;
+        unsigned long s_cache_limit;    /* the 'cache_limit=' mount option.  */
+        unsigned long s_cache_hits;
+        unsigned long s_cache_misses;
+        unsigned long s_cache_evictions;
+        /* mount options. */
+        int s_atime_mode;               /* one of STAMFS_ATIME_*.            */
+        int s_lazytime;                 /* keep timestamp-only updates in    */
+                                        /* memory.                           */
+        /* the inodes holding 'lazytime' updates, oldest last. */
+        spinlock_t s_lazy_lock;
+        struct list_head s_lazy_list;
+        int s_name_cache;               /* keep the names of directories in  */
+                                        /* memory (see stamfs_names.c).      */
+};
+
+/* extract the STAMFS meta-data from a VFS super-block. */
+#define STAMFS_META(sb) ((struct stamfs_meta_data *)((sb)->u.generic_sbp))
+
+/* do the inodes of the given file-system hold flags (and the fields that
+ * go with them)? */
+static inline int stamfs_inode_flags_enabled(struct super_block *sb)
+{
+        return (STAMFS_META(sb)->s_feature_ro_compat &
+                STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS) != 0;
+}
+
 
 /*
  * exported functions.
@@ -12,32 +78,82 @@
 
 struct super_block *stamfs_read_super (struct super_block *, void *, int);
 
+/*
+ * Get a buffer for a block that was just allocated, without reading its
+ * stale contents from the device. The buffer is returned zeroed and
+ * up-to-date.
+ * returns NULL on failure.
+ */
+struct buffer_head *stamfs_getblk_zeroed(struct super_block *sb,
+                                         unsigned long block_num);
+
 /*
  * Allocates a free block number.
  * returns 0 if no free numbers are available.
  */
-int stamfs_alloc_block(struct super_block *sb);
+unsigned long stamfs_alloc_block(struct super_block *sb);
+
+/*
+ * Allocates the given block number if it is free, or any free block number
+ * otherwise.
+ * returns 0 if no free numbers are available.
+ */
+unsigned long stamfs_alloc_block_near(struct super_block *sb,
+                                      unsigned long goal);
+
+/*
+ * Allocates 'count' adjacent blocks past the highest used block, storing
+ * their numbers in 'block_nums'.
+ * returns 1 on success, 0 if there is not enough room for such a run (in
+ * which case nothing was allocated).
+ */
+int stamfs_alloc_block_run(struct super_block *sb, int count,
+                           unsigned long *block_nums);
 
 /*
  * Frees a previously allocated block number.
  */
-int stamfs_release_block(struct super_block *sb, int block_num);
+int stamfs_release_block(struct super_block *sb, unsigned long block_num);
 
 /*
  * Allocates a free inode number, mapping it to the given block number.
  * returns 0 if no free numbers are available.
  */
-ino_t stamfs_alloc_inode_num(struct super_block *sb, int block_num);
+ino_t stamfs_alloc_inode_num(struct super_block *sb, unsigned long block_num);
+
+/*
+ * Allocates everything a new inode needs on disk, under a single lock of
+ * the super-block: an inode number, the inode's block and its block index
+ * - as adjacent blocks where possible.
+ * returns the inode number, or 0 if no free blocks or inode numbers are
+ * available.
+ */
+ino_t stamfs_alloc_inode_cluster(struct super_block *sb,
+                                 unsigned long *p_inode_block_num,
+                                 unsigned long *p_bi_block_num);
 
 /*
  * Frees a previously allocated inode number.
  */
 int stamfs_release_inode_num(struct super_block *sb, ino_t ino_num);
 
+/*
+ * Turn on the given read-only compatible feature, if it's not on yet.
+ */
+void stamfs_set_feature_ro_compat(struct super_block *sb, __u32 feature);
+
 /*
  * Finds the block that the given inode's info is stored in.
  * returns the block number, or 0 on error.
  */
 unsigned long stamfs_inode_to_block_num(struct inode *ino);
 
+/*
+ * Finds the block that the info of the inode with the given number is
+ * stored in.
+ * returns the block number, or 0 on error.
+ */
+unsigned long stamfs_ino_num_to_block_num(struct super_block *sb,
+                                          unsigned long ino_num);
+
 #endif /* STAMFS_SUPER_H */
@@ -0,0 +1,247 @@
+
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+
+#include "stamfs.h"
+#include "stamfs_util.h"
+#include "stamfs_super.h"
+#include "stamfs_inode.h"
+#include "stamfs_usage.h"
+
+/*
+ * Each inode holds the usage (bytes, blocks and inodes) of the subtree
+ * rooted at it - for a plain file, that is just the file itself. whenever
+ * the size or the blocks of an inode change, or an inode is linked into or
+ * unlinked from a directory, the change is added to the inode's subtree
+ * usage and then to that of each of its ancestors, following the parent
+ * pointers up to the root. all these updates are serialized by the
+ * super-block's s_usage_sem.
+ *
+ * get_block only changes i_blocks - it may be called from writepage, so it
+ * doesn't propagate anything. the delta is propagated later, from
+ * file_write, truncate or write_inode - or, at the latest, when the last
+ * user of the inode releases it.
+ */
+
+/* is the subtree usage maintained on the given file-system? */
+static inline int stamfs_usage_enabled(struct super_block *sb)
+{
+        return (STAMFS_META(sb)->s_feature_ro_compat &
+                STAMFS_FEATURE_RO_COMPAT_DIR_USAGE) != 0;
+}
+
+/* were the inode's size or blocks changed since they were last accounted? */
+static inline int stamfs_usage_pending(struct inode *ino)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        return (ino->i_size != inode_meta->i_acct_bytes ||
+                ino->i_blocks != inode_meta->i_acct_blocks);
+}
+
+/*
+ * Add the given deltas to the subtree usage of the given directory, and of
+ * all its ancestors. s_usage_sem must be held by the caller.
+ */
+static void stamfs_usage_propagate(struct super_block *sb,
+                                   unsigned long ino_num,
+                                   long long delta_bytes,
+                                   long long delta_blocks,
+                                   long delta_inodes)
+{
+        struct stamfs_inode_meta_data *inode_meta = NULL;
+        struct inode *dir = NULL;
+        unsigned long depth = 0;
+
+        /* the depth check guards against a corrupt parent chain. */
+        while (ino_num != 0 && depth++ < STAMFS_MAX_INODE_NUM) {
+                dir = iget(sb, ino_num);
+                if (!dir)
+                        break;
+                if (is_bad_inode(dir)) {
+                        iput(dir);
+                        break;
+                }
+
+                inode_meta = STAMFS_INODE_META(dir);
+                inode_meta->i_tree_bytes += delta_bytes;
+                inode_meta->i_tree_blocks += delta_blocks;
+                inode_meta->i_tree_inodes += delta_inodes;
+                mark_inode_dirty(dir);
+
+                ino_num = inode_meta->i_parent_ino;
+                iput(dir);
+        }
+}
+
+/*
+ * Account for a change of the inode's own size or blocks. s_usage_sem must
+ * be held by the caller.
+ */
+static void stamfs_usage_do_sync(struct inode *ino)
+{
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+        long long delta_bytes;
+        long long delta_blocks;
+
+        delta_bytes = ino->i_size - inode_meta->i_acct_bytes;
+        delta_blocks = (long long)ino->i_blocks - inode_meta->i_acct_blocks;
+        if (delta_bytes == 0 && delta_blocks == 0)
+                return;
+
+        STAMFS_DBG(DEB_STAM, "stamfs: inode %lu usage changed by %lld bytes, "
+                             "%lld blocks\n",
+                             ino->i_ino, delta_bytes, delta_blocks);
+
+        inode_meta->i_acct_bytes = ino->i_size;
+        inode_meta->i_acct_blocks = ino->i_blocks;
+        inode_meta->i_tree_bytes += delta_bytes;
+        inode_meta->i_tree_blocks += delta_blocks;
+        mark_inode_dirty(ino);
+
+        stamfs_usage_propagate(ino->i_sb, inode_meta->i_parent_ino,
+                               delta_bytes, delta_blocks, 0);
+}
+
+/*
+ * Account for a change of the given inode's size or number of blocks, in
+ * its own subtree usage and in that of all its ancestors.
+ */
+void stamfs_usage_sync(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+
+        if (!stamfs_usage_enabled(sb) || !STAMFS_INODE_META(ino))
+                return;
+
+        down(&STAMFS_META(sb)->s_usage_sem);
+        stamfs_usage_do_sync(ino);
+        up(&STAMFS_META(sb)->s_usage_sem);
+}
+
+/*
+ * Same as stamfs_usage_sync, but never sleeps on s_usage_sem - if it is
+ * taken, the change stays recorded in the inode (i_size and i_blocks vs.
+ * i_acct_bytes and i_acct_blocks), and the inode is dirtied again, so
+ * that a later write_inode retries. i_acct_* are not stored on disk, so
+ * the inode must not leave the cache with the change still pending.
+ */
+void stamfs_usage_try_sync(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+
+        if (!stamfs_usage_enabled(sb) || !STAMFS_INODE_META(ino))
+                return;
+
+        if (down_trylock(&STAMFS_META(sb)->s_usage_sem)) {
+                if (stamfs_usage_pending(ino))
+                        mark_inode_dirty(ino);
+                return;
+        }
+        stamfs_usage_do_sync(ino);
+        up(&STAMFS_META(sb)->s_usage_sem);
+}
+
+/*
+ * The last user of the given inode is going away - account for any change
+ * left over by stamfs_usage_try_sync, waiting for s_usage_sem if needed.
+ * directories are skipped: they are released by stamfs_usage_propagate(),
+ * with s_usage_sem held - and their own size and blocks only change under
+ * stamfs_usage_sync anyway.
+ */
+void stamfs_usage_release(struct inode *ino)
+{
+        if (S_ISDIR(ino->i_mode) || !ino->i_nlink)
+                return;
+        if (!stamfs_usage_enabled(ino->i_sb) || !STAMFS_INODE_META(ino) ||
+            !stamfs_usage_pending(ino))
+                return;
+
+        stamfs_usage_sync(ino);
+}
+
+/*
+ * The given child was just linked into the given directory - make it point
+ * to the directory, and add its subtree's usage to the directory and to all
+ * its ancestors.
+ */
+void stamfs_usage_link(struct inode *dir, struct inode *child)
+{
+        struct super_block *sb = dir->i_sb;
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_inode_meta_data *child_meta = STAMFS_INODE_META(child);
+
+        if (!(stamfs_meta->s_feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT))
+                return;
+
+        down(&stamfs_meta->s_usage_sem);
+
+        /* the child is not linked anywhere yet, so this stays with it. */
+        if (stamfs_usage_enabled(sb))
+                stamfs_usage_do_sync(child);
+
+        child_meta->i_parent_ino = dir->i_ino;
+        mark_inode_dirty(child);
+
+        if (stamfs_usage_enabled(sb))
+                stamfs_usage_propagate(sb, dir->i_ino,
+                                       child_meta->i_tree_bytes,
+                                       child_meta->i_tree_blocks,
+                                       child_meta->i_tree_inodes);
+
+        up(&stamfs_meta->s_usage_sem);
+}
+
+/*
+ * The given child was just unlinked from the given directory - remove its
+ * subtree's usage from the directory and from all its ancestors, and make it
+ * point nowhere.
+ */
+void stamfs_usage_unlink(struct inode *dir, struct inode *child)
+{
+        struct super_block *sb = dir->i_sb;
+        struct stamfs_meta_data *stamfs_meta = STAMFS_META(sb);
+        struct stamfs_inode_meta_data *child_meta = STAMFS_INODE_META(child);
+
+        if (!(stamfs_meta->s_feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT))
+                return;
+
+        down(&stamfs_meta->s_usage_sem);
+
+        if (stamfs_usage_enabled(sb)) {
+                stamfs_usage_do_sync(child);
+                stamfs_usage_propagate(sb, dir->i_ino,
+                                       -(long long)child_meta->i_tree_bytes,
+                                       -(long long)child_meta->i_tree_blocks,
+                                       -(long)child_meta->i_tree_inodes);
+        }
+
+        /* an open unlinked file may still change - but nobody cares. */
+        child_meta->i_parent_ino = 0;
+        mark_inode_dirty(child);
+
+        up(&stamfs_meta->s_usage_sem);
+}
+
+/*
+ * Get the usage of the subtree rooted at the given inode.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_usage_get(struct inode *ino, struct stamfs_usage *usage)
+{
+        struct super_block *sb = ino->i_sb;
+        struct stamfs_inode_meta_data *inode_meta = STAMFS_INODE_META(ino);
+
+        if (!stamfs_usage_enabled(sb))
+                return -EOPNOTSUPP;
+
+        down(&STAMFS_META(sb)->s_usage_sem);
+        usage->su_bytes = inode_meta->i_tree_bytes;
+        usage->su_blocks = inode_meta->i_tree_blocks;
+        usage->su_inodes = inode_meta->i_tree_inodes;
+        up(&STAMFS_META(sb)->s_usage_sem);
+
+        return 0;
+}
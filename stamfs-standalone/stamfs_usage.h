@@ -0,0 +1,53 @@
+
+#ifndef STAMFS_USAGE_H
+#define STAMFS_USAGE_H
+
+#include <linux/fs.h>
+
+#include "stamfs.h"
+
+/*
+ * Functions that maintain the parent pointers of inodes, and the usage of
+ * the subtree rooted at each directory
+ * (STAMFS_FEATURE_RO_COMPAT_PARENT and STAMFS_FEATURE_RO_COMPAT_DIR_USAGE).
+ */
+
+/*
+ * Account for a change of the given inode's size or number of blocks, in
+ * its own subtree usage and in that of all its ancestors.
+ */
+void stamfs_usage_sync(struct inode *ino);
+
+/*
+ * Same as stamfs_usage_sync, but never sleeps on s_usage_sem. used from
+ * write_inode, which may run while s_usage_sem is held.
+ */
+void stamfs_usage_try_sync(struct inode *ino);
+
+/*
+ * The last user of the given inode is going away - account for any change
+ * left over by stamfs_usage_try_sync. may sleep on s_usage_sem.
+ */
+void stamfs_usage_release(struct inode *ino);
+
+/*
+ * The given child was just linked into the given directory - make it point
+ * to the directory, and add its subtree's usage to the directory and to all
+ * its ancestors.
+ */
+void stamfs_usage_link(struct inode *dir, struct inode *child);
+
+/*
+ * The given child was just unlinked from the given directory - remove its
+ * subtree's usage from the directory and from all its ancestors, and make it
+ * point nowhere.
+ */
+void stamfs_usage_unlink(struct inode *dir, struct inode *child);
+
+/*
+ * Get the usage of the subtree rooted at the given inode.
+ * @return 0 on success, a negative error code on failure.
+ */
+int stamfs_usage_get(struct inode *ino, struct stamfs_usage *usage);
+
+#endif /* STAMFS_USAGE_H */
@@ -17,19 +17,35 @@
 #define ROOT_INODE_INDEX_BLOCK_NUM (ROOT_INODE_BLOCK_NUM + 1)
 #define ROOT_INODE_FIRST_DATA_BLOCK_NUM (ROOT_INODE_INDEX_BLOCK_NUM + 1)
 #define HIGHEST_USED_BLOCK_NUM ROOT_INODE_FIRST_DATA_BLOCK_NUM
-
+/* the change log, if any, follows the root inode's blocks. */
+#define CHANGELOG_FIRST_BLOCK_NUM (HIGHEST_USED_BLOCK_NUM + 1)
+
+/* the 'incompat' features of the new file-system, and the size of its block
+ * pointers. */
+static __u32 feature_incompat = 0;
+/* the 'ro_compat' features of the new file-system. */
+static __u32 feature_ro_compat = STAMFS_FEATURE_RO_COMPAT_PARENT |
+                                 STAMFS_FEATURE_RO_COMPAT_DIR_USAGE |
+                                 STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS;
+/* the number of blocks of the change log (STAMFS_FEATURE_RO_COMPAT_CHANGELOG). */
+static int changelog_blocks = 0;
 
 /* print usage information and exit. */
 void usage(const char* progname)
 {
-        fprintf(stderr, "Usage: %s [-f] <dev file|file>\n", progname);
+        fprintf(stderr,
+                "Usage: %s [-f] [-O changelog] "
+                "[-O dir_index] [-O long_names] [-O name_hash] "
+                "<dev file|file>\n",
+                progname);
         exit(1);
 }
 
 /* check that the given file path is valid, and points to a device file (unless
  * force == 1).
  */
-int check_dev(const char* progname, const char *dev_path, int force, int* p_num_blocks)
+int check_dev(const char* progname, const char *dev_path, int force,
+              __u64* p_num_blocks)
 {
         struct stat st;
 
@@ -84,29 +100,30 @@ int write_stamfs_block(const char* progname, const char* dev_path,
                        int stamfs_block_num, char* data, int data_len)
 {
         int rc;
-        off_t seek_pos = stamfs_block_num * STAMFS_BLOCK_SIZE;
+        off_t seek_pos = (off_t)stamfs_block_num * STAMFS_BLOCK_SIZE;
+        off_t new_pos;
 
         /* we need to write into block #1. */
-        rc = lseek(fd, seek_pos, SEEK_SET);
-        if (rc == -1) {
+        new_pos = lseek(fd, seek_pos, SEEK_SET);
+        if (new_pos == -1) {
                 int errnum = errno;
                 fprintf(stderr,
-                        "%s: failed seeking into position %lu "
+                        "%s: failed seeking into position %llu "
                         "of file '%s' - %s.\n",
                         progname,
-                        seek_pos,
+                        (unsigned long long)seek_pos,
                         dev_path,
                         strerror(errnum));
                 return 0;
         }
-        if (rc != seek_pos) {
+        if (new_pos != seek_pos) {
                 fprintf(stderr,
-                        "%s: failed seeking into position %lu of file '%s' - "
-                        "lseek returned %d.\n",
+                        "%s: failed seeking into position %llu of file '%s' - "
+                        "lseek returned %llu.\n",
                         progname,
-                        seek_pos,
+                        (unsigned long long)seek_pos,
                         dev_path,
-                        rc);
+                        (unsigned long long)new_pos);
                 return 0;
         }
 
@@ -124,10 +141,10 @@ int write_stamfs_block(const char* progname, const char* dev_path,
         if (rc != data_len) {
                 fprintf(stderr,
                         "%s: got only partial write when writing '%s' block "
-                        " into position %lu of file '%s'.\n",
+                        " into position %llu of file '%s'.\n",
                         progname,
                         block_name,
-                        seek_pos,
+                        (unsigned long long)seek_pos,
                         dev_path);
                 return 0;
         }
@@ -137,7 +154,7 @@ int write_stamfs_block(const char* progname, const char* dev_path,
 
 /* write the STAMFS super-block. */
 int write_stamfs_super_block(const char* progname, const char* dev_path,
-                             int fd, int num_blocks, int num_free_blocks)
+                             int fd, __u64 num_blocks, __u64 num_free_blocks)
 {
         struct stamfs_super_block stamfs_sb;
         int rc;
@@ -145,14 +162,25 @@ int write_stamfs_super_block(const char* progname, const char* dev_path,
         memset(&stamfs_sb, 0, sizeof(stamfs_sb));
         stamfs_sb.s_magic = STAMFS_SUPER_MAGIC;
         stamfs_sb.s_inodes_count = STAMFS_MAX_INODE_NUM;
-        stamfs_sb.s_blocks_count = num_blocks;
+        stamfs_sb.s_blocks_count = (__u32)num_blocks;
         stamfs_sb.s_free_inodes_count = STAMFS_MAX_INODE_NUM - 1;
-        stamfs_sb.s_free_blocks_count = num_free_blocks;
+        stamfs_sb.s_free_blocks_count = (__u32)num_free_blocks;
         stamfs_sb.s_free_list_block_num = STAMFS_FREE_LIST_BLOCK_NUM;
-        stamfs_sb.s_highest_used_block_num = HIGHEST_USED_BLOCK_NUM;
+        stamfs_sb.s_highest_used_block_num =
+                HIGHEST_USED_BLOCK_NUM + changelog_blocks;
+        stamfs_sb.s_feature_magic = STAMFS_FEATURE_MAGIC;
+        stamfs_sb.s_feature_incompat = feature_incompat;
+        stamfs_sb.s_feature_ro_compat = feature_ro_compat;
+        if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_CHANGELOG) {
+                stamfs_sb.s_changelog_block_num = CHANGELOG_FIRST_BLOCK_NUM;
+                stamfs_sb.s_changelog_blocks = changelog_blocks;
+                stamfs_sb.s_changelog_head = 0;
+                stamfs_sb.s_changelog_seq = 1;
+        }
 
-        printf("%s: free blocks count: %d, blocks_count - %d\n",
-               progname, num_free_blocks, num_blocks);
+        printf("%s: free blocks count: %llu, blocks_count - %llu\n",
+               progname, (unsigned long long)num_free_blocks,
+               (unsigned long long)num_blocks);
 
         /* we need to write into block #1. */
         rc = write_stamfs_block(progname, dev_path, fd, "super-block",
@@ -164,17 +192,18 @@ int write_stamfs_super_block(const char* progname, const char* dev_path,
 /* write the inode index. */
 int write_stamfs_inode_index(const char* progname, const char* dev_path, int fd)
 {
-        struct stamfs_inode_index stamfs_ii;
+        char buf[STAMFS_BLOCK_SIZE];
         int rc;
 
         /* everything should be zero, except for the root inode. */
-        memset((char*)&stamfs_ii, 0, sizeof(stamfs_ii));
-        stamfs_ii.index[STAMFS_ROOT_INODE_NUM-1] = ROOT_INODE_BLOCK_NUM;
+        memset(buf, 0, sizeof(buf));
+        stamfs_set_block_ptr(buf, STAMFS_ROOT_INODE_NUM-1,
+                             ROOT_INODE_BLOCK_NUM);
 
         /* we need to write into block #2. */
         rc = write_stamfs_block(progname, dev_path, fd, "inode-index",
                                 STAMFS_INODES_BLOCK_NUM,
-                                (char*)&stamfs_ii, sizeof(stamfs_ii));
+                                buf, sizeof(buf));
         return rc;
 }
 
@@ -200,17 +229,21 @@ int write_stamfs_free_list_block(const char* progname, const char* dev_path,
 int write_stamfs_root_inode_first_data_block(const char* progname,
                                              const char* dev_path, int fd)
 {
-        struct stamfs_dir_rec stamfs_dr;
+        char buf[STAMFS_BLOCK_SIZE];
+        struct stamfs_dir_entry *entry = (struct stamfs_dir_entry *)buf;
         int rc;
 
-        memset((char*)&stamfs_dr, 0, sizeof(stamfs_dr));
-        stamfs_dr.dr_ino = 0;
+        /* an empty block - a first fixed-length entry with dr_ino 0, or a
+         * single unused variable-length entry spanning the whole block. */
+        memset(buf, 0, sizeof(buf));
+        if (feature_incompat & STAMFS_FEATURE_INCOMPAT_LONG_NAMES)
+                entry->de_rec_len = STAMFS_BLOCK_SIZE;
 
         /* we need to write into block #ROOT_INODE_FIRST_DATA_BLOCK_NUM. */
         rc = write_stamfs_block(progname, dev_path, fd,
                                 "root inode first data block",
                                 ROOT_INODE_FIRST_DATA_BLOCK_NUM,
-                                (char*)&stamfs_dr, sizeof(stamfs_dr));
+                                buf, sizeof(buf));
         return rc;
 }
 
@@ -218,17 +251,17 @@ int write_stamfs_root_inode_first_data_block(const char* progname,
 int write_stamfs_root_inode_block_index(const char* progname,
                                         const char* dev_path, int fd)
 {
-        struct stamfs_inode_block_index stamfs_root_bi;
+        char buf[STAMFS_BLOCK_SIZE];
         int rc;
 
-        memset((char*)&stamfs_root_bi, 0, sizeof(stamfs_root_bi));
-        stamfs_root_bi.index[0] = ROOT_INODE_FIRST_DATA_BLOCK_NUM;
+        memset(buf, 0, sizeof(buf));
+        stamfs_set_block_ptr(buf, 0, ROOT_INODE_FIRST_DATA_BLOCK_NUM);
 
         /* we need to write into block #STAMFS_ROOT_INODE_BLOCK_NUM. */
         rc = write_stamfs_block(progname, dev_path, fd,
                                 "root inode block index",
                                 ROOT_INODE_INDEX_BLOCK_NUM,
-                                (char*)&stamfs_root_bi, sizeof(stamfs_root_bi));
+                                buf, sizeof(buf));
         return rc;
 }
 
@@ -250,6 +283,11 @@ int write_stamfs_root_inode(const char* progname, const char* dev_path, int fd)
         stamfs_root_ino.i_num_blocks = 1;
         stamfs_root_ino.i_num_links = 1;
         stamfs_root_ino.i_index_block = ROOT_INODE_INDEX_BLOCK_NUM;
+        /* the root has no parent, and its subtree is just itself. */
+        stamfs_root_ino.i_parent_ino = 0;
+        stamfs_root_ino.i_tree_bytes = stamfs_root_ino.i_size;
+        stamfs_root_ino.i_tree_blocks = stamfs_root_ino.i_num_blocks;
+        stamfs_root_ino.i_tree_inodes = 1;
 
         /* we need to write into block #ROOT_INODE_BLOCK_NUM. */
         rc = write_stamfs_block(progname, dev_path, fd, "inode-index",
@@ -265,9 +303,27 @@ int write_stamfs_root_inode(const char* progname, const char* dev_path, int fd)
         return write_stamfs_root_inode_first_data_block(progname, dev_path, fd);
 }
 
+/* write the (empty) blocks of the change log. */
+int write_stamfs_changelog(const char* progname, const char* dev_path, int fd)
+{
+        char buf[STAMFS_BLOCK_SIZE];
+        int i;
+
+        memset(buf, 0, sizeof(buf));
+
+        for (i = 0; i < changelog_blocks; i++) {
+                if (!write_stamfs_block(progname, dev_path, fd, "change log",
+                                        CHANGELOG_FIRST_BLOCK_NUM + i,
+                                        buf, sizeof(buf)))
+                        return 0;
+        }
+
+        return 1;
+}
+
 /* create the STAMFS file-system structure. */
 int mkstamfs(const char* progname, const char* dev_path,
-             int num_blocks, int num_free_blocks)
+             __u64 num_blocks, __u64 num_free_blocks)
 {
         int fd = open(dev_path, O_WRONLY | O_EXCL);
 
@@ -287,6 +343,12 @@ int mkstamfs(const char* progname, const char* dev_path,
                 return 0;
         }
 
+        /* the inode index and the free list are written here, rather than
+         * left for the kernel to initialise on the first mount: there are no
+         * inode tables or bitmaps that grow with the device - these two
+         * blocks are all the meta-data there is, and data blocks are handed
+         * out past a high-water mark, without being zeroed. so formatting
+         * takes the same (short) time on a device of any size. */
         if (!write_stamfs_inode_index(progname, dev_path, fd)) {
                 close(fd);
                 return 0;
@@ -302,6 +364,11 @@ int mkstamfs(const char* progname, const char* dev_path,
                 return 0;
         }
 
+        if (!write_stamfs_changelog(progname, dev_path, fd)) {
+                close(fd);
+                return 0;
+        }
+
         if (close(fd) == -1) {
                 int errnum = errno;
                 fprintf(stderr,
@@ -319,30 +386,67 @@ int main(int argc, char *argv[])
 {
         const char *dev_path = NULL;
         int force = 0;
-        int num_blocks = 0;
-        int free_blocks = 0;
+        __u64 num_blocks = 0;
+        __u64 free_blocks = 0;
         const char* progname = argv[0];
-
-        if (argc < 2)
-                usage(progname);
+        int c;
 
         /* parse command-line options. */
-        if (strcmp(argv[1], "-f") == 0) {
-            force = 1;
-            argv++;
-            argc--;
+        while ((c = getopt(argc, argv, "fO:")) != -1) {
+                switch (c) {
+                case 'f':
+                        force = 1;
+                        break;
+                case 'O':
+                        if (strcmp(optarg, "changelog") == 0)
+                                feature_ro_compat |=
+                                        STAMFS_FEATURE_RO_COMPAT_CHANGELOG;
+                        else if (strcmp(optarg, "dir_index") == 0)
+                                feature_ro_compat |=
+                                        STAMFS_FEATURE_RO_COMPAT_DIR_INDEX;
+                        else if (strcmp(optarg, "long_names") == 0)
+                                feature_incompat |=
+                                        STAMFS_FEATURE_INCOMPAT_LONG_NAMES;
+                        else if (strcmp(optarg, "name_hash") == 0)
+                                feature_ro_compat |=
+                                        STAMFS_FEATURE_RO_COMPAT_NAME_HASH;
+                        else {
+                                fprintf(stderr, "%s: unknown feature '%s'.\n",
+                                        progname, optarg);
+                                usage(progname);
+                        }
+                        break;
+                default:
+                        usage(progname);
+                }
         }
 
-        if (argc < 2)
+        if (optind != argc - 1)
                 usage(progname);
 
-        dev_path = argv[1];
+        dev_path = argv[optind];
+        if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_CHANGELOG)
+                changelog_blocks = STAMFS_CHANGELOG_DEFAULT_BLOCKS;
 
         /* make necessary checks - the path exists, and either points to
          * a device file, or force==1. */
         if (!check_dev(progname, dev_path, force, &num_blocks))
                 exit(1);
-        free_blocks = num_blocks - (HIGHEST_USED_BLOCK_NUM + 1);
+        if (num_blocks <= HIGHEST_USED_BLOCK_NUM + changelog_blocks) {
+                fprintf(stderr, "%s: '%s' is too small.\n",
+                        progname, dev_path);
+                exit(1);
+        }
+        /* the kernel won't mount anything bigger. */
+        if (num_blocks > STAMFS_MAX_BLOCKS_COUNT) {
+                fprintf(stderr,
+                        "%s: '%s' has %llu blocks - at most %lu are "
+                        "supported.\n",
+                        progname, dev_path, (unsigned long long)num_blocks,
+                        STAMFS_MAX_BLOCKS_COUNT);
+                exit(1);
+        }
+        free_blocks = num_blocks - (HIGHEST_USED_BLOCK_NUM + changelog_blocks + 1);
 
         /* create the file system. */
         if (!mkstamfs(progname, dev_path, num_blocks, free_blocks))
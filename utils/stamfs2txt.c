@@ -14,7 +14,9 @@
 
 /* globals. */
 struct stamfs_super_block stamfs_sb;
-struct stamfs_inode_index stamfs_ii;
+char stamfs_ii[STAMFS_BLOCK_SIZE];
+__u32 feature_incompat = 0;
+__u32 feature_ro_compat = 0;
 
 void usage(const char* progname)
 {
@@ -69,32 +71,33 @@ int check_dev(const char* progname, const char *dev_path, int force)
  * return 1 on success, 0 on failure.
  */
 int read_stamfs_block(const char* progname, const char* dev_path, int fd,
-                      const char* block_name, int stamfs_block_num,
+                      const char* block_name, __u32 stamfs_block_num,
                       char* data, int data_len)
 {
         int rc;
-        off_t seek_pos = stamfs_block_num * STAMFS_BLOCK_SIZE;
+        off_t seek_pos = (off_t)stamfs_block_num * STAMFS_BLOCK_SIZE;
+        off_t new_pos;
 
-        rc = lseek(fd, seek_pos, SEEK_SET);
-        if (rc == -1) {
+        new_pos = lseek(fd, seek_pos, SEEK_SET);
+        if (new_pos == -1) {
                 int errnum = errno;
                 fprintf(stderr,
-                        "%s: failed seeking into position %ld of "
+                        "%s: failed seeking into position %llu of "
                         "file '%s' - %s.\n",
                         progname,
-                        seek_pos,
+                        (unsigned long long)seek_pos,
                         dev_path,
                         strerror(errnum));
                 return 0;
         }
-        if (rc != seek_pos) {
+        if (new_pos != seek_pos) {
                 fprintf(stderr,
-                        "%s: failed seeking into position %ld of file '%s' "
-                        "- lseek returned %d.\n",
+                        "%s: failed seeking into position %llu of file '%s' "
+                        "- lseek returned %llu.\n",
                         progname,
-                        seek_pos,
+                        (unsigned long long)seek_pos,
                         dev_path,
-                        rc);
+                        (unsigned long long)new_pos);
                 return 0;
         }
 
@@ -125,6 +128,7 @@ int read_stamfs_block(const char* progname, const char* dev_path, int fd,
 int read_stamfs_super_block(const char* progname, const char* dev_path, int fd)
 {
         int rc;
+        __u32 feature_compat = 0;
 
         /* we need to read from block #1. */
         rc = read_stamfs_block(progname, dev_path, fd,
@@ -133,16 +137,63 @@ int read_stamfs_super_block(const char* progname, const char* dev_path, int fd)
         if (!rc)
                 return 0;
 
+        /* older file-systems have no feature fields at all. */
+        if (stamfs_sb.s_feature_magic == STAMFS_FEATURE_MAGIC) {
+                feature_compat = stamfs_sb.s_feature_compat;
+                feature_incompat = stamfs_sb.s_feature_incompat;
+                feature_ro_compat = stamfs_sb.s_feature_ro_compat;
+        }
+
         printf("Super-block:\n");
         printf("    magic: 0x%x\n", stamfs_sb.s_magic);
+        printf("    feature_compat: 0x%x\n", feature_compat);
+        printf("    feature_incompat: 0x%x%s\n", feature_incompat,
+               (feature_incompat & STAMFS_FEATURE_INCOMPAT_LONG_NAMES ?
+                " (long_names)" : ""));
+        printf("    feature_ro_compat: 0x%x%s%s%s%s%s%s%s%s%s\n", feature_ro_compat,
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT ?
+                " (parent)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_USAGE ?
+                " (dir_usage)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_CHANGELOG ?
+                " (changelog)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_LARGE_DIR ?
+                " (large_dir)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_INDEX ?
+                " (dir_index)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_NAME_HASH ?
+                " (name_hash)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_SORTED_DIR ?
+                " (sorted_dir)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_COUNT ?
+                " (dir_count)" : ""),
+               (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS ?
+                " (inode_flags)" : ""));
         printf("    inodes_count: %d\n", stamfs_sb.s_inodes_count);
-        printf("    blocks_count: %d\n", stamfs_sb.s_blocks_count);
+        printf("    blocks_count: %u\n", stamfs_sb.s_blocks_count);
         printf("    free_inodes_count: %d\n", stamfs_sb.s_free_inodes_count);
-        printf("    free_blocks_count: %d\n", stamfs_sb.s_free_blocks_count);
+        printf("    free_blocks_count: %u\n", stamfs_sb.s_free_blocks_count);
         printf("    free_list_block_num: %d\n",
                stamfs_sb.s_free_list_block_num);
-        printf("    highest_used_block_num: %d\n",
+        printf("    highest_used_block_num: %u\n",
                stamfs_sb.s_highest_used_block_num);
+        if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_CHANGELOG) {
+                printf("    changelog_block_num: %u\n",
+                       stamfs_sb.s_changelog_block_num);
+                printf("    changelog_blocks: %u\n",
+                       stamfs_sb.s_changelog_blocks);
+                printf("    changelog_head: %u\n", stamfs_sb.s_changelog_head);
+                printf("    changelog_seq: %llu\n",
+                       (unsigned long long)stamfs_sb.s_changelog_seq |
+                       (__u64)stamfs_sb.s_changelog_seq_hi << 32);
+        }
+
+        if (feature_incompat & ~STAMFS_FEATURE_INCOMPAT_SUPP) {
+                fprintf(stderr, "%s: unsupported features (0x%x).\n",
+                        progname,
+                        feature_incompat & ~STAMFS_FEATURE_INCOMPAT_SUPP);
+                return 0;
+        }
 
         return 1;
 }
@@ -155,14 +206,15 @@ int read_stamfs_inode_index(const char* progname, const char* dev_path, int fd)
         /* we need to read from block #2. */
         rc = read_stamfs_block(progname, dev_path, fd,
                                "inode-index", STAMFS_INODES_BLOCK_NUM,
-                               (char*)&stamfs_ii, sizeof(stamfs_ii));
+                               stamfs_ii, sizeof(stamfs_ii));
         if (!rc)
                 return 0;
 
         printf("Inode-index (inode# -> block#):\n");
         for (i=0; i < STAMFS_MAX_INODE_NUM-1; ++i) {
-                if (stamfs_ii.index[i] != 0)
-                        printf("    %04d -> %06d\n", i+1, stamfs_ii.index[i]);
+                __u32 block_num = stamfs_get_block_ptr(stamfs_ii, i);
+                if (block_num != 0)
+                        printf("    %04d -> %06u\n", i+1, block_num);
 
         }
 
@@ -172,22 +224,23 @@ int read_stamfs_inode_index(const char* progname, const char* dev_path, int fd)
 int read_stamfs_free_list_block(const char* progname, const char* dev_path,
                                 int fd)
 {
-        struct stamfs_free_list_index stamfs_fl;
+        char stamfs_fl[STAMFS_BLOCK_SIZE];
         int rc;
         int i;
 
         /* we need to read from block #STAMFS_FREE_LIST_BLOCK_NUM. */
         rc = read_stamfs_block(progname, dev_path, fd,
                                "free-list", STAMFS_FREE_LIST_BLOCK_NUM,
-                               (char*)&stamfs_fl, sizeof(stamfs_fl));
+                               stamfs_fl, sizeof(stamfs_fl));
         if (!rc)
                 return 0;
 
         printf("Free-blocks-list:\n");
         for (i=0; i < STAMFS_MAX_BLOCK_NUMS_PER_BLOCK-1; ++i) {
-                if (stamfs_fl.index[i] == 0)
+                __u32 block_num = stamfs_get_block_ptr(stamfs_fl, i);
+                if (block_num == 0)
                         break;
-                printf("    %d: %06d\n", i, stamfs_fl.index[i]);
+                printf("    %d: %06u\n", i, block_num);
         }
 
         return 1;
@@ -199,10 +252,74 @@ int read_stamfs_inode(const char* progname, const char* dev_path, int fd,
                       int ino_num, const char* inode_path, int inode_ftype);
 
 
-int read_stamfs_inode_first_data_block(const char* progname,
-                                       const char* dev_path, int fd,
-                                       int ino_num, const char* inode_path,
-                                       int data_block_num)
+/* print, and recurse through, the variable-length entries of the given
+ * directory data block (STAMFS_FEATURE_INCOMPAT_LONG_NAMES). */
+int read_stamfs_inode_dir_entries(const char* progname,
+                                  const char* dev_path, int fd,
+                                  const char* buf)
+{
+        struct stamfs_dir_entry* stamfs_de;
+        unsigned int offset;
+        int pass;
+
+        /* first print the entries, then recurse through them. */
+        for (pass = 0; pass < 2; pass++) {
+                for (offset = 0; offset < STAMFS_BLOCK_SIZE;
+                     offset += stamfs_de->de_rec_len) {
+                        char dir_name_str[STAMFS_MAX_LONG_FNAME_LEN+1];
+
+                        stamfs_de = (struct stamfs_dir_entry*)(buf + offset);
+                        if (stamfs_de->de_rec_len < STAMFS_DIR_ENTRY_LEN(0) ||
+                            (stamfs_de->de_rec_len & 3) ||
+                            offset + stamfs_de->de_rec_len > STAMFS_BLOCK_SIZE) {
+                                fprintf(stderr, "%s: corrupt directory entry "
+                                        "at offset %u, rec_len=%u.\n",
+                                        progname, offset,
+                                        stamfs_de->de_rec_len);
+                                return 0;
+                        }
+                        if (stamfs_de->de_ino == 0)
+                                continue;
+                        memcpy(dir_name_str,
+                               stamfs_de->de_name,
+                               stamfs_de->de_name_len);
+                        dir_name_str[stamfs_de->de_name_len] = '\0';
+
+                        if (pass == 0) {
+                                printf("        Entry at %u:\n", offset);
+                                printf("            inode: %u\n",
+                                       stamfs_de->de_ino);
+                                printf("            rec_len: %u\n",
+                                       stamfs_de->de_rec_len);
+                                printf("            namelen: %d\n",
+                                       stamfs_de->de_name_len);
+                                printf("            name: '%s'\n",
+                                       dir_name_str);
+                                printf("            ftype: %d\n",
+                                       stamfs_de->de_ftype);
+                                if (feature_ro_compat &
+                                    STAMFS_FEATURE_RO_COMPAT_NAME_HASH)
+                                        printf("            hash: 0x%x\n",
+                                               *(__u32*)((char*)stamfs_de +
+                                                 STAMFS_DIR_ENTRY_LEN(
+                                                   stamfs_de->de_name_len)));
+                        }
+                        /* recurse */
+                        else if (!read_stamfs_inode(progname, dev_path, fd,
+                                                    stamfs_de->de_ino,
+                                                    dir_name_str,
+                                                    stamfs_de->de_ftype))
+                                return 0;
+                }
+        }
+
+        return 1;
+}
+
+int read_stamfs_inode_dir_data_block(const char* progname,
+                                     const char* dev_path, int fd,
+                                     int ino_num, const char* inode_path,
+                                     int block_offset, __u32 data_block_num)
 {
         char buf[STAMFS_BLOCK_SIZE];
         struct stamfs_dir_rec* stamfs_dr;
@@ -210,7 +327,7 @@ int read_stamfs_inode_first_data_block(const char* progname,
         int i;
         char block_name[1024];
 
-        sprintf(block_name, "data block of inode %d", ino_num);
+        sprintf(block_name, "data block %d of inode %d", block_offset, ino_num);
 
         /* we need to read from block #data_block_num. */
         rc = read_stamfs_block(progname, dev_path, fd,
@@ -219,10 +336,14 @@ int read_stamfs_inode_first_data_block(const char* progname,
         if (!rc)
                 return 0;
 
-        printf("    Entries:\n");
+        printf("    Entries (data block %d):\n", block_offset);
+        if (feature_incompat & STAMFS_FEATURE_INCOMPAT_LONG_NAMES)
+                return read_stamfs_inode_dir_entries(progname, dev_path, fd,
+                                                     buf);
+
         stamfs_dr = (struct stamfs_dir_rec*)buf;
         for (i=0 ;
-             ((char*)stamfs_dr) < buf + STAMFS_BLOCK_SIZE;
+             i < STAMFS_DIR_RECS_PER_BLOCK;
              stamfs_dr++,i++) {
                 char dir_name_str[STAMFS_MAX_FNAME_LEN+1];
                 if (stamfs_dr->dr_ino == 0)
@@ -239,18 +360,20 @@ int read_stamfs_inode_first_data_block(const char* progname,
                 printf("            namelen: %d\n", stamfs_dr->dr_name_len);
                 printf("            name: '%s'\n", dir_name_str);
                 printf("            ftype: %d\n", stamfs_dr->dr_ftype);
+                if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_NAME_HASH)
+                        printf("            hash: 0x%x\n", stamfs_dr->dr_hash);
         }
 
         /* recurse through the dir structure. */
         stamfs_dr = (struct stamfs_dir_rec*)buf;
         for (i=0 ;
-             ((char*)stamfs_dr) < buf + STAMFS_BLOCK_SIZE;
+             i < STAMFS_DIR_RECS_PER_BLOCK;
              stamfs_dr++,i++) {
                 char dir_name_str[STAMFS_MAX_FNAME_LEN+1];
                 if (stamfs_dr->dr_ino == 0)
                         break;
                 if (stamfs_dr->dr_ino == STAMFS_FREE_DIR_REC_MARKER)
-                        break;
+                        continue;
                 memcpy(dir_name_str,
                        stamfs_dr->dr_name,
                        stamfs_dr->dr_name_len);
@@ -266,12 +389,45 @@ int read_stamfs_inode_first_data_block(const char* progname,
         return 1;
 }
 
+int read_stamfs_inode_dx_root(const char* progname, const char* dev_path,
+                              int fd, int ino_num, __u32 data_block_num)
+{
+        char buf[STAMFS_BLOCK_SIZE];
+        struct stamfs_dx_root* stamfs_dx = (struct stamfs_dx_root*)buf;
+        int rc;
+        int i;
+        char block_name[1024];
+
+        sprintf(block_name, "index root of inode %d", ino_num);
+
+        /* we need to read from block #data_block_num. */
+        rc = read_stamfs_block(progname, dev_path, fd,
+                               block_name, data_block_num,
+                               (char*)buf, sizeof(buf));
+        if (!rc)
+                return 0;
+
+        printf("    Index (data block 0):\n");
+        for (i = 0;
+             i < stamfs_dx->dx_count && i < STAMFS_DX_ENTRIES_PER_ROOT;
+             i++)
+                printf("        hash 0x%08x: data block %u\n",
+                       stamfs_dx->dx_entries[i].de_hash,
+                       stamfs_dx->dx_entries[i].de_block);
+
+        return 1;
+}
+
 int read_stamfs_inode_block_index(const char* progname, const char* dev_path,
                                   int fd, int ino_num, const char* inode_path,
-                                  int inode_ftype, int index_block_num)
+                                  int inode_ftype, __u32 index_block_num,
+                                  __u32 size, __u32 inode_flags)
 {
-        struct stamfs_inode_block_index stamfs_bi;
+        char stamfs_bi[STAMFS_BLOCK_SIZE];
+        __u32 first_block_num;
+        int num_blocks = size / STAMFS_BLOCK_SIZE;
         int rc;
+        int i;
         char block_name[1024];
 
         sprintf(block_name, "block index of inode %d", ino_num);
@@ -279,26 +435,41 @@ int read_stamfs_inode_block_index(const char* progname, const char* dev_path,
         /* we need to read from block #index_block_num. */
         rc = read_stamfs_block(progname, dev_path, fd,
                                "super-block", index_block_num,
-                               (char*)&stamfs_bi, sizeof(stamfs_bi));
+                               stamfs_bi, sizeof(stamfs_bi));
         if (!rc)
                 return 0;
 
-        printf("    1st_data_block_num: %d\n", stamfs_bi.index[0]);
+        first_block_num = stamfs_get_block_ptr(stamfs_bi, 0);
+        printf("    1st_data_block_num: %u\n", first_block_num);
 
-        if (inode_ftype == STAMFS_DIR_REC_FTYPE_DIR)
-                return read_stamfs_inode_first_data_block(progname, dev_path,
-                                                          fd, ino_num,
-                                                          inode_path,
-                                                          stamfs_bi.index[0]);
-        else
+        if (inode_ftype != STAMFS_DIR_REC_FTYPE_DIR)
                 return 1;
+
+        /* a directory may span several data blocks. */
+        for (i = 0; i < num_blocks && i < STAMFS_MAX_BLOCKS_PER_FILE; i++) {
+                __u32 data_block_num = stamfs_get_block_ptr(stamfs_bi, i);
+                if (i == 0 && (inode_flags & STAMFS_INODE_FL_INDEX)) {
+                        if (!read_stamfs_inode_dx_root(progname, dev_path, fd,
+                                                       ino_num,
+                                                       data_block_num))
+                                return 0;
+                        continue;
+                }
+                if (!read_stamfs_inode_dir_data_block(progname, dev_path,
+                                                      fd, ino_num,
+                                                      inode_path, i,
+                                                      data_block_num))
+                        return 0;
+        }
+
+        return 1;
 }
 
 int read_stamfs_inode(const char* progname, const char* dev_path, int fd,
                       int ino_num, const char* inode_path, int inode_ftype)
 {
         struct stamfs_inode stamfs_ino;
-        int inode_block_num = stamfs_ii.index[ino_num-1];
+        __u32 inode_block_num = stamfs_get_block_ptr(stamfs_ii, ino_num-1);
         int rc;
         char block_name[1024];
 
@@ -310,22 +481,51 @@ int read_stamfs_inode(const char* progname, const char* dev_path, int fd,
                                (char*)&stamfs_ino, sizeof(stamfs_ino));
         if (!rc)
                 return 0;
+        /* without the feature, these fields may hold leftovers. */
+        if (!(feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_INODE_FLAGS)) {
+                stamfs_ino.i_flags = 0;
+                stamfs_ino.i_dir_free_block = 0;
+                stamfs_ino.i_dir_entries = 0;
+        }
 
         printf("Inode '%s' (%d):\n", inode_path, ino_num);
         printf("    mode: %o\n", stamfs_ino.i_mode);
         printf("    uid: %d\n", stamfs_ino.i_uid);
         printf("    gid: %d\n", stamfs_ino.i_gid);
-        printf("    size: %d\n", stamfs_ino.i_size);
+        printf("    size: %u\n", stamfs_ino.i_size);
         printf("    atime: %u\n", stamfs_ino.i_atime);
         printf("    mtime: %u\n", stamfs_ino.i_mtime);
         printf("    ctime: %u\n", stamfs_ino.i_ctime);
         printf("    num_blocks: %d\n", stamfs_ino.i_num_blocks);
         printf("    num_links: %d\n", stamfs_ino.i_num_links);
-        printf("    index_block_num: %d\n", stamfs_ino.i_index_block);
+        printf("    index_block_num: %u\n", stamfs_ino.i_index_block);
+        printf("    flags: 0x%x%s%s%s%s\n", stamfs_ino.i_flags,
+               (stamfs_ino.i_flags & STAMFS_INODE_FL_SEALED ? " (sealed)" : ""),
+               (stamfs_ino.i_flags & STAMFS_INODE_FL_INDEX ? " (index)" : ""),
+               (stamfs_ino.i_flags & STAMFS_INODE_FL_SORTED ? " (sorted)" : ""),
+               (stamfs_ino.i_flags & STAMFS_INODE_FL_COUNTED ? " (counted)" : ""));
+        if (S_ISDIR(stamfs_ino.i_mode))
+                printf("    dir_free_block: %u\n", stamfs_ino.i_dir_free_block);
+        if ((feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_COUNT) &&
+            (stamfs_ino.i_flags & STAMFS_INODE_FL_COUNTED))
+                printf("    dir_entries: %u\n", stamfs_ino.i_dir_entries);
+        if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_PARENT)
+                printf("    parent_ino: %u\n", stamfs_ino.i_parent_ino);
+        if (feature_ro_compat & STAMFS_FEATURE_RO_COMPAT_DIR_USAGE) {
+                printf("    tree_bytes: %llu\n",
+                       (unsigned long long)stamfs_ino.i_tree_bytes |
+                       (unsigned long long)stamfs_ino.i_tree_bytes_hi << 32);
+                printf("    tree_blocks: %llu\n",
+                       (unsigned long long)stamfs_ino.i_tree_blocks |
+                       (unsigned long long)stamfs_ino.i_tree_blocks_hi << 32);
+                printf("    tree_inodes: %u\n", stamfs_ino.i_tree_inodes);
+        }
 
         return read_stamfs_inode_block_index(progname, dev_path, fd,
                                              ino_num, inode_path, inode_ftype,
-                                             stamfs_ino.i_index_block);
+                                             stamfs_ino.i_index_block,
+                                             stamfs_ino.i_size,
+                                             stamfs_ino.i_flags);
 }
 
 int stamfs2txt(const char* progname, const char* dev_path)
@@ -0,0 +1,84 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s [-d] <path>\n"
+                        "  <path> is any file on the STAMFS file-system.\n"
+                        "  prints the statistics of the mount's meta-data "
+                        "cache, after dropping\n"
+                        "  the whole cache with -d.\n",
+                progname);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        struct stamfs_cache_stats stats;
+        int drop = 0;
+        int fd;
+        int c;
+
+        /* parse command-line options. */
+        while ((c = getopt(argc, argv, "d")) != -1) {
+                switch (c) {
+                case 'd':
+                        drop = 1;
+                        break;
+                default:
+                        usage(progname);
+                }
+        }
+
+        if (optind != argc - 1)
+                usage(progname);
+
+        fd = open(argv[optind], O_RDONLY);
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, argv[optind], strerror(errnum));
+                return 1;
+        }
+
+        if (drop && ioctl(fd, STAMFS_IOC_DROP_CACHE) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot drop the cache - %s.\n",
+                        progname, strerror(errnum));
+                close(fd);
+                return 1;
+        }
+
+        if (ioctl(fd, STAMFS_IOC_GET_CACHE_STATS, &stats) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot get the cache statistics - %s.\n",
+                        progname, strerror(errnum));
+                close(fd);
+                return 1;
+        }
+        close(fd);
+
+        printf("entries: %u\n", stats.cs_entries);
+        printf("limit: %u\n", stats.cs_limit);
+        printf("hits: %llu\n", (unsigned long long)stats.cs_hits);
+        printf("misses: %llu\n", (unsigned long long)stats.cs_misses);
+        printf("evictions: %llu\n", (unsigned long long)stats.cs_evictions);
+
+        return 0;
+}
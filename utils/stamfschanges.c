@@ -0,0 +1,115 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s <path> [<sequence-number>]\n"
+                        "  <path> is any file on the STAMFS file-system.\n"
+                        "  prints the changes logged from the given sequence "
+                        "number on (default: 1),\n"
+                        "  followed by the sequence number to continue from.\n",
+                progname);
+        exit(1);
+}
+
+/* the name of a change log operation. */
+const char* change_op_name(__u32 op)
+{
+        switch (op) {
+        case STAMFS_CHANGE_CREATE:
+                return "create";
+        case STAMFS_CHANGE_UNLINK:
+                return "unlink";
+        case STAMFS_CHANGE_WRITE:
+                return "write";
+        case STAMFS_CHANGE_TRUNCATE:
+                return "truncate";
+        default:
+                return "unknown";
+        }
+}
+
+/* print all the changes logged from the given sequence number on.
+ * returns 1 on success, 0 on failure.
+ */
+int print_changes(const char* progname, int fd, __u64 seq)
+{
+        struct stamfs_changes changes;
+        __u32 i;
+
+        do {
+                memset(&changes, 0, sizeof(changes));
+                changes.sc_seq = seq;
+                if (ioctl(fd, STAMFS_IOC_READ_CHANGES, &changes) == -1) {
+                        int errnum = errno;
+                        fprintf(stderr,
+                                "%s: cannot read the change log - %s.\n",
+                                progname, strerror(errnum));
+                        return 0;
+                }
+                if (changes.sc_oldest_seq > seq)
+                        fprintf(stderr,
+                                "%s: changes %llu to %llu were dropped from "
+                                "the log.\n",
+                                progname, (unsigned long long)seq,
+                                (unsigned long long)changes.sc_oldest_seq - 1);
+
+                for (i = 0; i < changes.sc_count; i++)
+                        printf("%llu\t%u\t%s\n",
+                               (unsigned long long)changes.sc_changes[i].sc_seq,
+                               changes.sc_changes[i].sc_ino,
+                               change_op_name(changes.sc_changes[i].sc_op));
+                seq = changes.sc_seq;
+        } while (changes.sc_count == STAMFS_CHANGES_MAX);
+
+        printf("next: %llu\n", (unsigned long long)seq);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        __u64 seq = 1;
+        char* end = NULL;
+        int rc;
+        int fd;
+
+        if (argc < 2 || argc > 3)
+                usage(progname);
+
+        if (argc == 3) {
+                seq = strtoull(argv[2], &end, 0);
+                if (*argv[2] == '\0' || *end != '\0') {
+                        fprintf(stderr, "%s: invalid sequence number '%s'.\n",
+                                progname, argv[2]);
+                        return 1;
+                }
+        }
+
+        fd = open(argv[1], O_RDONLY);
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, argv[1], strerror(errnum));
+                return 1;
+        }
+
+        rc = print_changes(progname, fd, seq);
+        close(fd);
+
+        return rc ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s <dir> [<dir> ...]\n"
+                        "  compacts the directories - packs their entries, "
+                        "dropping removed\n"
+                        "  entries, and frees the empty blocks at their end.\n",
+                progname);
+        exit(1);
+}
+
+/* compact the given directory.
+ * returns 1 on success, 0 on failure.
+ */
+int compact_dir(const char* progname, const char* path)
+{
+        int fd = open(path, O_RDONLY);
+
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                return 0;
+        }
+
+        if (ioctl(fd, STAMFS_IOC_COMPACT_DIR) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot compact '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                close(fd);
+                return 0;
+        }
+        close(fd);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        int rc = 0;
+        int i;
+
+        if (argc < 2)
+                usage(progname);
+
+        for (i = 1; i < argc; i++) {
+                if (!compact_dir(progname, argv[i]))
+                        rc = 1;
+        }
+
+        return rc;
+}
@@ -0,0 +1,74 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s <path> [<path> ...]\n", progname);
+        exit(1);
+}
+
+/* print the usage of the subtree rooted at the given path, as maintained by
+ * the file-system.
+ * returns 1 on success, 0 on failure.
+ */
+int print_usage(const char* progname, const char* path)
+{
+        struct stamfs_usage su;
+        int fd = open(path, O_RDONLY);
+
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                return 0;
+        }
+
+        if (ioctl(fd, STAMFS_IOC_GET_USAGE, &su) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot get the usage of '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                close(fd);
+                return 0;
+        }
+        close(fd);
+
+        printf("%llu\t%llu\t%llu\t%s\n",
+               (unsigned long long)su.su_bytes,
+               (unsigned long long)su.su_blocks,
+               (unsigned long long)su.su_inodes,
+               path);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        int rc = 0;
+        int i;
+
+        if (argc < 2)
+                usage(progname);
+
+        printf("bytes\tblocks\tinodes\tpath\n");
+        for (i = 1; i < argc; i++) {
+                if (!print_usage(progname, argv[i]))
+                        rc = 1;
+        }
+
+        return rc;
+}
@@ -0,0 +1,116 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s <dir> [<dir> ...]\n"
+                        "  lists the entries of the directories, with the "
+                        "attributes of their\n"
+                        "  inodes (mode, links, owner, size, blocks, "
+                        "modification time).\n",
+                progname);
+        exit(1);
+}
+
+/* print the given entry. */
+void print_entry(const struct stamfs_direntplus *dp)
+{
+        char mtime[32];
+        time_t t = dp->dp_mtime;
+
+        strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", localtime(&t));
+        printf("%7u %06o %3u %5u %5u %10llu %6u %s %s\n",
+               dp->dp_ino, dp->dp_mode, dp->dp_nlink,
+               dp->dp_uid, dp->dp_gid,
+               (unsigned long long)dp->dp_size, dp->dp_blocks,
+               mtime, dp->dp_name);
+}
+
+/* list the given directory.
+ * returns 1 on success, 0 on failure.
+ */
+int list_dir(const char* progname, const char* path)
+{
+        struct stamfs_readdirplus rp;
+        char *buf;
+        unsigned int pos;
+        unsigned int i;
+        int fd;
+
+        buf = malloc(STAMFS_READDIRPLUS_MAX_LEN);
+        if (!buf) {
+                fprintf(stderr, "%s: out of memory.\n", progname);
+                return 0;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                free(buf);
+                return 0;
+        }
+
+        do {
+                memset(&rp, 0, sizeof(rp));
+                rp.rp_buf = (unsigned long)buf;
+                rp.rp_buf_len = STAMFS_READDIRPLUS_MAX_LEN;
+                if (ioctl(fd, STAMFS_IOC_READDIRPLUS, &rp) == -1) {
+                        int errnum = errno;
+                        fprintf(stderr,
+                                "%s: cannot list '%s' - %s.\n",
+                                progname, path, strerror(errnum));
+                        close(fd);
+                        free(buf);
+                        return 0;
+                }
+
+                pos = 0;
+                for (i = 0; i < rp.rp_count; i++) {
+                        struct stamfs_direntplus *dp =
+                                (struct stamfs_direntplus *)(buf + pos);
+
+                        print_entry(dp);
+                        pos += dp->dp_reclen;
+                }
+        } while (rp.rp_count > 0);
+
+        close(fd);
+        free(buf);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        int rc = 0;
+        int i;
+
+        if (argc < 2)
+                usage(progname);
+
+        for (i = 1; i < argc; i++) {
+                if (argc > 2)
+                        printf("%s%s:\n", (i > 1 ? "\n" : ""), argv[i]);
+                if (!list_dir(progname, argv[i]))
+                        rc = 1;
+        }
+
+        return rc;
+}
@@ -0,0 +1,82 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s <path> <inode-number> [<inode-number> ...]\n"
+                        "  <path> is any file on the STAMFS file-system.\n",
+                progname);
+        exit(1);
+}
+
+/* print the path of the inode with the given number, as rebuilt by the
+ * file-system from the inodes' parent pointers.
+ * returns 1 on success, 0 on failure.
+ */
+int print_path(const char* progname, int fd, const char* ino_str)
+{
+        struct stamfs_path sp;
+        unsigned long ino_num;
+        char* end = NULL;
+
+        ino_num = strtoul(ino_str, &end, 0);
+        if (*ino_str == '\0' || *end != '\0' || ino_num > 0xffffffffUL) {
+                fprintf(stderr, "%s: invalid inode number '%s'.\n",
+                        progname, ino_str);
+                return 0;
+        }
+
+        memset(&sp, 0, sizeof(sp));
+        sp.sp_ino = ino_num;
+        if (ioctl(fd, STAMFS_IOC_GET_PATH, &sp) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot get the path of inode %lu - %s.\n",
+                        progname, ino_num, strerror(errnum));
+                return 0;
+        }
+
+        printf("%lu\t%s\n", ino_num, sp.sp_path);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        int rc = 0;
+        int fd;
+        int i;
+
+        if (argc < 3)
+                usage(progname);
+
+        fd = open(argv[1], O_RDONLY);
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, argv[1], strerror(errnum));
+                return 1;
+        }
+
+        for (i = 2; i < argc; i++) {
+                if (!print_path(progname, fd, argv[i]))
+                        rc = 1;
+        }
+        close(fd);
+
+        return rc;
+}
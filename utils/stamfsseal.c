@@ -0,0 +1,94 @@
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "stamfs.h"
+
+/* print usage information and exit. */
+void usage(const char* progname)
+{
+        fprintf(stderr, "Usage: %s [-u] <file> [<file> ...]\n"
+                        "  seals the files (makes them immutable, and lays "
+                        "out their blocks\n"
+                        "  contiguously), or unseals them with -u. sealing "
+                        "a directory sorts\n"
+                        "  its entries by name, until they change, and -u "
+                        "drops the order.\n",
+                progname);
+        exit(1);
+}
+
+/* seal or unseal the given file.
+ * returns 1 on success, 0 on failure.
+ */
+int seal_file(const char* progname, const char* path, int unseal)
+{
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        int request;
+
+        if (fd == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: failed opening '%s' - %s.\n",
+                        progname, path, strerror(errnum));
+                return 0;
+        }
+
+        /* a directory is sorted, rather than sealed. */
+        if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+                request = (unseal ? STAMFS_IOC_UNSORT_DIR : STAMFS_IOC_SORT_DIR);
+        else
+                request = (unseal ? STAMFS_IOC_UNSEAL : STAMFS_IOC_SEAL);
+
+        if (ioctl(fd, request) == -1) {
+                int errnum = errno;
+                fprintf(stderr,
+                        "%s: cannot %s '%s' - %s.\n",
+                        progname, unseal ? "unseal" : "seal", path,
+                        strerror(errnum));
+                close(fd);
+                return 0;
+        }
+        close(fd);
+
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        const char* progname = argv[0];
+        int unseal = 0;
+        int rc = 0;
+        int c;
+        int i;
+
+        /* parse command-line options. */
+        while ((c = getopt(argc, argv, "u")) != -1) {
+                switch (c) {
+                case 'u':
+                        unseal = 1;
+                        break;
+                default:
+                        usage(progname);
+                }
+        }
+
+        if (optind >= argc)
+                usage(progname);
+
+        for (i = optind; i < argc; i++) {
+                if (!seal_file(progname, argv[i], unseal))
+                        rc = 1;
+        }
+
+        return rc;
+}